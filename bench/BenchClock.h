@@ -0,0 +1,34 @@
+/*
+ BenchClock.h - Cycle counter shared by the benchmarks.
+*/
+
+#ifndef BenchClock_h
+#define BenchClock_h
+
+#include <stdint.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+// CPU cycles where the TSC is available, nanoseconds elsewhere
+static inline uint64_t BenchClock_cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+// Wall clock in nanoseconds
+static inline uint64_t BenchClock_nanos(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+#endif
@@ -0,0 +1,223 @@
+/*
+ FakeBroker.c - Scripted broker stand-in for the benchmarks.
+*/
+
+#include "FakeBroker.h"
+#include "PubSubClient.h"
+#include <string.h>
+
+/******************************************************************************
+ * Private Function Prototypes
+ *****************************************************************************/
+static void   answer    (FakeBroker_t* self, uint8_t header, const uint8_t* body, size_t length);
+static void   handle    (FakeBroker_t* self);
+static void   feed      (FakeBroker_t* self, const uint8_t* buf, size_t size);
+static int    connectIP (Client_t* self, IPAddress_t ip, uint16_t port);
+static int    connectHost(Client_t* self, const char* host, uint16_t port);
+static size_t write     (Client_t* self, uint8_t b);
+static size_t writeMulti(Client_t* self, const uint8_t* buf, size_t size);
+static size_t writeVec  (Client_t* self, const struct iovec* iov, int count);
+
+/******************************************************************************
+ * Private Function Implementation
+ *****************************************************************************/
+static void answer(FakeBroker_t* self, uint8_t header, const uint8_t* body, size_t length)
+{
+    uint8_t head[5];
+    uint8_t pos = 0;
+    head[pos++] = header;
+    pos += PubSub_encodeLength(&head[pos], (uint32_t)length);
+    if (self->loop.rxSize - (self->loop.rxTail - self->loop.rxHead) < pos + length)
+    {
+        self->dropped++;
+        return;
+    }
+    LoopbackClient_push(&self->loop, head, pos);
+    LoopbackClient_push(&self->loop, body, length);
+}
+
+// answers the packet that has just been received in full
+static void handle(FakeBroker_t* self)
+{
+    uint8_t type = self->header[0] & 0xF0;
+    uint8_t qos = (self->header[0] & 0x06) >> 1;
+    const uint8_t* body = self->packet;
+    size_t kept = self->packetPos;
+    uint8_t reply[4];
+
+    if (type == MQTTCONNECT)
+    {
+        reply[0] = 0;
+        reply[1] = 0;
+        self->connects++;
+        answer(self, MQTTCONNACK, reply, 2);
+    }
+    else if ((type == MQTTSUBSCRIBE) && (kept >= 2))
+    {
+        // message id followed by one granted QoS per topic filter
+        uint8_t granted[MQTT_MAX_PACKET_SIZE];
+        size_t count = 2;
+        size_t pos = 2;
+        granted[0] = body[0];
+        granted[1] = body[1];
+        while ((pos + 2 < kept) && (count < sizeof(granted)))
+        {
+            pos += 2 + ((body[pos] << 8) | body[pos + 1]);
+            if (pos < kept)
+            {
+                granted[count++] = body[pos++] & 0x03;
+            }
+        }
+        self->subscribes++;
+        answer(self, MQTTSUBACK, granted, count);
+    }
+    else if ((type == MQTTUNSUBSCRIBE) && (kept >= 2))
+    {
+        answer(self, MQTTUNSUBACK, body, 2);
+    }
+    else if (type == MQTTPINGREQ)
+    {
+        self->pings++;
+        answer(self, MQTTPINGRESP, NULL, 0);
+    }
+    else if (type == MQTTPUBLISH)
+    {
+        self->publishes++;
+        self->publishBytes += self->length;
+        size_t topicEnd = (kept >= 2) ? 2 + ((body[0] << 8) | body[1]) : kept;
+        if ((qos > 0) && (topicEnd + 2 <= kept))
+        {
+            answer(self, (qos == 1) ? MQTTPUBACK : MQTTPUBREC, &body[topicEnd], 2);
+        }
+        if (self->echo && (kept == self->length) && (topicEnd <= kept))
+        {
+            // Back as QoS 0: the topic, then the payload without the message id
+            size_t skip = (qos > 0) ? 2 : 0;
+            memmove(&self->packet[topicEnd], &self->packet[topicEnd + skip], kept - topicEnd - skip);
+            answer(self, MQTTPUBLISH, body, kept - skip);
+        }
+    }
+    else if ((type == MQTTPUBREL) && (kept >= 2))
+    {
+        answer(self, MQTTPUBCOMP, body, 2);
+    }
+    else if (type == MQTTDISCONNECT)
+    {
+        self->loop.connected = 0;
+    }
+}
+
+// runs the bytes the library wrote through the packet parser
+static void feed(FakeBroker_t* self, const uint8_t* buf, size_t size)
+{
+    while (size > 0)
+    {
+        if (!self->inBody)
+        {
+            self->header[self->headerLength++] = *buf++;
+            size--;
+            if (self->headerLength < 2)
+            {
+                continue;
+            }
+            int used = PubSub_decodeLength(&self->header[1], self->headerLength - 1, &self->length);
+            if (used == 0)
+            {
+                continue;
+            }
+            if (used < 0)
+            {
+                // Not MQTT: resynchronise on the next byte
+                self->headerLength = 0;
+                continue;
+            }
+            self->packetPos = 0;
+            self->remaining = self->length;
+            self->inBody = 1;
+        }
+        else
+        {
+            size_t chunk = (size < self->remaining) ? size : self->remaining;
+            size_t keep = self->packetSize - self->packetPos;
+            if (keep > chunk)
+            {
+                keep = chunk;
+            }
+            memcpy(&self->packet[self->packetPos], buf, keep);
+            self->packetPos += keep;
+            // The rest is still read once, as a socket write copies it
+            for (; keep < chunk; keep++)
+            {
+                self->checksum += buf[keep];
+            }
+            self->remaining -= chunk;
+            buf += chunk;
+            size -= chunk;
+        }
+        if (self->remaining == 0)
+        {
+            handle(self);
+            self->headerLength = 0;
+            self->inBody = 0;
+        }
+    }
+}
+
+static int connectIP(Client_t* self, IPAddress_t ip, uint16_t port)
+{
+    FakeBroker_t* fb = (FakeBroker_t*)self;
+    fb->loop.connected = 1;
+    fb->headerLength = 0;
+    fb->inBody = 0;
+    return 1;
+}
+
+static int connectHost(Client_t* self, const char* host, uint16_t port)
+{
+    return connectIP(self, NULL, port);
+}
+
+static size_t write(Client_t* self, uint8_t b)
+{
+    feed((FakeBroker_t*)self, &b, 1);
+    return 1;
+}
+
+static size_t writeMulti(Client_t* self, const uint8_t* buf, size_t size)
+{
+    feed((FakeBroker_t*)self, buf, size);
+    return size;
+}
+
+static size_t writeVec(Client_t* self, const struct iovec* iov, int count)
+{
+    size_t size = 0;
+    int i;
+    for (i = 0; i < count; i++)
+    {
+        feed((FakeBroker_t*)self, (const uint8_t*)iov[i].iov_base, iov[i].iov_len);
+        size += iov[i].iov_len;
+    }
+    return size;
+}
+
+/******************************************************************************
+ * Function implementation
+ *****************************************************************************/
+void FakeBroker_init(FakeBroker_t* self, uint8_t* rx, size_t rxSize, uint8_t* packet, size_t packetSize)
+{
+    memset(self, 0, sizeof(*self));
+    LoopbackClient_init(&self->loop, rx, rxSize);
+    self->loop.base.connectIP   = connectIP;
+    self->loop.base.connectHost = connectHost;
+    self->loop.base.write       = write;
+    self->loop.base.writeMulti  = writeMulti;
+    self->loop.base.writeVec    = writeVec;
+    self->packet = packet;
+    self->packetSize = packetSize;
+}
+
+size_t FakeBroker_push(FakeBroker_t* self, const uint8_t* buf, size_t size)
+{
+    return LoopbackClient_push(&self->loop, buf, size);
+}
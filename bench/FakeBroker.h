@@ -0,0 +1,45 @@
+/*
+ FakeBroker.h - Scripted broker stand-in for the benchmarks.
+
+ A LoopbackClient_t whose write side parses the packets the library sends
+ and queues the answers a broker would give: CONNACK for CONNECT, SUBACK for
+ SUBSCRIBE, UNSUBACK for UNSUBSCRIBE, PINGRESP for PINGREQ, PUBACK/PUBREC for
+ QoS 1/2 PUBLISH and PUBCOMP for PUBREL. With echo set, every PUBLISH is also
+ sent back as QoS 0. Body bytes past the packet buffer are added up in
+ checksum, so that every byte written is read once, as a real transport's
+ copy would.
+*/
+
+#ifndef FakeBroker_h
+#define FakeBroker_h
+
+#include "LoopbackClient.h"
+
+typedef struct
+{
+    LoopbackClient_t loop;
+    uint8_t* packet;        // packet being received from the library
+    size_t packetSize;
+    size_t packetPos;       // bytes kept in packet
+    uint8_t header[5];      // fixed header being received
+    uint8_t headerLength;
+    uint8_t inBody;         // header complete, body bytes being received
+    uint32_t remaining;     // body bytes still to come, once the header is known
+    uint32_t length;        // body length of the current packet
+    uint8_t echo;
+    unsigned long connects;
+    unsigned long subscribes;
+    unsigned long pings;
+    unsigned long publishes;
+    unsigned long dropped;  // answers that did not fit the receive buffer
+    size_t publishBytes;
+    uint32_t checksum;      // sum of the body bytes not kept in packet
+} FakeBroker_t;
+
+// rx holds the answers until the library reads them, packet the body of the
+// packet the library is sending (longer bodies are summed, not kept)
+void   FakeBroker_init  (FakeBroker_t* self, uint8_t* rx, size_t rxSize, uint8_t* packet, size_t packetSize);
+// queues bytes for the library as if the broker had sent them
+size_t FakeBroker_push  (FakeBroker_t* self, const uint8_t* buf, size_t size);
+
+#endif
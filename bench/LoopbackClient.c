@@ -0,0 +1,151 @@
+/*
+ LoopbackClient.c - In-memory Client_t used by the benchmarks.
+
+ Bytes pushed into the receive buffer are handed to the library as if they
+ arrived from the network; everything the library writes is counted and
+ dropped.
+*/
+
+#include "LoopbackClient.h"
+#include <string.h>
+
+/******************************************************************************
+ * Private Function Implementation
+ *****************************************************************************/
+static int connectIP(Client_t* self, IPAddress_t ip, uint16_t port)
+{
+    ((LoopbackClient_t*)self)->connected = 1;
+    return 1;
+}
+
+static int connectHost(Client_t* self, const char* host, uint16_t port)
+{
+    ((LoopbackClient_t*)self)->connected = 1;
+    return 1;
+}
+
+static uint8_t connected(Client_t* self)
+{
+    return ((LoopbackClient_t*)self)->connected;
+}
+
+static size_t writeMulti(Client_t* self, const uint8_t* buf, size_t size)
+{
+    LoopbackClient_t* lb = (LoopbackClient_t*)self;
+    lb->txBytes += size;
+    lb->txCalls++;
+    return size;
+}
+
+static size_t writeVec(Client_t* self, const struct iovec* iov, int count)
+{
+    LoopbackClient_t* lb = (LoopbackClient_t*)self;
+    size_t size = 0;
+    int i;
+    for (i = 0; i < count; i++)
+    {
+        size += iov[i].iov_len;
+    }
+    lb->txBytes += size;
+    lb->txCalls++;
+    return size;
+}
+
+static size_t write(Client_t* self, uint8_t b)
+{
+    return writeMulti(self, &b, 1);
+}
+
+static int available(Client_t* self)
+{
+    LoopbackClient_t* lb = (LoopbackClient_t*)self;
+    return (int)(lb->rxTail - lb->rxHead);
+}
+
+static int read(Client_t* self)
+{
+    LoopbackClient_t* lb = (LoopbackClient_t*)self;
+    if (lb->rxHead == lb->rxTail)
+    {
+        return -1;
+    }
+    return lb->rx[lb->rxHead++];
+}
+
+static int readMulti(Client_t* self, uint8_t* buf, size_t size)
+{
+    LoopbackClient_t* lb = (LoopbackClient_t*)self;
+    size_t avail = lb->rxTail - lb->rxHead;
+    if (size > avail)
+    {
+        size = avail;
+    }
+    memcpy(buf, &lb->rx[lb->rxHead], size);
+    lb->rxHead += size;
+    return (int)size;
+}
+
+static int peek(Client_t* self)
+{
+    LoopbackClient_t* lb = (LoopbackClient_t*)self;
+    if (lb->rxHead == lb->rxTail)
+    {
+        return -1;
+    }
+    return lb->rx[lb->rxHead];
+}
+
+static void flush(Client_t* self)
+{
+}
+
+static void stop(Client_t* self)
+{
+    ((LoopbackClient_t*)self)->connected = 0;
+}
+
+/******************************************************************************
+ * Function implementation
+ *****************************************************************************/
+void LoopbackClient_init(LoopbackClient_t* self, uint8_t* rx, size_t rxSize)
+{
+    memset(self, 0, sizeof(*self));
+    self->base.connectIP   = connectIP;
+    self->base.connectHost = connectHost;
+    self->base.connected   = connected;
+    self->base.write       = write;
+    self->base.writeMulti  = writeMulti;
+    self->base.available   = available;
+    self->base.read        = read;
+    self->base.readMulti   = readMulti;
+    self->base.peek        = peek;
+    self->base.flush       = flush;
+    self->base.stop        = stop;
+    self->base.writeVec    = writeVec;
+    self->rx = rx;
+    self->rxSize = rxSize;
+}
+
+// appends bytes to the receive side, compacting consumed data first
+size_t LoopbackClient_push(LoopbackClient_t* self, const uint8_t* buf, size_t size)
+{
+    if (self->rxHead > 0)
+    {
+        memmove(self->rx, &self->rx[self->rxHead], self->rxTail - self->rxHead);
+        self->rxTail -= self->rxHead;
+        self->rxHead = 0;
+    }
+    if (size > self->rxSize - self->rxTail)
+    {
+        size = self->rxSize - self->rxTail;
+    }
+    memcpy(&self->rx[self->rxTail], buf, size);
+    self->rxTail += size;
+    return size;
+}
+
+// replays everything pushed so far
+void LoopbackClient_rewind(LoopbackClient_t* self)
+{
+    self->rxHead = 0;
+}
@@ -0,0 +1,27 @@
+/*
+ LoopbackClient.h - In-memory Client_t used by the benchmarks.
+*/
+
+#ifndef LoopbackClient_h
+#define LoopbackClient_h
+
+#include <stddef.h>
+#include "Client.h"
+
+typedef struct
+{
+    Client_t base;
+    uint8_t* rx;
+    size_t rxSize;
+    size_t rxHead;
+    size_t rxTail;
+    size_t txBytes;
+    size_t txCalls;
+    uint8_t connected;
+} LoopbackClient_t;
+
+void   LoopbackClient_init  (LoopbackClient_t* self, uint8_t* rx, size_t rxSize);
+size_t LoopbackClient_push  (LoopbackClient_t* self, const uint8_t* buf, size_t size);
+void   LoopbackClient_rewind(LoopbackClient_t* self);
+
+#endif
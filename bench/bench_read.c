@@ -0,0 +1,101 @@
+/*
+ bench_read.c - Receive path throughput over the in-memory loopback client.
+
+ Fills the loopback with back-to-back QoS 0 PUBLISH packets and reports how
+ many input bytes PubSub_loop() consumes per CPU cycle.
+*/
+
+#include "PubSubClient.h"
+#include "LoopbackClient.h"
+#include "BenchClock.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define BENCH_STREAM_SIZE   (1 << 20)
+#define BENCH_ROUNDS        50
+
+static unsigned long messages;
+
+static unsigned long benchMillis(void)
+{
+    return 0;
+}
+
+static void benchCallback(char* topic, uint8_t* payload, unsigned int length)
+{
+    messages++;
+}
+
+// encodes one QoS 0 PUBLISH packet, returns its size
+static size_t encodePublish(uint8_t* buf, const char* topic, uint16_t plength)
+{
+    uint16_t tl = strlen(topic);
+    uint32_t remaining = 2 + tl + plength;
+    size_t pos = 0;
+    buf[pos++] = MQTTPUBLISH;
+    do {
+        uint8_t digit = remaining % 128;
+        remaining /= 128;
+        buf[pos++] = digit | (remaining > 0 ? 0x80 : 0);
+    } while (remaining > 0);
+    buf[pos++] = tl >> 8;
+    buf[pos++] = tl & 0xFF;
+    memcpy(&buf[pos], topic, tl);
+    pos += tl;
+    memset(&buf[pos], 0xA5, plength);
+    return pos + plength;
+}
+
+static void run(uint16_t plength)
+{
+    static PubSubClient_t client;
+    static LoopbackClient_t loopback;
+    static uint8_t rx[BENCH_STREAM_SIZE];
+    static uint8_t packet[MQTT_MAX_PACKET_SIZE];
+    const uint8_t connack[4] = {MQTTCONNACK, 2, 0, 0};
+    uint8_t ip[4] = {127, 0, 0, 1};
+
+    memset(&client, 0, sizeof(client));
+    LoopbackClient_init(&loopback, rx, sizeof(rx));
+    PubSub_initIPCallback(&client, &loopback.base, benchMillis, ip, 1883, benchCallback);
+    LoopbackClient_push(&loopback, connack, sizeof(connack));
+    if (!PubSub_connectId(&client, "bench"))
+    {
+        printf("connect failed\n");
+        exit(1);
+    }
+
+    size_t size = encodePublish(packet, "bench/topic", plength);
+    size_t total = 0;
+    while (total + size <= sizeof(rx))
+    {
+        total += LoopbackClient_push(&loopback, packet, size);
+    }
+
+    messages = 0;
+    uint64_t start = BenchClock_cycles();
+    int round;
+    for (round = 0; round < BENCH_ROUNDS; round++)
+    {
+        LoopbackClient_rewind(&loopback);
+        while (loopback.base.available(&loopback.base) > 0)
+        {
+            PubSub_loop(&client);
+        }
+    }
+    uint64_t elapsed = BenchClock_cycles() - start;
+
+    printf("payload %4u: %8lu msgs, %.4f bytes/cycle\n",
+           plength, messages, (double)total * BENCH_ROUNDS / elapsed);
+}
+
+int main(void)
+{
+    const uint16_t sizes[] = {8, 32, 64, 100};
+    unsigned int i;
+    for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+    {
+        run(sizes[i]);
+    }
+    return 0;
+}
@@ -0,0 +1,427 @@
+/*
+ bench_suite.c - Client benchmarks against the scripted broker stand-in.
+
+ Measures publish throughput per payload size, by topic and through a
+ prepared handle, inbound parse and dispatch latency, the remaining length
+ codec, replay of the offline store, the multi-producer publish queue and
+ the connect handshake, and writes
+ the results as JSON to the file given as first argument (stdout otherwise).
+ BENCH_REVISION in the environment is copied into the output so results can
+ be tracked across commits:
+
+   BENCH_REVISION=$(git rev-parse --short HEAD) ./mqtt_c_bench results.json
+*/
+
+#include "PubSubClient.h"
+#include "FakeBroker.h"
+#include "BenchClock.h"
+#include <stdlib.h>
+#include <string.h>
+#if defined(__unix__) || defined(__APPLE__)
+#include "PubSubFileStore.h"
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#define BENCH_STORE
+#define BENCH_THREADS
+#endif
+
+#define BENCH_RX_SIZE           (64 * 1024)
+#define BENCH_PUBLISH_NANOS     200000000ULL
+#define BENCH_LATENCY_SAMPLES   100000
+#define BENCH_CODEC_ROUNDS      1000000
+#define BENCH_CONNECT_SAMPLES   20000
+#define BENCH_REPLAY_MESSAGES   100000
+#define BENCH_QUEUE_MESSAGES    400000
+#define BENCH_QUEUE_SLOTS       1024
+
+static PubSubClient_t client;
+static FakeBroker_t broker;
+static uint8_t rx[BENCH_RX_SIZE];
+static uint8_t packet[MQTT_MAX_PACKET_SIZE];
+static uint64_t samples[BENCH_LATENCY_SAMPLES];
+static unsigned long received;
+
+static unsigned long benchMillis(void)
+{
+    return (unsigned long)(BenchClock_nanos() / 1000000ULL);
+}
+
+static void benchHandler(PubSubClient_t* session, char* topic, uint8_t* payload, unsigned int length)
+{
+    received++;
+}
+
+static int compareSamples(const void* a, const void* b)
+{
+    uint64_t x = *(const uint64_t*)a;
+    uint64_t y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+// percentile of sorted samples
+static uint64_t percentile(const uint64_t* sorted, size_t count, double p)
+{
+    size_t i = (size_t)(p * (count - 1) + 0.5);
+    return sorted[i];
+}
+
+static void printPercentiles(FILE* out, uint64_t* values, size_t count)
+{
+    uint64_t total = 0;
+    size_t i;
+    for (i = 0; i < count; i++)
+    {
+        total += values[i];
+    }
+    qsort(values, count, sizeof(values[0]), compareSamples);
+    fprintf(out, "{\"samples\": %zu, \"mean\": %.1f, \"p50\": %llu, \"p90\": %llu, \"p99\": %llu, \"p999\": %llu, \"max\": %llu}",
+            count, (double)total / count,
+            (unsigned long long)percentile(values, count, 0.50),
+            (unsigned long long)percentile(values, count, 0.90),
+            (unsigned long long)percentile(values, count, 0.99),
+            (unsigned long long)percentile(values, count, 0.999),
+            (unsigned long long)values[count - 1]);
+}
+
+static void setup(uint8_t echo)
+{
+    uint8_t ip[4] = {127, 0, 0, 1};
+
+    PubSub_deinit(&client);
+    memset(&client, 0, sizeof(client));
+    FakeBroker_init(&broker, rx, sizeof(rx), packet, sizeof(packet));
+    broker.echo = echo;
+    PubSub_initIP(&client, &broker.loop.base, benchMillis, ip, 1883);
+    if (!PubSub_connectId(&client, "bench"))
+    {
+        fprintf(stderr, "connect failed, state %d\n", PubSub_state(&client));
+        exit(1);
+    }
+}
+
+// QoS 0 publishes through the broker stand-in for a fixed time, by topic or
+// through a prepared handle
+static void benchPublish(FILE* out, unsigned int plength, int prepared, int last)
+{
+    uint8_t* payload = malloc(plength);
+    unsigned long messages = 0;
+    PubSubPrepared_t handle;
+    uint64_t start;
+    uint64_t elapsed;
+
+    memset(payload, 0xA5, plength);
+    setup(0);
+    PubSub_preparePublish(&client, &handle, "bench/publish", 0, false, false);
+    start = BenchClock_nanos();
+    do {
+        int i;
+        for (i = 0; i < 1024; i++)
+        {
+            boolean rc = prepared ? PubSub_publishPrepared(&client, &handle, payload, plength)
+                                  : PubSub_publish(&client, "bench/publish", payload, plength, false);
+            if (!rc)
+            {
+                fprintf(stderr, "publish of %u bytes failed\n", plength);
+                exit(1);
+            }
+        }
+        messages += 1024;
+        elapsed = BenchClock_nanos() - start;
+    } while (elapsed < BENCH_PUBLISH_NANOS);
+    free(payload);
+
+    if (broker.publishes != messages)
+    {
+        fprintf(stderr, "broker saw %lu of %lu publishes\n", broker.publishes, messages);
+        exit(1);
+    }
+    fprintf(out, "    {\"payload\": %u, \"messages\": %lu, \"msgs_per_sec\": %.0f, \"bytes_per_sec\": %.0f}%s\n",
+            plength, messages,
+            messages * 1e9 / elapsed,
+            (double)broker.publishBytes * 1e9 / elapsed,
+            last ? "" : ",");
+}
+
+// one echoed PUBLISH per PubSub_loop() call, parsed and routed through the
+// subscription handlers
+static void benchDispatch(FILE* out, unsigned int plength)
+{
+    uint8_t payload[MQTT_MAX_PACKET_SIZE];
+    uint8_t frame[MQTT_MAX_PACKET_SIZE + 5];
+    size_t size;
+    size_t i;
+
+    setup(1);
+    PubSub_subscribeHandler(&client, "bench/+/latency", 0, false, benchHandler);
+    PubSub_subscribeHandler(&client, "bench/#", 0, false, benchHandler);
+    PubSub_subscribeHandler(&client, "other/topic", 0, false, benchHandler);
+    PubSub_loop(&client);
+
+    // Let the broker stand-in frame the packet once, then replay it
+    memset(payload, 0x5A, plength);
+    PubSub_publish(&client, "bench/dispatch/latency", payload, plength, false);
+    size = broker.loop.rxTail - broker.loop.rxHead;
+    memcpy(frame, &broker.loop.rx[broker.loop.rxHead], size);
+    broker.echo = 0;
+    PubSub_loop(&client);
+
+    received = 0;
+    for (i = 0; i < BENCH_LATENCY_SAMPLES; i++)
+    {
+        FakeBroker_push(&broker, frame, size);
+        uint64_t start = BenchClock_nanos();
+        PubSub_loop(&client);
+        samples[i] = BenchClock_nanos() - start;
+    }
+    if (received != 2 * BENCH_LATENCY_SAMPLES)
+    {
+        fprintf(stderr, "dispatched %lu of %u messages\n", received, 2 * BENCH_LATENCY_SAMPLES);
+        exit(1);
+    }
+    fprintf(out, "  \"dispatch_latency_ns\": {\"payload\": %u, \"handlers\": 2, \"latency\": ", plength);
+    printPercentiles(out, samples, BENCH_LATENCY_SAMPLES);
+    fprintf(out, "},\n");
+}
+
+static void benchCodec(FILE* out)
+{
+    const uint32_t lengths[] = {100, 10000, 1000000, MQTT_MAX_REMAINING_LENGTH};
+    unsigned int n = sizeof(lengths) / sizeof(lengths[0]);
+    unsigned int k;
+
+    fprintf(out, "  \"remaining_length\": [\n");
+    for (k = 0; k < n; k++)
+    {
+        uint8_t buf[4];
+        volatile uint32_t sink = 0;
+        uint32_t length = lengths[k];
+        uint8_t used = 0;
+        int i;
+
+        uint64_t start = BenchClock_nanos();
+        for (i = 0; i < BENCH_CODEC_ROUNDS; i++)
+        {
+            used = PubSub_encodeLength(buf, length ^ (i & 1));
+            sink += buf[0];
+        }
+        uint64_t encode = BenchClock_nanos() - start;
+
+        start = BenchClock_nanos();
+        for (i = 0; i < BENCH_CODEC_ROUNDS; i++)
+        {
+            uint32_t value;
+            PubSub_decodeLength(buf, used, &value);
+            sink += value;
+            buf[0] ^= (i & 1);
+        }
+        uint64_t decode = BenchClock_nanos() - start;
+
+        fprintf(out, "    {\"bytes\": %u, \"encode_ns\": %.2f, \"decode_ns\": %.2f}%s\n",
+                used, (double)encode / BENCH_CODEC_ROUNDS, (double)decode / BENCH_CODEC_ROUNDS,
+                (k + 1 < n) ? "," : "");
+    }
+    fprintf(out, "  ],\n");
+}
+
+#ifdef BENCH_STORE
+// Messages published during an outage into the file store, then the time
+// from reconnect until the store is empty
+static void benchReplay(FILE* out, unsigned int plength)
+{
+    static PubSubFileStore_t store;
+    char path[] = "/tmp/mqtt_c_bench_storeXXXXXX";
+    uint8_t payload[64];
+    unsigned long loops = 0;
+    int fd = mkstemp(path);
+    size_t i;
+
+    if ((fd < 0) || !PubSubFileStore_open(&store, path, 16 * 1024 * 1024, PUBSUB_STORE_DROP_NEWEST))
+    {
+        fprintf(stderr, "cannot open store %s\n", path);
+        exit(1);
+    }
+    close(fd);
+    memset(payload, 0x3C, plength);
+    setup(0);
+    PubSub_setStore(&client, &store.base);
+    PubSub_disconnect(&client);
+    for (i = 0; i < BENCH_REPLAY_MESSAGES; i++)
+    {
+        PubSub_publish(&client, "bench/replay", payload, plength, false);
+    }
+    size_t stored = PubSubFileStore_length(&store);
+
+    uint64_t start = BenchClock_nanos();
+    PubSub_connectId(&client, "bench");
+    while (PubSubFileStore_length(&store) > 0)
+    {
+        PubSub_loop(&client);
+        loops++;
+    }
+    uint64_t elapsed = BenchClock_nanos() - start;
+    if (broker.publishes != BENCH_REPLAY_MESSAGES)
+    {
+        fprintf(stderr, "broker saw %lu of %u replayed publishes\n", broker.publishes, BENCH_REPLAY_MESSAGES);
+        exit(1);
+    }
+    fprintf(out, "  \"offline_replay\": {\"payload\": %u, \"messages\": %u, \"bytes\": %zu, \"loops\": %lu, \"ms\": %.2f, \"msgs_per_sec\": %.0f},\n",
+            plength, BENCH_REPLAY_MESSAGES, stored, loops, elapsed / 1e6,
+            BENCH_REPLAY_MESSAGES * 1e9 / elapsed);
+
+    PubSub_setStore(&client, NULL);
+    PubSubFileStore_close(&store);
+    unlink(path);
+}
+#endif
+
+#ifdef BENCH_THREADS
+static PubSubQueue_t queue;
+static PubSubQueueSlot_t queueSlots[BENCH_QUEUE_SLOTS];
+
+typedef struct
+{
+    pthread_t thread;
+    unsigned long count;
+    uint64_t nanos;
+} producer_t;
+
+static void* benchProducer(void* arg)
+{
+    producer_t* p = (producer_t*)arg;
+    uint8_t payload[16];
+    unsigned long i = 0;
+
+    memset(payload, 0x3C, sizeof(payload));
+    p->nanos = 0;
+    while (i < p->count)
+    {
+        uint64_t start = BenchClock_nanos();
+        boolean queued = PubSubQueue_publish(&queue, "bench/queue", payload, sizeof(payload), false, false);
+        p->nanos += BenchClock_nanos() - start;
+        if (queued)
+        {
+            i++;
+        }
+        else
+        {
+            sched_yield();
+        }
+    }
+    return NULL;
+}
+
+// The same number of messages enqueued by 1 to 8 threads while this thread
+// sends them: time spent in the enqueue calls per message, refused calls on
+// a full queue included, and throughput to the broker
+static void benchQueue(FILE* out, int producers, int last)
+{
+    producer_t threads[8];
+    uint64_t nanos = 0;
+    int i;
+
+    setup(0);
+    PubSubQueue_init(&queue, queueSlots, BENCH_QUEUE_SLOTS);
+    PubSub_setQueue(&client, &queue);
+    uint64_t start = BenchClock_nanos();
+    for (i = 0; i < producers; i++)
+    {
+        threads[i].count = BENCH_QUEUE_MESSAGES / producers;
+        pthread_create(&threads[i].thread, NULL, benchProducer, &threads[i]);
+    }
+    while (broker.publishes < (BENCH_QUEUE_MESSAGES / producers) * producers)
+    {
+        PubSub_loop(&client);
+    }
+    uint64_t elapsed = BenchClock_nanos() - start;
+    for (i = 0; i < producers; i++)
+    {
+        pthread_join(threads[i].thread, NULL);
+        nanos += threads[i].nanos;
+    }
+    fprintf(out, "    {\"producers\": %d, \"enqueue_ns\": %.1f, \"full\": %lu, \"msgs_per_sec\": %.0f}%s\n",
+            producers, (double)nanos / BENCH_QUEUE_MESSAGES, queue.full,
+            broker.publishes * 1e9 / elapsed, last ? "" : ",");
+    PubSub_setQueue(&client, NULL);
+}
+#endif
+
+// CONNECT, CONNACK and DISCONNECT through the broker stand-in
+static void benchConnect(FILE* out)
+{
+    size_t i;
+
+    setup(0);
+    PubSub_disconnect(&client);
+    for (i = 0; i < BENCH_CONNECT_SAMPLES; i++)
+    {
+        uint64_t start = BenchClock_nanos();
+        if (!PubSub_connectId(&client, "bench"))
+        {
+            fprintf(stderr, "connect failed, state %d\n", PubSub_state(&client));
+            exit(1);
+        }
+        samples[i] = BenchClock_nanos() - start;
+        PubSub_disconnect(&client);
+    }
+    fprintf(out, "  \"connect_ns\": ");
+    printPercentiles(out, samples, BENCH_CONNECT_SAMPLES);
+    fprintf(out, "\n");
+}
+
+int main(int argc, char** argv)
+{
+    const unsigned int sizes[] = {0, 16, 64, 256, 1024, 4096, 65536};
+    unsigned int n = sizeof(sizes) / sizeof(sizes[0]);
+    const char* revision = getenv("BENCH_REVISION");
+    FILE* out = stdout;
+    unsigned int i;
+
+    if (argc > 1)
+    {
+        out = fopen(argv[1], "w");
+        if (out == NULL)
+        {
+            perror(argv[1]);
+            return 1;
+        }
+    }
+
+    fprintf(out, "{\n");
+    fprintf(out, "  \"revision\": \"%s\",\n", revision ? revision : "");
+    fprintf(out, "  \"max_packet_size\": %u,\n", MQTT_MAX_PACKET_SIZE);
+    fprintf(out, "  \"publish\": [\n");
+    for (i = 0; i < n; i++)
+    {
+        benchPublish(out, sizes[i], 0, i + 1 == n);
+    }
+    fprintf(out, "  ],\n");
+    fprintf(out, "  \"publish_prepared\": [\n");
+    for (i = 0; i < n; i++)
+    {
+        benchPublish(out, sizes[i], 1, i + 1 == n);
+    }
+    fprintf(out, "  ],\n");
+    benchDispatch(out, 32);
+    benchCodec(out);
+#ifdef BENCH_STORE
+    benchReplay(out, 64);
+#endif
+#ifdef BENCH_THREADS
+    fprintf(out, "  \"queue\": [\n");
+    for (i = 1; i <= 8; i *= 2)
+    {
+        benchQueue(out, i, i == 8);
+    }
+    fprintf(out, "  ],\n");
+#endif
+    benchConnect(out);
+    fprintf(out, "}\n");
+
+    PubSub_deinit(&client);
+    if (out != stdout)
+    {
+        fclose(out);
+    }
+    return 0;
+}
@@ -0,0 +1,119 @@
+/*
+ bench_trie.c - Topic dispatch cost with many subscription filters.
+
+ Registers a large filter set (exact, '+' and '#' filters) and compares the
+ trie lookup against the linear scan an application would otherwise run in
+ its callback.
+*/
+
+#include "TopicTrie.h"
+#include "BenchClock.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BENCH_SITES     64
+#define BENCH_DEVICES   256
+#define BENCH_LOOKUPS   200000
+
+static unsigned long hits;
+
+static void visit(const TopicTrieNode_t* node, void* context)
+{
+    hits++;
+}
+
+// MQTT filter match, as applications implement it in their callbacks
+static int filterMatches(const char* filter, const char* topic)
+{
+    while (1)
+    {
+        if (filter[0] == '#')
+        {
+            return 1;
+        }
+        const char* fe = strchr(filter, '/');
+        const char* te = strchr(topic, '/');
+        size_t fl = fe ? (size_t)(fe - filter) : strlen(filter);
+        size_t tl = te ? (size_t)(te - topic) : strlen(topic);
+        if (!((fl == 1) && (filter[0] == '+')) &&
+            ((fl != tl) || (memcmp(filter, topic, fl) != 0)))
+        {
+            return 0;
+        }
+        if ((fe == NULL) && (te == NULL))
+        {
+            return 1;
+        }
+        if (te == NULL)
+        {
+            return (fe != NULL) && (strcmp(fe + 1, "#") == 0);
+        }
+        if (fe == NULL)
+        {
+            return 0;
+        }
+        filter = fe + 1;
+        topic = te + 1;
+    }
+}
+
+int main(void)
+{
+    static char filters[BENCH_SITES * BENCH_DEVICES + BENCH_SITES * 2][48];
+    static char topics[1024][48];
+    TopicTrie_t trie = {0};
+    size_t count = 0;
+    int s, d, i;
+
+    for (s = 0; s < BENCH_SITES; s++)
+    {
+        for (d = 0; d < BENCH_DEVICES; d++)
+        {
+            sprintf(filters[count++], "site%d/dev%d/temp", s, d);
+        }
+        sprintf(filters[count++], "site%d/+/alarm", s);
+        sprintf(filters[count++], "site%d/config/#", s);
+    }
+    for (i = 0; i < 1024; i++)
+    {
+        const char* leaf[] = {"temp", "alarm", "humidity", "config/x"};
+        sprintf(topics[i], "site%d/dev%d/%s", rand() % BENCH_SITES, rand() % BENCH_DEVICES, leaf[i % 4]);
+    }
+
+    uint64_t start = BenchClock_nanos();
+    for (i = 0; i < (int)count; i++)
+    {
+        TopicTrie_insert(&trie, filters[i], NULL, 0);
+    }
+    uint64_t insert = BenchClock_nanos() - start;
+
+    hits = 0;
+    start = BenchClock_nanos();
+    for (i = 0; i < BENCH_LOOKUPS; i++)
+    {
+        TopicTrie_match(&trie, topics[i & 1023], visit, NULL);
+    }
+    uint64_t trieTime = BenchClock_nanos() - start;
+    unsigned long trieHits = hits;
+
+    int linearLookups = BENCH_LOOKUPS / 100;
+    unsigned long linearHits = 0;
+    start = BenchClock_nanos();
+    for (i = 0; i < linearLookups; i++)
+    {
+        size_t f;
+        for (f = 0; f < count; f++)
+        {
+            linearHits += filterMatches(filters[f], topics[i & 1023]);
+        }
+    }
+    uint64_t linearTime = BenchClock_nanos() - start;
+
+    printf("filters:       %zu (insert %.1f ns/filter)\n", count, (double)insert / count);
+    printf("trie match:    %.1f ns/topic (%lu hits)\n", (double)trieTime / BENCH_LOOKUPS, trieHits);
+    printf("linear scan:   %.1f ns/topic (%lu hits over %d topics)\n", (double)linearTime / linearLookups, linearHits, linearLookups);
+
+    TopicTrie_free(&trie);
+    return 0;
+}
@@ -21,22 +21,44 @@
 #define client_h
 #include <stdint.h>
 #include <stdio.h>
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/uio.h>
+#else
+struct iovec
+{
+    void*  iov_base;
+    size_t iov_len;
+};
+#endif
 
 typedef uint8_t IPAddress_t[4];
 
-typedef int     (*fpClient_connectIP)   (IPAddress_t ip, uint16_t port);
-typedef int     (*fpClient_connectHost) (const char *host, uint16_t port);
-typedef uint8_t (*fpClient_connected)   (void);
-typedef size_t  (*fpClient_write)       (uint8_t);
-typedef size_t  (*fpClient_writeMulti)  (const uint8_t *buf, size_t size);
-typedef int     (*fpClient_available)   (void);
-typedef int     (*fpClient_read)        (void);
-typedef int     (*fpClient_readMulti)   (uint8_t *buf, size_t size);
-typedef int     (*fpClient_peek)        (void);
-typedef void    (*fpClient_flush)       (void);
-typedef void    (*fpClient_stop)        (void);
-
-typedef struct
+typedef struct Client_t Client_t;
+
+// Every callback receives the Client_t it was invoked through, so a single
+// transport implementation can serve many connections by embedding Client_t
+// at the start of its own per-connection structure.
+//
+// write(), writeMulti() and writeVec() return how many bytes were taken. A
+// transport takes all of them or none: a write that cannot be finished
+// returns 0 and, when part of it already went out, closes the connection.
+// PubSubClient drops the connection itself when a packet is cut short
+// anyway, as the rest would be mixed up with the next one.
+typedef int     (*fpClient_connectIP)   (Client_t* self, IPAddress_t ip, uint16_t port);
+typedef int     (*fpClient_connectHost) (Client_t* self, const char *host, uint16_t port);
+typedef uint8_t (*fpClient_connected)   (Client_t* self);
+typedef size_t  (*fpClient_write)       (Client_t* self, uint8_t);
+typedef size_t  (*fpClient_writeMulti)  (Client_t* self, const uint8_t *buf, size_t size);
+typedef int     (*fpClient_available)   (Client_t* self);
+typedef int     (*fpClient_read)        (Client_t* self);
+typedef int     (*fpClient_readMulti)   (Client_t* self, uint8_t *buf, size_t size);
+typedef int     (*fpClient_peek)        (Client_t* self);
+typedef void    (*fpClient_flush)       (Client_t* self);
+typedef void    (*fpClient_stop)        (Client_t* self);
+typedef size_t  (*fpClient_writeVec)    (Client_t* self, const struct iovec *iov, int count);
+typedef int     (*fpClient_wait)        (Client_t* self, unsigned long timeoutMs);
+
+struct Client_t
 {
     fpClient_connectIP      connectIP;
     fpClient_connectHost    connectHost;
@@ -49,6 +71,13 @@ typedef struct
     fpClient_peek           peek;
     fpClient_flush          flush;
     fpClient_stop           stop;
-} Client_t;
+    // Optional: writes count segments in order as one send (like writev).
+    // Leave NULL when the transport has no gather write.
+    fpClient_writeVec       writeVec;
+    // Optional: sleeps until data can be read or timeoutMs has passed.
+    // Returns > 0 when readable, 0 on timeout, < 0 on error. Without it
+    // blocking calls poll the client instead.
+    fpClient_wait           wait;
+};
 
 #endif
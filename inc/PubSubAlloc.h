@@ -0,0 +1,67 @@
+/*
+ PubSubAlloc.h - Allocator interface for session buffers and the
+  subscription registry, with a fixed-block pool and a bump arena on
+  caller-provided memory.
+
+ None of them are thread safe: a session only allocates on the thread that
+ runs it, and only when it is set up or subscribes, never per message.
+*/
+
+#ifndef PubSubAlloc_h
+#define PubSubAlloc_h
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// PUBSUB_ALLOC_ALIGN : Alignment of what the pool and the arena hand out, a
+//  power of two
+#ifndef PUBSUB_ALLOC_ALIGN
+#define PUBSUB_ALLOC_ALIGN 8
+#endif
+
+typedef struct PubSubAllocator_t PubSubAllocator_t;
+typedef void* (*fpAllocator_alloc)(PubSubAllocator_t* self, size_t size);
+typedef void  (*fpAllocator_free) (PubSubAllocator_t* self, void* ptr, size_t size);
+
+struct PubSubAllocator_t
+{
+    // size bytes, NULL when there is no room
+    fpAllocator_alloc alloc;
+    // Gives back what alloc returned, with the size asked for
+    fpAllocator_free  free;
+};
+
+// Fixed-size blocks on a free list: constant time, no fragmentation, but
+// nothing larger than a block
+typedef struct
+{
+    PubSubAllocator_t base;
+    void* next;                 // first free block
+    size_t blockSize;
+    size_t available;           // free blocks
+} PubSubPool_t;
+
+// Hands out memory front to back and only takes back the latest piece;
+// PubSubArena_reset() frees everything at once
+typedef struct
+{
+    PubSubAllocator_t base;
+    uint8_t* memory;
+    size_t size;
+    size_t used;
+} PubSubArena_t;
+
+// Through allocator, or the C heap when it is NULL
+void*   PubSubAlloc_alloc       (PubSubAllocator_t* allocator, size_t size);
+void    PubSubAlloc_free        (PubSubAllocator_t* allocator, void* ptr, size_t size);
+
+// Splits size bytes of memory, aligned to PUBSUB_ALLOC_ALIGN, into blocks of
+// blockSize rounded up to it. false when not even one block fits.
+bool    PubSubPool_init         (PubSubPool_t* self, void* memory, size_t size, size_t blockSize);
+
+// size bytes of memory aligned to PUBSUB_ALLOC_ALIGN
+void    PubSubArena_init        (PubSubArena_t* self, void* memory, size_t size);
+void    PubSubArena_reset       (PubSubArena_t* self);
+
+#endif
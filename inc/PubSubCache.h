@@ -0,0 +1,87 @@
+/*
+ PubSubCache.h - Last value per topic, with a memory budget and least
+  recently used eviction.
+
+ Set on a session, see PubSub_setCache(), the cache keeps the latest payload
+ of every topic that arrives, retained messages included, so that it can be
+ looked up at any time instead of mirroring the callback into a map of one's
+ own. Topics are found through an open addressing hash table over
+ caller-provided entries; their values are allocated through an allocator,
+ within a budget of bytes. When either runs out, the topics not stored or
+ looked up for the longest time make room.
+
+ Not thread safe: store and look up on the thread that runs the session.
+*/
+
+#ifndef PubSubCache_h
+#define PubSubCache_h
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "PubSubAlloc.h"
+
+// The latest value of a topic. The pointers are into the cache and only valid
+// until the next store.
+typedef struct
+{
+    const char* topic;              // NUL terminated
+    uint16_t topicLength;
+    const uint8_t* payload;         // NULL when a retained value was cleared
+    uint32_t payloadLength;
+    unsigned long received;         // the time passed to PubSubCache_store()
+    bool retain;
+} PubSubCacheValue_t;
+
+// Told about a new value of a topic; a repeat of the same payload is not one
+typedef void (*fpCacheChanged_t)(void* context, const PubSubCacheValue_t* value);
+
+typedef struct
+{
+    uint8_t* data;                  // topic, NUL, payload; NULL when free
+    size_t size;                    // bytes allocated for data
+    uint32_t hash;
+    uint16_t topicLength;
+    uint32_t payloadLength;
+    unsigned long received;
+    bool retain;
+    uint32_t newer;                 // LRU neighbours, entry indices
+    uint32_t older;
+} PubSubCacheEntry_t;
+
+typedef struct
+{
+    PubSubCacheEntry_t* entries;
+    uint32_t mask;
+    uint32_t count;
+    uint32_t limit;                 // count kept to 3/4 of the entries
+    uint32_t newest;
+    uint32_t oldest;
+    size_t budget;
+    size_t used;                    // bytes allocated for values
+    PubSubAllocator_t* allocator;
+    fpCacheChanged_t changed;
+    void* changedContext;
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long evictions;
+    unsigned long rejected;         // larger than the budget, or out of memory
+} PubSubCache_t;
+
+// count caller-provided entries, a power of two of at least 4, of which 3/4
+// are used. Values take up to budget bytes from allocator, the C heap when it
+// is NULL.
+bool    PubSubCache_init        (PubSubCache_t* self, PubSubCacheEntry_t* entries, size_t count, size_t budget, PubSubAllocator_t* allocator);
+void    PubSubCache_setChanged  (PubSubCache_t* self, fpCacheChanged_t changed, void* context);
+
+// Keeps payload as the latest value of topic. A retained message without
+// payload clears the topic, as it does on the broker. false when it could not
+// be kept.
+bool    PubSubCache_store       (PubSubCache_t* self, const char* topic, uint16_t topicLength, const uint8_t* payload, uint32_t payloadLength, bool retain, unsigned long now);
+// Fills value with the latest of topic, false when there is none
+bool    PubSubCache_get         (PubSubCache_t* self, const char* topic, PubSubCacheValue_t* value);
+bool    PubSubCache_remove      (PubSubCache_t* self, const char* topic);
+// Forgets every topic and gives their memory back
+void    PubSubCache_clear       (PubSubCache_t* self);
+
+#endif
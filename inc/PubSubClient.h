@@ -10,21 +10,103 @@
 #include <stdio.h>
 #include <stdbool.h>
 #include "Client.h"
+#include "PubSubAlloc.h"
+#include "TopicTrie.h"
+#include "PubSubStats.h"
+#include "PubSubQueue.h"
+#include "PubSubCache.h"
+#include "PubSubShaper.h"
 
 #define MQTT_VERSION_3_1      3
 #define MQTT_VERSION_3_1_1    4
+#define MQTT_VERSION_5        5
 
 // MQTT_VERSION : Pick the version
 //#define MQTT_VERSION MQTT_VERSION_3_1
+//#define MQTT_VERSION MQTT_VERSION_5
 #ifndef MQTT_VERSION
 #define MQTT_VERSION MQTT_VERSION_3_1_1
 #endif
 
-// MQTT_MAX_PACKET_SIZE : Maximum packet size
+#if MQTT_VERSION == MQTT_VERSION_5
+// MQTT_TOPIC_ALIAS_MAX : Topic aliases kept per direction (at least 1).
+//  Outbound topics get an alias when the broker accepts them; a repeated
+//  topic is then sent as the 2 byte alias alone.
+#ifndef MQTT_TOPIC_ALIAS_MAX
+#define MQTT_TOPIC_ALIAS_MAX 8
+#endif
+
+// MQTT_TOPIC_ALIAS_LENGTH : Longest topic, address prefix included, that can
+//  be aliased, plus one
+#ifndef MQTT_TOPIC_ALIAS_LENGTH
+#define MQTT_TOPIC_ALIAS_LENGTH 64
+#endif
+
+// MQTT_SESSION_EXPIRY : Seconds the broker keeps a persistent session after
+//  the connection is gone, see PubSub_setCleanSession()
+#ifndef MQTT_SESSION_EXPIRY
+#define MQTT_SESSION_EXPIRY 3600
+#endif
+#endif
+
+// MQTT_MAX_PACKET_SIZE : Maximum packet size, unless PubSub_configure() sets
+//  another for the session
 #ifndef MQTT_MAX_PACKET_SIZE
 #define MQTT_MAX_PACKET_SIZE 128
 #endif
 
+// MQTT_RX_BUFFER_SIZE : Receive ring. Inbound packets up to this size are
+//  handled in place; larger PUBLISH packets go to the chunk callback. Also
+//  configurable per session.
+#ifndef MQTT_RX_BUFFER_SIZE
+#define MQTT_RX_BUFFER_SIZE (2 * MQTT_MAX_PACKET_SIZE)
+#endif
+
+// MQTT_PREPARED_TOPIC_LENGTH : Longest topic, address prefix included, a
+//  prepared publish handle can hold, plus one
+#ifndef MQTT_PREPARED_TOPIC_LENGTH
+#define MQTT_PREPARED_TOPIC_LENGTH 64
+#endif
+
+// MQTT_STORE_DRAIN_SIZE : Offline store bytes sent per PubSub_loop() call
+#ifndef MQTT_STORE_DRAIN_SIZE
+#define MQTT_STORE_DRAIN_SIZE 4096
+#endif
+
+// MQTT_QUEUE_DRAIN_COUNT : Queued publishes sent per PubSub_loop() call
+#ifndef MQTT_QUEUE_DRAIN_COUNT
+#define MQTT_QUEUE_DRAIN_COUNT 64
+#endif
+
+// MQTT_MAX_PENDING_SUBSCRIBES : Batched SUBSCRIBE and UNSUBSCRIBE packets
+//  that can wait for their acknowledgement at the same time
+#ifndef MQTT_MAX_PENDING_SUBSCRIBES
+#define MQTT_MAX_PENDING_SUBSCRIBES 4
+#endif
+
+// MQTT_INBOUND_WINDOW : Inbound QoS 1/2 messages the session keeps track of
+//  at once, QoS 2 ones until their PUBREL and deferred ones until they are
+//  acknowledged. A power of two; in MQTT 5 it is the Receive Maximum the
+//  broker is given.
+#ifndef MQTT_INBOUND_WINDOW
+#define MQTT_INBOUND_WINDOW 32
+#endif
+
+// MQTT_ACK_BUFFER_SIZE : Bytes of acknowledgements collected for the one
+//  write at the end of PubSub_loop(), 4 per acknowledgement
+#ifndef MQTT_ACK_BUFFER_SIZE
+#define MQTT_ACK_BUFFER_SIZE 64
+#endif
+
+// MQTT_STATS : Keep the counters and histograms of PubSub_getStats(); 0
+//  leaves them out entirely
+#ifndef MQTT_STATS
+#define MQTT_STATS 1
+#endif
+
+// MQTT_MAX_REMAINING_LENGTH : Largest remaining length the protocol can encode
+#define MQTT_MAX_REMAINING_LENGTH 268435455UL
+
 // MQTT_KEEPALIVE : keepAlive interval in Seconds
 #ifndef MQTT_KEEPALIVE
 #define MQTT_KEEPALIVE 15
@@ -41,6 +123,7 @@
 //#define MQTT_MAX_TRANSFER_SIZE 80
 
 // Possible values for client.state()
+#define MQTT_CONNECTING             -5
 #define MQTT_CONNECTION_TIMEOUT     -4
 #define MQTT_CONNECTION_LOST        -3
 #define MQTT_CONNECT_FAILED         -2
@@ -68,9 +151,14 @@
 #define MQTTDISCONNECT  14 << 4 // Client is Disconnecting
 #define MQTTReserved    15 << 4 // Reserved
 
+// Result of a filter the broker refused, or that was waiting for its
+// acknowledgement when the connection went
+#define MQTT_SUBSCRIBE_FAILED   0x80
+
 #define MQTTQOS0        (0 << 1)
 #define MQTTQOS1        (1 << 1)
 #define MQTTQOS2        (2 << 1)
+#define MQTTDUP         (1 << 3)
 
 #ifdef ESP8266
 #include <functional>
@@ -83,7 +171,491 @@
 
 typedef unsigned long (*fpMillis_t)(void);
 
-void    PubSubClient_setMyAddress( const char* globalLocation, const char* localLocation, const char* deviceName);
+struct PubSubClient_t;
+// Called whenever the session changes state (one of the MQTT_* state values)
+typedef void (*fpStateCallback_t)(struct PubSubClient_t* client, int state);
+// Receives an inbound PUBLISH that does not fit the buffer, one piece at a
+// time as it arrives: offset is the position of chunk within the payload of
+// total bytes.
+typedef void (*fpChunkCallback_t)(struct PubSubClient_t* client, const char* topic, const uint8_t* chunk, unsigned int length, uint32_t offset, uint32_t total);
+
+// An inbound PUBLISH as it sits in the receive ring. Nothing is copied: the
+// pointers are only valid until the message callback returns. The topic is
+// also NUL terminated, the payload is not.
+typedef struct
+{
+    const char* topic;
+    uint16_t topicLength;
+    const uint8_t* payload;
+    uint32_t payloadLength;
+    const uint8_t* properties;      // MQTT 5 property block, without its length
+    uint32_t propertiesLength;
+    uint16_t msgId;
+    uint8_t qos;
+    bool retain;
+    bool dup;
+} PubSubMessageView_t;
+
+// A topic encoded once for repeated publishing, see PubSub_preparePublish()
+typedef struct
+{
+    uint8_t header;                 // PUBLISH fixed header: QoS and retain
+    uint16_t length;                // topic length, address prefix included
+    uint8_t encoded[2 + MQTT_PREPARED_TOPIC_LENGTH];    // length, then the topic, NUL terminated
+} PubSubPrepared_t;
+
+typedef void (*fpMessageCallback_t)(struct PubSubClient_t* client, const PubSubMessageView_t* message);
+
+// MQTT_ADDRESS_LENGTH : Room for the address prefix set by setMyAddress and
+//  its NUL, unless PubSub_configure() sets another
+#ifndef MQTT_ADDRESS_LENGTH
+#define MQTT_ADDRESS_LENGTH 25
+#endif
+
+typedef struct
+{
+    char* address;
+    uint16_t length;
+    uint16_t size;
+} PubSubAddress_t;
+
+// Buffer sizes and allocators of a session, see PubSub_configure(). A size
+// of 0 takes the compile-time default.
+typedef struct
+{
+    PubSubAllocator_t* allocator;           // session buffers, NULL for the C heap
+    PubSubAllocator_t* registryAllocator;   // subscription registry, NULL for the C heap
+    size_t packetSize;                      // outbound packets, MQTT_MAX_PACKET_SIZE, at most 65535
+    size_t rxSize;                          // receive ring, MQTT_RX_BUFFER_SIZE
+    size_t filterSize;                      // a filter with address prefix and NUL, MQTT_MAX_PACKET_SIZE
+    uint16_t addressSize;                   // address prefix and NUL, MQTT_ADDRESS_LENGTH
+} PubSubConfig_t;
+
+// Called once the broker has fully acknowledged a QoS 1 or 2 publish
+typedef void (*fpPublishCallback_t)(struct PubSubClient_t* client, uint16_t msgId);
+
+// One slot of the outbound QoS 1/2 window. The topic and payload are not
+// copied: they must stay valid until the completion callback has run.
+typedef struct
+{
+    const char* topic;
+    const uint8_t* payload;
+    unsigned int plength;
+    unsigned long sentAt;
+    fpPublishCallback_t callback;
+    uint16_t msgId;
+    uint8_t qos;
+    uint8_t state;
+    bool retained;
+    bool addAddress;
+} PubSubInflight_t;
+
+// Progress of the incremental packet parser between PubSub_loop() calls.
+// Unread data sits in the receive ring from tail on.
+typedef struct
+{
+    uint8_t  state;
+    uint8_t  lengthLength;
+    uint8_t  qos;           // of the PUBLISH being streamed
+    uint16_t msgId;
+    uint32_t remaining;
+    uint32_t offset;
+    size_t   tail;
+    size_t   count;
+    size_t   release;       // size of the packet last handed out, still in place
+} PubSubReader_t;
+
+// One message of a PubSub_publishBatch() call
+typedef struct
+{
+    const char* topic;
+    const uint8_t* payload;
+    unsigned int plength;
+    boolean retained;
+    boolean addAddress;
+} PubSubMessage_t;
+
+// One filter of PubSub_subscribeMany() or PubSub_unsubscribeMany()
+typedef struct
+{
+    const char* topic;
+    uint8_t qos;                    // requested, subscribe only
+    uint8_t result;                 // granted QoS or reason code from the broker
+} PubSubFilter_t;
+
+// Called once the broker acknowledged the count filters sent under msgId,
+// with their results filled in
+typedef void (*fpSubscribeCallback_t)(struct PubSubClient_t* client, uint16_t msgId, PubSubFilter_t* filters, size_t count);
+
+// A batched SUBSCRIBE or UNSUBSCRIBE waiting for its acknowledgement
+typedef struct
+{
+    PubSubFilter_t* filters;
+    fpSubscribeCallback_t callback;
+    uint16_t count;
+    uint16_t msgId;
+    uint8_t ack;                    // MQTTSUBACK or MQTTUNSUBACK, 0 when free
+} PubSubPending_t;
+
+// Store-and-forward queue for QoS 0 publishes, see PubSub_setStore(). It
+// holds complete PUBLISH frames back to back as one byte stream.
+typedef struct PubSubStore_t PubSubStore_t;
+typedef boolean (*fpStore_append) (PubSubStore_t* self, const struct iovec* frame, int count, size_t keep);
+typedef size_t  (*fpStore_peek)   (PubSubStore_t* self, const uint8_t** data);
+typedef void    (*fpStore_consume)(PubSubStore_t* self, size_t size);
+
+struct PubSubStore_t
+{
+    // Appends one frame given as count segments, false when it is refused.
+    // The first keep bytes are partly sent: their frame must not be dropped
+    // to make room.
+    fpStore_append  append;
+    // Points data at the oldest stored bytes, returns how many follow in
+    // one piece, 0 when the store is empty
+    fpStore_peek    peek;
+    // Drops size bytes from the front once they have been sent
+    fpStore_consume consume;
+};
+
+// Delivery stage for inbound messages, see PubSub_setDispatcher() and
+// PubSubWorkers.h
+typedef struct PubSubDispatcher_t PubSubDispatcher_t;
+typedef boolean (*fpDispatcher_ready)   (PubSubDispatcher_t* self);
+typedef void    (*fpDispatcher_dispatch)(PubSubDispatcher_t* self, struct PubSubClient_t* client, const PubSubMessageView_t* message);
+
+struct PubSubDispatcher_t
+{
+    // false while the next message might not be taken: the session then
+    // leaves inbound packets unread
+    fpDispatcher_ready    ready;
+    // Takes message, copying what it keeps. Only called after ready()
+    // returned true.
+    fpDispatcher_dispatch dispatch;
+};
+
+// One broker session. The fields are private to PubSubClient.c; the type is
+// only public so that applications can place instances wherever they like.
+// Instances must be zero-initialised before the first PubSub_init* call.
+typedef struct PubSubClient_t
+{
+    Client_t* client;
+    fpMillis_t millis;
+    uint8_t* buffer;
+    size_t bufferSize;
+    uint16_t nextMsgId;
+    unsigned long lastOutActivity;
+    unsigned long lastInActivity;
+    bool pingOutstanding;
+    MQTT_CALLBACK_SIGNATURE;
+    IPAddress_t ip;
+    const char* domain;
+    uint16_t port;
+    int state;
+    PubSubAddress_t myAddress;
+    PubSubReader_t reader;
+    uint8_t* rxRing;
+    size_t rxSize;
+    char* filter;                   // a subscription filter being put together
+    size_t filterSize;
+    PubSubAllocator_t* allocator;
+    bool ownBuffers;                // buffers came from allocator
+    fpMessageCallback_t messageCallback;
+    bool asyncConnect;
+    fpStateCallback_t stateCallback;
+    fpChunkCallback_t chunkCallback;
+    uint32_t publishRemaining;
+    PubSubInflight_t* inflight;
+    uint16_t inflightSize;
+    uint16_t inflightCount;
+    unsigned long retryMillis;
+    TopicTrie_t handlers;
+    uint8_t* batch;
+    size_t batchSize;
+    size_t batchLength;
+    unsigned long batchSince;
+    size_t coalesceBytes;
+    unsigned long coalesceDelay;
+    PubSubStore_t* store;
+    bool storeBlocked;              // the client took less than offered
+    size_t storeSent;               // bytes of the first stored frame already sent
+    PubSubQueue_t* queue;
+    PubSubDispatcher_t* dispatcher;
+    PubSubCache_t* cache;
+    PubSubShaper_t* shaper;
+    size_t shapedSent;              // bytes of a shaped frame already sent
+    uint8_t shapedClass;            // and its class
+    PubSubPending_t pending[MQTT_MAX_PENDING_SUBSCRIBES];
+    // Inbound QoS 1/2 messages: message id, QoS and state of each one
+    // tracked, 0 when free
+    uint32_t inbound[MQTT_INBOUND_WINDOW];
+    uint16_t inboundCount;
+    uint8_t acks[MQTT_ACK_BUFFER_SIZE];     // acknowledgements not yet sent
+    uint16_t ackLength;
+    bool deferAck;
+    bool ackWaiting;                        // set by PubSub_ack(), any thread
+    // Connect parameters kept for the managed reconnect
+    const char* connectId;
+    const char* connectUser;
+    const char* connectPass;
+    const char* willTopic;
+    const char* willMessage;
+    uint8_t willQos;
+    bool willRetain;
+    unsigned long reconnectMin;
+    unsigned long reconnectMax;     // 0 when reconnecting is left to the application
+    unsigned long reconnectAt;
+    uint16_t reconnectAttempts;     // failed attempts since the last CONNACK
+    bool reconnectPending;
+    uint32_t jitter;                // PRNG state for the backoff jitter
+    bool keepSession;
+    bool sessionPresent;
+#if MQTT_STATS
+    PubSubStats_t stats;
+    fpMillis_t statsClock;          // microseconds, NULL for millis() * 1000
+    unsigned long pingSentAt;
+#endif
+#if MQTT_VERSION == MQTT_VERSION_5
+    // Limits from the broker's CONNACK
+    uint16_t receiveMaximum;
+    uint16_t aliasMaximum;
+    uint32_t maximumPacketSize;     // 0 when the broker set none
+    uint16_t aliasNext;
+    char aliasOut[MQTT_TOPIC_ALIAS_MAX][MQTT_TOPIC_ALIAS_LENGTH];
+    char aliasIn[MQTT_TOPIC_ALIAS_MAX][MQTT_TOPIC_ALIAS_LENGTH];
+#endif
+} PubSubClient_t;
+
+/******************************************************************************
+ * Instance API: every function operates on the given session
+ *****************************************************************************/
+// false when the prefix does not fit the address size
+boolean PubSub_setMyAddress     (PubSubClient_t* self, const char* globalLocation, const char* localLocation, const char* deviceName);
+void    PubSub_init             (PubSubClient_t* self, Client_t* client, fpMillis_t fpMillis);
+void    PubSub_initIP           (PubSubClient_t* self, Client_t* client, fpMillis_t fpMillis, uint8_t *, uint16_t);
+void    PubSub_initIPCallback   (PubSubClient_t* self, Client_t* client, fpMillis_t fpMillis, uint8_t *, uint16_t, MQTT_CALLBACK_SIGNATURE);
+void    PubSub_initHost         (PubSubClient_t* self, Client_t* client, fpMillis_t fpMillis, const char*, uint16_t);
+void    PubSub_initHostCallback (PubSubClient_t* self, Client_t* client, fpMillis_t fpMillis, const char*, uint16_t, MQTT_CALLBACK_SIGNATURE);
+// Releases what the session allocated: its buffers and the subscription
+// handler registry
+void    PubSub_deinit           (PubSubClient_t* self);
+// Sizes the buffers of the session and takes them from config->allocator,
+// the subscription registry from config->registryAllocator, so that small
+// sessions need not pay for large ones. Call it before the PubSub_init*
+// functions, which otherwise take buffers of the default sizes from the C
+// heap, and before PubSub_setMyAddress() and any subscribe. false while
+// connected, when an allocation failed (the session then has no buffers),
+// or when the registry would change allocator while not empty.
+boolean PubSub_configure        (PubSubClient_t* self, const PubSubConfig_t* config);
+
+boolean PubSub_connectId        (PubSubClient_t* self, const char* id);
+boolean PubSub_connectIdUserPass(PubSubClient_t* self, const char* id, const char* user, const char* pass);
+boolean PubSub_connect          (PubSubClient_t* self, const char* id, const char* user, const char* pass, const char* willTopic, uint8_t willQos, boolean willRetain, const char* willMessage);
+// In async mode connect only sends CONNECT and returns true while the state is
+// MQTT_CONNECTING; PubSub_loop() then waits for the CONNACK without blocking.
+void    PubSub_setAsyncConnect  (PubSubClient_t* self, boolean async);
+void    PubSub_setStateCallback (PubSubClient_t* self, fpStateCallback_t callback);
+void    PubSub_disconnect       (PubSubClient_t* self);
+
+// Managed reconnect: once a connection fails or is lost, PubSub_loop() opens
+// a new one after a backoff that doubles from minDelay up to maxDelay millis
+// per failed attempt, each delay randomised between half and all of it so
+// that clients losing the same broker do not return in step. The handshake
+// then completes without blocking, as in async mode. The strings passed to
+// PubSub_connect() are reused and must stay valid. On a CONNACK without a
+// session present every subscription made with PubSub_subscribe*() is sent
+// again, as few SUBSCRIBE packets as MQTT_MAX_PACKET_SIZE allows; QoS 1/2
+// publishes in flight are resent as before. PubSub_disconnect() stops it;
+// maxDelay 0 turns it off.
+void    PubSub_setReconnect     (PubSubClient_t* self, unsigned long minDelay, unsigned long maxDelay);
+// With clean false the broker is asked to keep the session (subscriptions and
+// queued QoS 1/2 messages) across connections; in MQTT 5 for
+// MQTT_SESSION_EXPIRY seconds. Takes effect on the next connect.
+void    PubSub_setCleanSession  (PubSubClient_t* self, boolean clean);
+// Whether the broker resumed a stored session on the last CONNACK
+boolean PubSub_sessionPresent   (PubSubClient_t* self);
+
+boolean PubSub_publish          (PubSubClient_t* self, const char* topic, const uint8_t * payload, unsigned int plength, boolean addAddress);
+boolean PubSub_publishRetained  (PubSubClient_t* self, const char* topic, const uint8_t * payload, unsigned int plength, boolean retained, boolean addAddress);
+
+// QoS 1/2 publish: returns the message id, or 0 when not connected or when
+// the in-flight window is full. In MQTT 5 the window is also limited by the
+// broker's Receive Maximum, and packets over its Maximum Packet Size are
+// refused here rather than sent. Messages are resent with DUP after
+// retryMillis without an acknowledgement and after a reconnect that resumes
+// the session. When the broker starts a new session instead, they are sent
+// again as new messages, without DUP, and a QoS 2 message already released
+// (waiting for PUBCOMP) is complete. The window is count caller-provided
+// slots indexed by message id. The window can only be
+// changed while nothing is in flight: false otherwise.
+uint16_t PubSub_publishQOS      (PubSubClient_t* self, const char* topic, const uint8_t * payload, unsigned int plength, uint8_t qos, boolean retained, boolean addAddress, fpPublishCallback_t callback);
+boolean PubSub_setInflightWindow(PubSubClient_t* self, PubSubInflight_t* slots, uint16_t count, unsigned long retryMillis);
+uint16_t PubSub_inflight        (PubSubClient_t* self);
+
+// Prepared publish for topics that are published over and over: the fixed
+// header flags and the length-prefixed topic, with the address prefix when
+// addAddress is set, are encoded once into handle. preparePublish returns
+// false when the topic does not fit MQTT_PREPARED_TOPIC_LENGTH or qos is
+// above 2; a later change of address is not picked up. publishPrepared sends
+// the encoded topic as it is and only adds the remaining length, the message
+// id and the payload; in MQTT 5 the topic alias lookup takes its place. QoS 1/2 go through the in-flight window as with
+// PubSub_publishQOS(), without a callback, so the handle must stay valid
+// while its messages are in flight; only their retries build the topic
+// again.
+boolean PubSub_preparePublish   (PubSubClient_t* self, PubSubPrepared_t* handle, const char* topic, uint8_t qos, boolean retained, boolean addAddress);
+boolean PubSub_publishPrepared  (PubSubClient_t* self, const PubSubPrepared_t* handle, const uint8_t* payload, unsigned int plength);
+
+// Streaming publish: sends the header for a payload of plength bytes, which is
+// then passed in any number of writePayload calls. beginPublish returns false
+// when the header did not go out. Until endPublish nothing else may be sent
+// on the session, so PubSub_loop() does nothing meanwhile. endPublish returns
+// false when fewer bytes than announced were written; the connection is then
+// dropped, as the packet cannot be completed.
+boolean PubSub_beginPublish     (PubSubClient_t* self, const char* topic, unsigned int plength, boolean retained, boolean addAddress);
+size_t  PubSub_writePayload     (PubSubClient_t* self, const uint8_t* buf, size_t size);
+boolean PubSub_endPublish       (PubSubClient_t* self);
+void    PubSub_setChunkCallback (PubSubClient_t* self, fpChunkCallback_t callback);
+
+// Receives every PUBLISH that no subscription handler took, as a view into
+// the receive ring, in place of the session callback.
+// The ring never wraps a packet: when its end is reached the unread bytes,
+// less than one packet, are moved back to the front. Packets larger than
+// MQTT_RX_BUFFER_SIZE never reach this callback: they are streamed to the
+// chunk callback, or dropped when none is set.
+void    PubSub_setMessageCallback(PubSubClient_t* self, fpMessageCallback_t callback);
+
+// Batched publish: PUBLISH frames are packed back to back into a
+// caller-provided buffer and sent with one write. publishBatch sends the
+// messages in as few writes as the buffer allows and returns how many were
+// sent; without a buffer every message is written on its own.
+// With coalescing on (maxBytes > 0) every publish is queued the same way and
+// sent once maxBytes would be exceeded, maxDelay millis after the first
+// queued frame (checked by PubSub_loop()), before any other packet, or on
+// PubSub_flush(). Queued frames are dropped on reconnect.
+void    PubSub_setBatchBuffer   (PubSubClient_t* self, uint8_t* buf, size_t size);
+void    PubSub_setCoalescing    (PubSubClient_t* self, size_t maxBytes, unsigned long maxDelay);
+size_t  PubSub_publishBatch     (PubSubClient_t* self, const PubSubMessage_t* messages, size_t count);
+boolean PubSub_flush            (PubSubClient_t* self);
+
+// Offline store: QoS 0 publishes (plain, prepared and batched) made while the
+// session is down are appended to store instead of failing, with the full
+// topic and no MQTT 5 alias. Once connected, PubSub_loop() and
+// PubSub_flush() send them in order, MQTT_STORE_DRAIN_SIZE bytes at a time
+// and only as fast as the client takes them. New publishes queue behind them
+// until the store is empty. QoS 1/2 publishes are not stored.
+void    PubSub_setStore         (PubSubClient_t* self, PubSubStore_t* store);
+
+// Publish queue for other threads: none of the PubSub_* functions are thread
+// safe, but any thread may call PubSubQueue_publish*() on queue. The thread
+// running PubSub_loop() takes up to MQTT_QUEUE_DRAIN_COUNT messages per call
+// and sends them as one batch when a batch buffer is set. While the session
+// is down they go to the offline store when there is one, else they wait in
+// the queue. Messages that cannot be sent are dropped and counted in
+// queue->failed.
+void    PubSub_setQueue         (PubSubClient_t* self, PubSubQueue_t* queue);
+
+// Traffic shaping, see PubSubShaper.h: QoS 0 publishes (plain, prepared,
+// batched and queued) are sent by class priority and no faster than the
+// rates of shaper allow, the offline store after the realtime class. Shaped
+// frames that have to wait carry the full topic and no MQTT 5 alias.
+// Streamed publishes (beginPublish) are not shaped.
+void    PubSub_setShaper        (PubSubClient_t* self, PubSubShaper_t* shaper);
+// publishRetained in class cls, one of the PUBSUB_CLASS_* values. Without a
+// shaper the class is ignored.
+boolean PubSub_publishClass     (PubSubClient_t* self, const char* topic, const uint8_t* payload, unsigned int plength, boolean retained, boolean addAddress, uint8_t cls);
+
+// Hands the messages that no subscription handler takes to dispatcher
+// instead of the message or session callback, for instance to worker
+// threads. While dispatcher is not ready, PubSub_loop() reads no further
+// packets, so that the broker is held back by TCP flow control, and
+// PubSub_nextDeadline() asks again a millisecond later instead of counting
+// input as waiting. Held back longer than the keepalive period, the session
+// times out.
+void    PubSub_setDispatcher    (PubSubClient_t* self, PubSubDispatcher_t* dispatcher);
+// true while inbound packets are held back for the dispatcher
+boolean PubSub_inputHeld        (PubSubClient_t* self);
+
+// Keeps the latest payload of every inbound PUBLISH in cache, keyed by the
+// topic as the broker sent it, address prefix included, before the message is
+// delivered. Messages streamed through the chunk callback are not kept.
+void    PubSub_setCache         (PubSubClient_t* self, PubSubCache_t* cache);
+// The latest value of topic without waiting for a callback, valid until the
+// next PubSub_loop(). false when no cache is set or the topic has none.
+boolean PubSub_getLatest        (PubSubClient_t* self, const char* topic, PubSubCacheValue_t* value);
+
+// Subscriptions are recorded, also while not connected, until
+// PubSub_unsubscribe(), for the replay after a reconnect.
+boolean PubSub_subscribe        (PubSubClient_t* self, const char* topic);
+boolean PubSub_subscribeQOS     (PubSubClient_t* self, const char* topic, uint8_t qos, uint8_t sendAddress);
+// Subscribes and routes matching messages to handler instead of the session
+// callback. The handler stays registered until PubSub_unsubscribe() even when
+// the SUBSCRIBE could not be sent.
+boolean PubSub_subscribeHandler (PubSubClient_t* self, const char* topic, uint8_t qos, uint8_t sendAddress, fpTopicHandler_t handler);
+
+// Unsubscribes from topic as subscribed with the same sendAddress, which
+// PubSub_subscribe() sets, and forgets its record and handler
+boolean PubSub_unsubscribe      (PubSubClient_t* self, const char* topic, uint8_t sendAddress);
+
+// Batched subscribe and unsubscribe: the filters are packed into as few
+// packets as MQTT_MAX_PACKET_SIZE allows, each waiting in one of
+// MQTT_MAX_PENDING_SUBSCRIBES slots for its SUBACK or UNSUBACK. The results
+// are then written into the filters in order (in MQTT 3.1.1 an UNSUBACK has
+// none: 0) and callback, when set, is called once per packet. Filters stay
+// the caller's and must stay valid until then. Returns how many filters
+// from the start were sent: fewer than count when not connected, when all
+// slots are waiting, or at a filter that is invalid or does not fit a packet
+// on its own. When the connection goes, waiting filters fail with
+// MQTT_SUBSCRIBE_FAILED on the next connect.
+size_t  PubSub_subscribeMany    (PubSubClient_t* self, PubSubFilter_t* filters, size_t count, uint8_t sendAddress, fpSubscribeCallback_t callback);
+size_t  PubSub_unsubscribeMany  (PubSubClient_t* self, PubSubFilter_t* filters, size_t count, uint8_t sendAddress, fpSubscribeCallback_t callback);
+
+// Inbound QoS 1 and 2 messages are acknowledged (PUBACK, PUBREC) once the
+// callback returned. A QoS 2 message is delivered once: repeats of it are
+// only acknowledged again until the broker releases it. Acknowledgements are
+// collected and sent in one write at the end of PubSub_loop().
+// In deferred mode they wait instead until the application calls
+// PubSub_ack() with the msgId of the message, from any thread, for instance
+// once the message is stored. Repeats of a message waiting for that are not
+// delivered again. Up to MQTT_INBOUND_WINDOW messages wait at a time; an
+// MQTT 5 broker sends no more, beyond that MQTT 3.1.1 ones are acknowledged
+// at once and QoS 2 repeats of them are delivered again. Streamed messages
+// are always acknowledged at once. Waiting messages are forgotten when a
+// connect does not resume the session.
+void    PubSub_setDeferredAck   (PubSubClient_t* self, boolean deferred);
+// Any thread. Acknowledges the deferred message msgId with the next
+// PubSub_loop(), woken through the notify callback of the publish queue when
+// one is set. false when msgId is not waiting for it.
+boolean PubSub_ack              (PubSubClient_t* self, uint16_t msgId);
+
+boolean PubSub_loop             (PubSubClient_t* self);
+// The millis() value at which PubSub_loop() next has work to do when nothing
+// arrives: a keepalive ping or ping timeout, the CONNACK timeout, a QoS
+// retry, a coalescing flush, a managed reconnect, queued publishes or
+// acknowledgements. The current time when input is already waiting, a
+// keepalive period ahead when the session is idle or closed.
+// Event loops can sleep until then, or until the socket becomes readable.
+unsigned long PubSub_nextDeadline(PubSubClient_t* self);
+boolean PubSub_connected        (PubSubClient_t* self);
+int     PubSub_state            (PubSubClient_t* self);
+
+// Traffic counters and latency histograms of the session, updated as the
+// session runs and readable from any thread; NULL when built with
+// MQTT_STATS 0. The histograms take their time from the given microsecond
+// clock when one is set, else from millis().
+const PubSubStats_t* PubSub_getStats(PubSubClient_t* self);
+void    PubSub_resetStats       (PubSubClient_t* self);
+void    PubSub_setStatsClock    (PubSubClient_t* self, fpMillis_t micros);
+
+// MQTT remaining length codec, shared with transports and tools that frame
+// packets themselves
+uint8_t PubSub_encodeLength     (uint8_t* buf, uint32_t length);
+int     PubSub_decodeLength     (const uint8_t* buf, size_t size, uint32_t* length);
+
+/******************************************************************************
+ * Default instance API: thin wrappers around the PubSub_* functions
+ *****************************************************************************/
+PubSubClient_t* PubSubClient_getDefault(void);
+
+boolean PubSubClient_setMyAddress( const char* globalLocation, const char* localLocation, const char* deviceName);
 void    PubSubClient_init              (Client_t* client, fpMillis_t fpMillis);
 void    PubSubClient_initIP            (Client_t* client, fpMillis_t fpMillis, uint8_t *, uint16_t);
 void    PubSubClient_initIPCallback    (Client_t* client, fpMillis_t fpMillis, uint8_t *, uint16_t, MQTT_CALLBACK_SIGNATURE);
@@ -95,16 +667,36 @@ boolean PubSubClient_connectIdUserPass(const char* id, const char* user, const c
 //   boolean connect(const char* id, const char* willTopic, uint8_t willQos, boolean willRetain, const char* willMessage);
 boolean PubSubClient_connect(const char* id, const char* user, const char* pass, const char* willTopic, uint8_t willQos, boolean willRetain, const char* willMessage);
 void    PubSubClient_disconnect();
+void    PubSubClient_setReconnect(unsigned long minDelay, unsigned long maxDelay);
+void    PubSubClient_setCleanSession(boolean clean);
+boolean PubSubClient_sessionPresent();
 
 boolean PubSubClient_publish(const char* topic, const uint8_t * payload, unsigned int plength, boolean addAddress);
 boolean PubSubClient_publishRetained(const char* topic, const uint8_t * payload, unsigned int plength, boolean retained, boolean addAddress);
+boolean PubSubClient_publishClass(const char* topic, const uint8_t * payload, unsigned int plength, boolean retained, boolean addAddress, uint8_t cls);
+size_t  PubSubClient_publishBatch(const PubSubMessage_t* messages, size_t count);
+boolean PubSubClient_preparePublish(PubSubPrepared_t* handle, const char* topic, uint8_t qos, boolean retained, boolean addAddress);
+void    PubSubClient_setStore(PubSubStore_t* store);
+void    PubSubClient_setQueue(PubSubQueue_t* queue);
+void    PubSubClient_setShaper(PubSubShaper_t* shaper);
+void    PubSubClient_setDispatcher(PubSubDispatcher_t* dispatcher);
+void    PubSubClient_setCache(PubSubCache_t* cache);
+boolean PubSubClient_getLatest(const char* topic, PubSubCacheValue_t* value);
+boolean PubSubClient_publishPrepared(const PubSubPrepared_t* handle, const uint8_t* payload, unsigned int plength);
 
 boolean PubSubClient_subscribe(const char* topic);
 boolean PubSubClient_subscribeQOS(const char* topic, uint8_t qos, uint8_t sendAddress);
 
 boolean PubSubClient_unsubscribe(const char* topic);
+size_t  PubSubClient_subscribeMany(PubSubFilter_t* filters, size_t count, uint8_t sendAddress, fpSubscribeCallback_t callback);
+size_t  PubSubClient_unsubscribeMany(PubSubFilter_t* filters, size_t count, uint8_t sendAddress, fpSubscribeCallback_t callback);
+void    PubSubClient_setDeferredAck(boolean deferred);
+boolean PubSubClient_ack(uint16_t msgId);
 
 boolean PubSubClient_loop();
+unsigned long PubSubClient_nextDeadline();
 boolean PubSubClient_connected();
+int     PubSubClient_state();
+const PubSubStats_t* PubSubClient_getStats();
 
 #endif
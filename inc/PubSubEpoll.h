@@ -0,0 +1,52 @@
+/*
+ PubSubEpoll.h - epoll driver for many PubSubClient_t sessions on
+  SocketClient_t transports.
+
+ PubSub_loop() is only called for sessions whose socket became readable or
+ whose PubSub_nextDeadline() has passed.
+ Deadlines are kept in a binary heap so idle sessions cost nothing.
+
+ Nothing blocks: PubSubEpoll_add() sets the write timeout of the socket to
+ 0, so a frame larger than SOCKETCLIENT_TX_SIZE is refused rather than
+ waited for.
+*/
+
+#ifndef PubSubEpoll_h
+#define PubSubEpoll_h
+
+#include <stddef.h>
+#include "PubSubClient.h"
+#include "SocketClient.h"
+
+typedef struct
+{
+    PubSubClient_t* session;
+    SocketClient_t* socket;
+    unsigned long deadline;
+    size_t heapIndex;
+    int fd;                 // fd currently registered with epoll
+    uint32_t generation;    // socket generation of that fd
+    uint32_t events;
+} PubSubEpollEntry_t;
+
+typedef struct
+{
+    int epfd;
+    PubSubEpollEntry_t** heap;
+    size_t capacity;
+    size_t count;
+} PubSubEpoll_t;
+
+// heap provides room for capacity sessions
+bool PubSubEpoll_init   (PubSubEpoll_t* self, PubSubEpollEntry_t** heap, size_t capacity);
+void PubSubEpoll_close  (PubSubEpoll_t* self);
+bool PubSubEpoll_add    (PubSubEpoll_t* self, PubSubEpollEntry_t* entry, PubSubClient_t* session, SocketClient_t* socket);
+void PubSubEpoll_remove (PubSubEpoll_t* self, PubSubEpollEntry_t* entry);
+// Picks up a new socket or deadline after the application (re)connected or
+// published outside PubSubEpoll_run()
+bool PubSubEpoll_watch  (PubSubEpoll_t* self, PubSubEpollEntry_t* entry);
+// Waits up to timeoutMs (-1: until the next deadline) and services the
+// sessions that need it. Returns how many were serviced, -1 on error.
+int  PubSubEpoll_run    (PubSubEpoll_t* self, int timeoutMs);
+
+#endif
@@ -0,0 +1,42 @@
+/*
+ PubSubFileStore.h - Offline publish store in a memory-mapped file (POSIX).
+
+ The file is a small header followed by a fixed-size segment that is used
+ as a ring of PUBLISH frames. Frames are appended at the tail and sent from
+ the head; both offsets live in the mapped header, so whatever was stored
+ and not yet sent is still there when the process starts again. Data is
+ written back by the kernel; PubSubFileStore_sync() forces it to disk.
+*/
+
+#ifndef PubSubFileStore_h
+#define PubSubFileStore_h
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "PubSubClient.h"
+
+// What to do with a frame that does not fit the remaining space
+#define PUBSUB_STORE_DROP_NEWEST    0   // refuse the new frame
+#define PUBSUB_STORE_DROP_OLDEST    1   // drop the oldest frames to make room
+
+typedef struct
+{
+    PubSubStore_t base;
+    int fd;
+    uint8_t* map;               // file header followed by the data segment
+    size_t capacity;            // size of the data segment
+    size_t end;                 // where the older frames stop once the ring has wrapped
+    uint8_t policy;
+    unsigned long dropped;      // frames lost to the size cap
+} PubSubFileStore_t;
+
+// Opens or creates path with a data segment of capacity bytes. Frames kept
+// from an earlier run are taken over; when capacity changed, the oldest are
+// dropped as far as needed to fit.
+bool    PubSubFileStore_open    (PubSubFileStore_t* self, const char* path, size_t capacity, uint8_t policy);
+void    PubSubFileStore_close   (PubSubFileStore_t* self);
+// Bytes stored and not yet sent
+size_t  PubSubFileStore_length  (PubSubFileStore_t* self);
+bool    PubSubFileStore_sync    (PubSubFileStore_t* self);
+
+#endif
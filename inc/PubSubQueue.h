@@ -0,0 +1,81 @@
+/*
+ PubSubQueue.h - Bounded lock-free multi-producer publish queue.
+
+ Any number of threads enqueue QoS 0 publishes; the one thread that runs
+ PubSub_loop() for the session takes them out in order and sends them in
+ batches, see PubSub_setQueue(). A producer claims a slot with a single
+ compare-and-swap on the enqueue position and then fills it without
+ touching anything shared, so enqueueing never waits for the network
+ thread or for the other producers. Each slot carries a sequence number
+ that tells whether it is free, being filled or ready to send.
+ Needs the GCC / Clang __atomic builtins.
+*/
+
+#ifndef PubSubQueue_h
+#define PubSubQueue_h
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+// MQTT_QUEUE_SLOT_SIZE : Room in every slot for the topic, its NUL and a
+//  copied payload
+#ifndef MQTT_QUEUE_SLOT_SIZE
+#define MQTT_QUEUE_SLOT_SIZE 128
+#endif
+
+// PUBSUB_CACHE_LINE : Keeps the producers' enqueue position away from what
+//  the network thread writes
+#ifndef PUBSUB_CACHE_LINE
+#define PUBSUB_CACHE_LINE 64
+#endif
+
+// Gives a handed over payload back to its owner, on the network thread,
+// once the message was sent or dropped
+typedef void (*fpQueueRelease_t)(void* context, const uint8_t* payload, unsigned int plength);
+// Called by a producer when the queue was empty before its message, so that
+// a network thread sleeping in poll or epoll can be woken
+typedef void (*fpQueueNotify_t)(void* context);
+
+typedef struct
+{
+    size_t sequence;
+    const uint8_t* payload;         // into data, or handed over
+    unsigned int plength;
+    fpQueueRelease_t release;       // NULL when the payload was copied
+    void* context;
+    bool retained;
+    bool addAddress;
+    char data[MQTT_QUEUE_SLOT_SIZE];    // topic, NUL, copied payload
+} PubSubQueueSlot_t;
+
+typedef struct
+{
+    size_t enqueue;                 // next position, shared by the producers
+    uint8_t pad[PUBSUB_CACHE_LINE - sizeof(size_t)];
+    size_t dequeue;                 // next position to send, network thread
+    PubSubQueueSlot_t* slots;
+    size_t mask;
+    fpQueueNotify_t notify;
+    void* notifyContext;
+    unsigned long full;             // publishes refused for lack of a slot
+    unsigned long failed;           // taken out but not sent
+} PubSubQueue_t;
+
+// count caller-provided slots, a power of two of at least 2
+bool    PubSubQueue_init        (PubSubQueue_t* self, PubSubQueueSlot_t* slots, size_t count);
+void    PubSubQueue_setNotify   (PubSubQueue_t* self, fpQueueNotify_t notify, void* context);
+
+// Any thread. Copies topic and payload into a slot; false when the queue is
+// full or they do not fit MQTT_QUEUE_SLOT_SIZE.
+bool    PubSubQueue_publish     (PubSubQueue_t* self, const char* topic, const uint8_t* payload, unsigned int plength, bool retained, bool addAddress);
+// Any thread. Only the topic is copied; payload is handed over and given
+// back through release. On false it stays with the caller.
+bool    PubSubQueue_publishOwned(PubSubQueue_t* self, const char* topic, const uint8_t* payload, unsigned int plength, bool retained, bool addAddress, fpQueueRelease_t release, void* context);
+
+// Network thread only: the oldest message, NULL when there is none ready,
+// and taking it out once it was handled
+const PubSubQueueSlot_t* PubSubQueue_peek(PubSubQueue_t* self);
+void    PubSubQueue_pop         (PubSubQueue_t* self);
+
+#endif
@@ -0,0 +1,102 @@
+/*
+ PubSubShaper.h - Outbound traffic shaping: priority classes and token
+  bucket rate limits.
+
+ Set on a session, see PubSub_setShaper(), the shaper puts QoS 0 publishes in
+ one of PUBSUB_CLASSES classes and holds the session to a rate of bytes and
+ of messages per second. A publish goes out at once while the rate allows it
+ and nothing of its own or a higher class is waiting. Otherwise its frame is
+ copied into the caller-provided queue of its class, and PubSub_loop() sends
+ the queued frames as tokens come in, highest class first. Order is kept
+ within a class; a lower class is overtaken.
+
+ PUBSUB_CLASS_CONTROL is never held back, only counted against the rate, and
+ neither is what the session sends on its own: CONNECT, PINGREQ, PINGRESP,
+ acknowledgements, (UN)SUBSCRIBE, DISCONNECT, QoS 1 and 2 publishes with
+ their retries, and publishes streamed with PubSub_beginPublish(). Bulk data
+ then cannot hold up the keepalive. The offline store drains like
+ PUBSUB_CLASS_BULK, each chunk admitted at its size.
+*/
+
+#ifndef PubSubShaper_h
+#define PubSubShaper_h
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "Client.h"
+
+#define PUBSUB_CLASS_CONTROL    0
+#define PUBSUB_CLASS_REALTIME   1
+#define PUBSUB_CLASS_BULK       2
+#define PUBSUB_CLASSES          3
+
+// MQTT_SHAPER_DEFAULT_CLASS : Class of publishes that do not name one
+#ifndef MQTT_SHAPER_DEFAULT_CLASS
+#define MQTT_SHAPER_DEFAULT_CLASS PUBSUB_CLASS_REALTIME
+#endif
+
+typedef struct
+{
+    uint8_t* data;                  // ring of frames, each after its length
+    size_t size;
+    size_t head;                    // offset of the oldest frame
+    size_t length;                  // bytes queued: the depth
+    size_t frames;                  // frames queued
+    unsigned long sent;
+    unsigned long dropped;          // refused for lack of room
+} PubSubShaperQueue_t;
+
+typedef struct
+{
+    int64_t tokens;                 // thousandths, below 0 after a debt
+    uint32_t rate;                  // per second, 0 for no limit
+    uint32_t burst;                 // most tokens saved up
+} PubSubBucket_t;
+
+typedef struct
+{
+    PubSubShaperQueue_t queues[PUBSUB_CLASSES];
+    PubSubBucket_t bytes;
+    PubSubBucket_t messages;
+    unsigned long last;             // time of the last refill
+    bool started;
+    bool throttling;                // frames are waiting for tokens
+    unsigned long throttledSince;
+    unsigned long throttled;        // millis frames waited for tokens, past periods
+} PubSubShaper_t;
+
+// No queues and no limits
+void    PubSubShaper_init       (PubSubShaper_t* self);
+// size bytes of memory for the frames of class cls. A class without memory
+// only takes publishes that can go out at once.
+bool    PubSubShaper_setQueue   (PubSubShaper_t* self, uint8_t cls, void* memory, size_t size);
+// Rates per second, 0 for no limit. A burst of 0 allows one second's worth.
+// Frames larger than the byte burst are sent once the bucket is full.
+void    PubSubShaper_setRate    (PubSubShaper_t* self, uint32_t bytesPerSecond, uint32_t byteBurst, uint32_t messagesPerSecond, uint32_t messageBurst);
+
+// Millis until a frame of size bytes may be sent, 0 when it may go now
+unsigned long PubSubShaper_wait (PubSubShaper_t* self, size_t size, unsigned long now);
+// true when a frame of size bytes may be sent now, also keeping track of
+// the time frames are throttled
+bool    PubSubShaper_admit      (PubSubShaper_t* self, size_t size, unsigned long now);
+// Takes the tokens for what was sent
+void    PubSubShaper_charge     (PubSubShaper_t* self, size_t bytes, size_t messages);
+// Millis frames waited for tokens, the current wait included
+unsigned long PubSubShaper_throttled(const PubSubShaper_t* self, unsigned long now);
+
+// Appends one frame of size bytes given as count segments, false when it does
+// not fit
+bool    PubSubShaper_append     (PubSubShaper_t* self, uint8_t cls, const struct iovec* iov, int count, size_t size);
+// The highest class with frames queued, -1 when there is none
+int     PubSubShaper_next       (const PubSubShaper_t* self);
+// true when frames of class cls or a higher one are queued
+bool    PubSubShaper_waiting    (const PubSubShaper_t* self, uint8_t cls);
+// Size of the oldest frame of class cls, 0 when there is none
+size_t  PubSubShaper_frame      (const PubSubShaper_t* self, uint8_t cls);
+// Points data at byte offset of that frame, returns how many follow in one
+// piece
+size_t  PubSubShaper_peek       (const PubSubShaper_t* self, uint8_t cls, size_t offset, const uint8_t** data);
+void    PubSubShaper_pop        (PubSubShaper_t* self, uint8_t cls);
+
+#endif
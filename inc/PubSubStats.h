@@ -0,0 +1,66 @@
+/*
+ PubSubStats.h - Counters and latency histograms of a session, with text
+  and JSON output for monitoring.
+
+ Counters are only written by the thread running the session. An update is a
+ relaxed atomic load and store rather than a locked add, which is enough with
+ a single writer and lets another thread read any single value at any time
+ without tearing. A snapshot of several values is not taken atomically as a
+ whole.
+*/
+
+#ifndef PubSubStats_h
+#define PubSubStats_h
+
+#include <stdint.h>
+#include <stddef.h>
+
+// MQTT_STATS_BUCKETS : Histogram buckets on a log2 scale. Bucket 0 counts
+//  the value 0, bucket i the values from 2^(i-1) up to 2^i - 1 and the last
+//  one everything above.
+#ifndef MQTT_STATS_BUCKETS
+#define MQTT_STATS_BUCKETS 24
+#endif
+
+#if defined(__GNUC__)
+#define PUBSUB_STAT_ADD(var, n)     __atomic_store_n(&(var), __atomic_load_n(&(var), __ATOMIC_RELAXED) + (n), __ATOMIC_RELAXED)
+#define PUBSUB_STAT_SET(var, n)     __atomic_store_n(&(var), (n), __ATOMIC_RELAXED)
+#define PUBSUB_STAT_LOAD(var)       __atomic_load_n(&(var), __ATOMIC_RELAXED)
+#else
+#define PUBSUB_STAT_ADD(var, n)     ((var) += (n))
+#define PUBSUB_STAT_SET(var, n)     ((var) = (n))
+#define PUBSUB_STAT_LOAD(var)       (var)
+#endif
+
+typedef struct
+{
+    unsigned long count;
+    unsigned long sum;
+    unsigned long max;
+    unsigned long buckets[MQTT_STATS_BUCKETS];
+} PubSubHistogram_t;
+
+typedef struct
+{
+    unsigned long packetsIn[16];        // indexed by packet type, MQTTPUBLISH >> 4 etc.
+    unsigned long packetsOut[16];
+    unsigned long bytesIn;
+    unsigned long bytesOut;
+    unsigned long droppedOversize;      // inbound packets too large to handle
+    unsigned long shortWrites;          // writes the client took only part of
+    PubSubHistogram_t pingRtt;          // microseconds from PINGREQ to PINGRESP
+    PubSubHistogram_t callbackTime;     // microseconds delivering an inbound PUBLISH
+} PubSubStats_t;
+
+void          PubSubStats_record     (PubSubHistogram_t* histogram, unsigned long value);
+// Largest value counted in bucket i
+unsigned long PubSubStats_bucketLimit(uint8_t i);
+
+// Write the stats into buf, NUL terminated, and return the full length as
+// snprintf does: the output was cut short when that is size or more. Text is
+// in the Prometheus exposition format with metric names starting with
+// prefix, JSON is a single object.
+size_t        PubSubStats_formatText (const PubSubStats_t* stats, const char* prefix, char* buf, size_t size);
+size_t        PubSubStats_formatJson (const PubSubStats_t* stats, char* buf, size_t size);
+
+#endif
@@ -0,0 +1,90 @@
+/*
+ PubSubWorkers.h - Pool of worker threads running the message callback
+  (POSIX threads).
+
+ Set as the dispatcher of a session, see PubSub_setDispatcher(), the pool
+ takes inbound messages off the network thread. Each message is copied into
+ the bounded queue of one worker, picked by a hash of its topic: messages on
+ one topic are handled in the order they arrived, messages on different
+ topics in parallel. Once any queue is full the session stops reading until
+ its worker has made room.
+
+ The callback runs on the workers. Of the session it may only call
+ PubSub_ack(), which goes well with deferred acknowledgements, and publish
+ through a PubSubQueue_t. Sessions sharing a pool must all be run by the same
+ thread.
+*/
+
+#ifndef PubSubWorkers_h
+#define PubSubWorkers_h
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <pthread.h>
+#include "PubSubClient.h"
+
+// MQTT_WORKER_SLOT_SIZE : Room in every queue slot for the topic, its NUL,
+//  the MQTT 5 properties and the payload. The default holds any message a
+//  receive ring of the default MQTT_RX_BUFFER_SIZE can.
+#ifndef MQTT_WORKER_SLOT_SIZE
+#if MQTT_VERSION == MQTT_VERSION_5
+#define MQTT_WORKER_SLOT_SIZE (MQTT_RX_BUFFER_SIZE + MQTT_TOPIC_ALIAS_LENGTH)
+#else
+#define MQTT_WORKER_SLOT_SIZE MQTT_RX_BUFFER_SIZE
+#endif
+#endif
+
+typedef struct
+{
+    PubSubClient_t* client;
+    uint16_t topicLength;
+    uint32_t propertiesLength;
+    uint32_t payloadLength;
+    uint16_t msgId;
+    uint8_t qos;
+    bool retain;
+    bool dup;
+    char data[MQTT_WORKER_SLOT_SIZE];   // topic, NUL, properties, payload
+} PubSubWorkerSlot_t;
+
+struct PubSubWorkers_t;
+
+typedef struct
+{
+    struct PubSubWorkers_t* pool;
+    PubSubWorkerSlot_t* slots;
+    size_t head;                // next slot to handle, worker
+    size_t tail;                // next slot to fill, network thread
+    size_t count;               // filled slots, changed under lock
+    pthread_mutex_t lock;
+    pthread_cond_t filled;
+    pthread_t thread;
+} PubSubWorker_t;
+
+typedef struct PubSubWorkers_t
+{
+    PubSubDispatcher_t base;
+    PubSubWorker_t* workers;
+    size_t count;
+    size_t depth;
+    fpMessageCallback_t callback;
+    fpQueueNotify_t notify;
+    void* notifyContext;
+    bool running;
+    bool held;                  // the sessions were last told to wait
+    unsigned long stalls;       // times the sessions had to stop reading
+    unsigned long dropped;      // larger than a slot, or after the stop
+} PubSubWorkers_t;
+
+// Starts count threads, each with a queue of depth of the caller-provided
+// slots (count * depth of them), running callback for the messages
+bool    PubSubWorkers_start     (PubSubWorkers_t* self, PubSubWorker_t* workers, size_t count, PubSubWorkerSlot_t* slots, size_t depth, fpMessageCallback_t callback);
+// notify is called by a worker that made room in a full queue, so that a
+// network thread sleeping in poll or epoll can be woken to read on
+void    PubSubWorkers_setNotify (PubSubWorkers_t* self, fpQueueNotify_t notify, void* context);
+// Lets the workers handle what is queued, then joins them. Messages
+// dispatched after that are dropped.
+void    PubSubWorkers_stop      (PubSubWorkers_t* self);
+
+#endif
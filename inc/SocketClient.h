@@ -0,0 +1,66 @@
+/*
+ SocketClient.h - Non-blocking POSIX TCP implementation of Client_t.
+
+ Received data goes through a per-connection buffer, so available(), read()
+ and peek() only reach the socket when that buffer is empty. Writes that the
+ socket cannot take right away are kept in a send buffer and pushed out by
+ flush(), which an event loop calls when the socket becomes writable.
+
+ A write takes all of its data or none of it. One that does not fit behind
+ data already queued is refused whole. Whatever the socket does not take of
+ a frame that fits the send buffer is queued, so the write returns at once.
+ Only a frame larger than the send buffer blocks: it waits in poll() for the
+ socket, at most the write timeout in all, and drops the connection when
+ the socket stalls, since the frame can no longer be completed. An event
+ loop that must never block sets the timeout to 0, which refuses such
+ frames, or sizes SOCKETCLIENT_TX_SIZE above the largest frame it sends.
+*/
+
+#ifndef SocketClient_h
+#define SocketClient_h
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "Client.h"
+
+// SOCKETCLIENT_RX_SIZE : Receive buffer per connection
+#ifndef SOCKETCLIENT_RX_SIZE
+#define SOCKETCLIENT_RX_SIZE 2048
+#endif
+
+// SOCKETCLIENT_TX_SIZE : Send buffer per connection for data the socket
+//  could not take immediately
+#ifndef SOCKETCLIENT_TX_SIZE
+#define SOCKETCLIENT_TX_SIZE 2048
+#endif
+
+// SOCKETCLIENT_WRITE_TIMEOUT : Default of the millis a write may wait in all
+//  for the socket to take a frame that does not fit the send buffer
+#ifndef SOCKETCLIENT_WRITE_TIMEOUT
+#define SOCKETCLIENT_WRITE_TIMEOUT 5000
+#endif
+
+typedef struct
+{
+    Client_t base;
+    int fd;
+    bool open;
+    uint32_t generation;    // counts sockets opened, so reused fds can be told apart
+    unsigned long writeTimeout;
+    uint16_t rxHead;
+    uint16_t rxTail;
+    uint16_t txHead;
+    uint16_t txTail;
+    uint8_t rx[SOCKETCLIENT_RX_SIZE];
+    uint8_t tx[SOCKETCLIENT_TX_SIZE];
+} SocketClient_t;
+
+void    SocketClient_init       (SocketClient_t* self);
+int     SocketClient_fd         (SocketClient_t* self);
+// true while data is waiting in the send buffer
+bool    SocketClient_pending    (SocketClient_t* self);
+// Millis a write may block on a frame larger than the send buffer, 0 to
+// refuse such frames instead
+void    SocketClient_setWriteTimeout(SocketClient_t* self, unsigned long timeoutMs);
+
+#endif
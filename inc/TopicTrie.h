@@ -0,0 +1,61 @@
+/*
+ TopicTrie.h - Registry of subscription filters, one trie level per topic
+  level, with MQTT '+' and '#' wildcard matching.
+*/
+
+#ifndef TopicTrie_h
+#define TopicTrie_h
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include "PubSubAlloc.h"
+
+struct PubSubClient_t;
+
+// Handles an inbound PUBLISH whose topic matches the filter it was
+// registered for
+typedef void (*fpTopicHandler_t)(struct PubSubClient_t* client, char* topic, uint8_t* payload, unsigned int length);
+
+typedef struct TopicTrieNode_t TopicTrieNode_t;
+
+// Called for every filter that matches a topic
+typedef void (*fpTopicTrieVisit_t)(const TopicTrieNode_t* node, void* context);
+
+struct TopicTrieNode_t
+{
+    TopicTrieNode_t*  parent;
+    TopicTrieNode_t** children;     // open addressing, childCapacity entries
+    TopicTrieNode_t*  plus;         // '+' child
+    TopicTrieNode_t*  hash;         // '#' child
+    fpTopicHandler_t  handler;
+    uint32_t childCapacity;
+    uint32_t childCount;
+    uint16_t length;
+    uint8_t  qos;
+    bool     subscribed;
+    char     level[];
+};
+
+typedef struct
+{
+    TopicTrieNode_t* root;
+    size_t count;
+    PubSubAllocator_t* allocator;   // nodes and child tables, NULL for the C heap
+} TopicTrie_t;
+
+// A zero-initialised TopicTrie_t is an empty trie. Its allocator may only
+// be changed before the first insert or after TopicTrie_free().
+bool   TopicTrie_insert (TopicTrie_t* self, const char* filter, fpTopicHandler_t handler, uint8_t qos);
+bool   TopicTrie_remove (TopicTrie_t* self, const char* filter);
+int    TopicTrie_match  (const TopicTrie_t* self, const char* topic, fpTopicTrieVisit_t visit, void* context);
+// The node registered for exactly this filter, NULL when there is none
+const TopicTrieNode_t* TopicTrie_find(TopicTrie_t* self, const char* filter);
+// Calls visit once for every registered filter
+void   TopicTrie_walk   (const TopicTrie_t* self, fpTopicTrieVisit_t visit, void* context);
+// Writes the filter a node stands for, NUL terminated, into buf. Returns its
+// length, or 0 when it does not fit size.
+size_t TopicTrie_filter (const TopicTrieNode_t* node, char* buf, size_t size);
+void   TopicTrie_free   (TopicTrie_t* self);
+
+#endif
@@ -0,0 +1,143 @@
+/*
+ PubSubAlloc.c - Allocator interface for session buffers and the
+  subscription registry, with a fixed-block pool and a bump arena on
+  caller-provided memory.
+*/
+
+#include "PubSubAlloc.h"
+#include <stdlib.h>
+
+#define ALIGN_UP(n)     (((n) + PUBSUB_ALLOC_ALIGN - 1) & ~((size_t)PUBSUB_ALLOC_ALIGN - 1))
+#define POOL(a)         ((PubSubPool_t*)(a))
+#define ARENA(a)        ((PubSubArena_t*)(a))
+
+/******************************************************************************
+ * Private Function Prototypes
+ *****************************************************************************/
+static void*   poolAlloc   (PubSubAllocator_t* a, size_t size);
+static void    poolFree    (PubSubAllocator_t* a, void* ptr, size_t size);
+static void*   arenaAlloc  (PubSubAllocator_t* a, size_t size);
+static void    arenaFree   (PubSubAllocator_t* a, void* ptr, size_t size);
+
+/******************************************************************************
+ * Private Function Implementation
+ *****************************************************************************/
+static void* poolAlloc(PubSubAllocator_t* a, size_t size)
+{
+    PubSubPool_t* self = POOL(a);
+    void* block = self->next;
+
+    if ((block == NULL) || (size > self->blockSize))
+    {
+        return NULL;
+    }
+    // A free block starts with the link to the next one
+    self->next = *(void**)block;
+    self->available--;
+    return block;
+}
+
+static void poolFree(PubSubAllocator_t* a, void* ptr, size_t size)
+{
+    PubSubPool_t* self = POOL(a);
+
+    (void)size;
+    *(void**)ptr = self->next;
+    self->next = ptr;
+    self->available++;
+}
+
+static void* arenaAlloc(PubSubAllocator_t* a, size_t size)
+{
+    PubSubArena_t* self = ARENA(a);
+    size_t need = ALIGN_UP(size);
+    void* ptr;
+
+    if ((need < size) || (need > self->size - self->used))
+    {
+        return NULL;
+    }
+    ptr = &self->memory[self->used];
+    self->used += need;
+    return ptr;
+}
+
+// Only the latest piece goes back; anything else waits for the reset
+static void arenaFree(PubSubAllocator_t* a, void* ptr, size_t size)
+{
+    PubSubArena_t* self = ARENA(a);
+    size_t need = ALIGN_UP(size);
+
+    if ((uint8_t*)ptr + need == &self->memory[self->used])
+    {
+        self->used -= need;
+    }
+}
+
+/******************************************************************************
+ * Function implementation
+ *****************************************************************************/
+void* PubSubAlloc_alloc(PubSubAllocator_t* allocator, size_t size)
+{
+    if (allocator == NULL)
+    {
+        return malloc(size);
+    }
+    return allocator->alloc(allocator, size);
+}
+
+void PubSubAlloc_free(PubSubAllocator_t* allocator, void* ptr, size_t size)
+{
+    if (ptr == NULL)
+    {
+        return;
+    }
+    if (allocator == NULL)
+    {
+        free(ptr);
+        return;
+    }
+    allocator->free(allocator, ptr, size);
+}
+
+bool PubSubPool_init(PubSubPool_t* self, void* memory, size_t size, size_t blockSize)
+{
+    size_t count;
+    size_t i;
+
+    if (blockSize < sizeof(void*))
+    {
+        blockSize = sizeof(void*);
+    }
+    blockSize = ALIGN_UP(blockSize);
+    count = size / blockSize;
+    if (count == 0)
+    {
+        return false;
+    }
+    self->base.alloc = poolAlloc;
+    self->base.free = poolFree;
+    self->blockSize = blockSize;
+    self->available = count;
+    self->next = memory;
+    for (i = 0; i < count; i++)
+    {
+        uint8_t* block = (uint8_t*)memory + i * blockSize;
+        *(void**)block = (i + 1 < count) ? block + blockSize : NULL;
+    }
+    return true;
+}
+
+void PubSubArena_init(PubSubArena_t* self, void* memory, size_t size)
+{
+    self->base.alloc = arenaAlloc;
+    self->base.free = arenaFree;
+    self->memory = (uint8_t*)memory;
+    self->size = size;
+    self->used = 0;
+}
+
+void PubSubArena_reset(PubSubArena_t* self)
+{
+    self->used = 0;
+}
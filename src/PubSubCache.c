@@ -0,0 +1,352 @@
+/*
+ PubSubCache.c - Last value per topic, with a memory budget and least
+  recently used eviction.
+
+ The table is probed linearly from the hash of the topic. Removing an entry
+ moves the ones after it back to where a lookup finds them, so there are no
+ tombstones and a lookup stops at the first free entry. The entries in use
+ are also linked from the newest to the oldest by index; that list is what
+ gets evicted from.
+*/
+
+#include "PubSubCache.h"
+#include <string.h>
+
+#define NONE            0xFFFFFFFFUL
+#define TOPIC(e)        ((const char*)(e)->data)
+#define PAYLOAD(e)      (&(e)->data[(e)->topicLength + 1])
+
+/******************************************************************************
+ * Private Function Prototypes
+ *****************************************************************************/
+static uint32_t hashTopic   (const char* topic, uint16_t length);
+static uint32_t find        (PubSubCache_t* self, uint32_t hash, const char* topic, uint16_t length);
+static void     detach      (PubSubCache_t* self, uint32_t i);
+static void     linkNewest  (PubSubCache_t* self, uint32_t i);
+static void     touch       (PubSubCache_t* self, uint32_t i);
+static void     erase       (PubSubCache_t* self, uint32_t i);
+static void     valueOf     (PubSubCache_t* self, uint32_t i, PubSubCacheValue_t* value);
+
+/******************************************************************************
+ * Private Function Implementation
+ *****************************************************************************/
+// FNV-1a
+static uint32_t hashTopic(const char* topic, uint16_t length)
+{
+    uint32_t h = 2166136261UL;
+    uint16_t i;
+    for (i = 0; i < length; i++)
+    {
+        h ^= (uint8_t)topic[i];
+        h *= 16777619UL;
+    }
+    return h;
+}
+
+// Index of the entry of topic, NONE when it is not there
+static uint32_t find(PubSubCache_t* self, uint32_t hash, const char* topic, uint16_t length)
+{
+    uint32_t i = hash & self->mask;
+
+    while (self->entries[i].data != NULL)
+    {
+        PubSubCacheEntry_t* e = &self->entries[i];
+        if ((e->hash == hash) && (e->topicLength == length) && (memcmp(e->data, topic, length) == 0))
+        {
+            return i;
+        }
+        i = (i + 1) & self->mask;
+    }
+    return NONE;
+}
+
+static void detach(PubSubCache_t* self, uint32_t i)
+{
+    PubSubCacheEntry_t* e = &self->entries[i];
+
+    if (e->newer != NONE)
+    {
+        self->entries[e->newer].older = e->older;
+    }
+    else
+    {
+        self->newest = e->older;
+    }
+    if (e->older != NONE)
+    {
+        self->entries[e->older].newer = e->newer;
+    }
+    else
+    {
+        self->oldest = e->newer;
+    }
+}
+
+static void linkNewest(PubSubCache_t* self, uint32_t i)
+{
+    PubSubCacheEntry_t* e = &self->entries[i];
+
+    e->newer = NONE;
+    e->older = self->newest;
+    if (self->newest != NONE)
+    {
+        self->entries[self->newest].newer = i;
+    }
+    else
+    {
+        self->oldest = i;
+    }
+    self->newest = i;
+}
+
+static void touch(PubSubCache_t* self, uint32_t i)
+{
+    if (self->newest != i)
+    {
+        detach(self, i);
+        linkNewest(self, i);
+    }
+}
+
+// Frees entry i, then moves every entry of the probe run after it that would
+// no longer be found into the gap
+static void erase(PubSubCache_t* self, uint32_t i)
+{
+    PubSubCacheEntry_t* e = &self->entries[i];
+    uint32_t j = i;
+
+    PubSubAlloc_free(self->allocator, e->data, e->size);
+    self->used -= e->size;
+    self->count--;
+    detach(self, i);
+    e->data = NULL;
+
+    while (1)
+    {
+        j = (j + 1) & self->mask;
+        e = &self->entries[j];
+        if (e->data == NULL)
+        {
+            break;
+        }
+        uint32_t home = e->hash & self->mask;
+        // Stays when its home lies cyclically in (i, j]
+        if ((i <= j) ? ((i < home) && (home <= j)) : ((i < home) || (home <= j)))
+        {
+            continue;
+        }
+        self->entries[i] = *e;
+        if (e->newer != NONE)
+        {
+            self->entries[e->newer].older = i;
+        }
+        else
+        {
+            self->newest = i;
+        }
+        if (e->older != NONE)
+        {
+            self->entries[e->older].newer = i;
+        }
+        else
+        {
+            self->oldest = i;
+        }
+        e->data = NULL;
+        i = j;
+    }
+}
+
+static void valueOf(PubSubCache_t* self, uint32_t i, PubSubCacheValue_t* value)
+{
+    PubSubCacheEntry_t* e = &self->entries[i];
+
+    value->topic = TOPIC(e);
+    value->topicLength = e->topicLength;
+    value->payload = PAYLOAD(e);
+    value->payloadLength = e->payloadLength;
+    value->received = e->received;
+    value->retain = e->retain;
+}
+
+/******************************************************************************
+ * Function implementation
+ *****************************************************************************/
+bool PubSubCache_init(PubSubCache_t* self, PubSubCacheEntry_t* entries, size_t count, size_t budget, PubSubAllocator_t* allocator)
+{
+    if ((count < 4) || (count > 0x80000000UL) || ((count & (count - 1)) != 0))
+    {
+        return false;
+    }
+    memset(self, 0, sizeof(*self));
+    memset(entries, 0, count * sizeof(*entries));
+    self->entries = entries;
+    self->mask = (uint32_t)(count - 1);
+    self->limit = (uint32_t)(count - count / 4);
+    self->newest = NONE;
+    self->oldest = NONE;
+    self->budget = budget;
+    self->allocator = allocator;
+    return true;
+}
+
+void PubSubCache_setChanged(PubSubCache_t* self, fpCacheChanged_t changed, void* context)
+{
+    self->changed = changed;
+    self->changedContext = context;
+}
+
+bool PubSubCache_store(PubSubCache_t* self, const char* topic, uint16_t topicLength, const uint8_t* payload, uint32_t payloadLength, bool retain, unsigned long now)
+{
+    uint32_t hash = hashTopic(topic, topicLength);
+    uint32_t i = find(self, hash, topic, topicLength);
+    size_t need = (size_t)topicLength + 1 + payloadLength;
+    PubSubCacheEntry_t* e;
+    PubSubCacheValue_t value;
+
+    if (retain && (payloadLength == 0))
+    {
+        if (i != NONE)
+        {
+            erase(self, i);
+            if (self->changed != NULL)
+            {
+                value.topic = topic;
+                value.topicLength = topicLength;
+                value.payload = NULL;
+                value.payloadLength = 0;
+                value.received = now;
+                value.retain = true;
+                self->changed(self->changedContext, &value);
+            }
+        }
+        return true;
+    }
+
+    if (i != NONE)
+    {
+        e = &self->entries[i];
+        if ((e->payloadLength == payloadLength) &&
+            ((payloadLength == 0) || (memcmp(PAYLOAD(e), payload, payloadLength) == 0)))
+        {
+            // Same value again
+            e->received = now;
+            e->retain = retain;
+            touch(self, i);
+            return true;
+        }
+        if ((need > e->size) || (need < e->size / 2))
+        {
+            // Allocated anew below
+            erase(self, i);
+            i = NONE;
+        }
+    }
+
+    if (i == NONE)
+    {
+        uint8_t* data;
+
+        if (need > self->budget)
+        {
+            self->rejected++;
+            return false;
+        }
+        while ((self->count >= self->limit) || (self->used + need > self->budget))
+        {
+            erase(self, self->oldest);
+            self->evictions++;
+        }
+        while ((data = PubSubAlloc_alloc(self->allocator, need)) == NULL)
+        {
+            if (self->count == 0)
+            {
+                self->rejected++;
+                return false;
+            }
+            erase(self, self->oldest);
+            self->evictions++;
+        }
+        i = hash & self->mask;
+        while (self->entries[i].data != NULL)
+        {
+            i = (i + 1) & self->mask;
+        }
+        e = &self->entries[i];
+        e->data = data;
+        e->size = need;
+        e->hash = hash;
+        e->topicLength = topicLength;
+        memcpy(e->data, topic, topicLength);
+        e->data[topicLength] = 0;
+        self->used += need;
+        self->count++;
+        linkNewest(self, i);
+    }
+    else
+    {
+        touch(self, i);
+    }
+
+    if (payloadLength > 0)
+    {
+        memcpy(PAYLOAD(e), payload, payloadLength);
+    }
+    e->payloadLength = payloadLength;
+    e->received = now;
+    e->retain = retain;
+    if (self->changed != NULL)
+    {
+        valueOf(self, i, &value);
+        self->changed(self->changedContext, &value);
+    }
+    return true;
+}
+
+bool PubSubCache_get(PubSubCache_t* self, const char* topic, PubSubCacheValue_t* value)
+{
+    uint16_t length = (uint16_t)strlen(topic);
+    uint32_t i = find(self, hashTopic(topic, length), topic, length);
+
+    if (i == NONE)
+    {
+        self->misses++;
+        return false;
+    }
+    self->hits++;
+    touch(self, i);
+    valueOf(self, i, value);
+    return true;
+}
+
+bool PubSubCache_remove(PubSubCache_t* self, const char* topic)
+{
+    uint16_t length = (uint16_t)strlen(topic);
+    uint32_t i = find(self, hashTopic(topic, length), topic, length);
+
+    if (i == NONE)
+    {
+        return false;
+    }
+    erase(self, i);
+    return true;
+}
+
+void PubSubCache_clear(PubSubCache_t* self)
+{
+    uint32_t i;
+
+    for (i = 0; i <= self->mask; i++)
+    {
+        PubSubCacheEntry_t* e = &self->entries[i];
+        if (e->data != NULL)
+        {
+            PubSubAlloc_free(self->allocator, e->data, e->size);
+            e->data = NULL;
+        }
+    }
+    self->count = 0;
+    self->used = 0;
+    self->newest = NONE;
+    self->oldest = NONE;
+}
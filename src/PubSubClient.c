@@ -8,638 +8,3566 @@
 #include <stdint.h>
 #include <string.h>
 
+// The variable header of an outbound PUBLISH apart from the message id: how
+// much of the address prefix and topic is sent, and the property block
+typedef struct
+{
+    size_t alen;
+    size_t tlen;
+    const uint8_t* encoded;     // topic length and tlen topic bytes sent as they are, or NULL
+    uint8_t props[4];
+    uint8_t plen;
+    int16_t assign;     // outbound alias slot this packet introduces, -1 if none
+} publishParts_t;
+
+// A SUBSCRIBE being filled by replaySubscriptions()
+typedef struct
+{
+    PubSubClient_t* client;
+    uint16_t length;        // 0 while none is started
+} replay_t;
+
 /******************************************************************************
  * Private Function Prototypes
  *****************************************************************************/
-static void setServerIP(uint8_t * ip, uint16_t port);
-static void setServerHost(const char * domain, uint16_t port);
-static void setCallback(MQTT_CALLBACK_SIGNATURE);
-static void setClient(Client_t* client);
-static boolean  readByte    (uint8_t* result);
-static boolean  readBytePos (uint8_t* result, uint16_t * index);
-static uint16_t readPacket  (uint8_t* lengthLength);
-
-static boolean  write       (uint8_t header, uint8_t* buf, uint16_t length);
+static void setServerIP(PubSubClient_t* self, uint8_t * ip, uint16_t port);
+static void setServerHost(PubSubClient_t* self, const char * domain, uint16_t port);
+static void setCallback(PubSubClient_t* self, MQTT_CALLBACK_SIGNATURE);
+static void setClient(PubSubClient_t* self, Client_t* client, fpMillis_t fpMillis);
+static boolean  allocateBuffers(PubSubClient_t* self);
+static void     releaseBuffers(PubSubClient_t* self);
+static char*    buildFilter (PubSubClient_t* self, const char* topic, uint8_t sendAddress);
+static void     ringFill    (PubSubClient_t* self, size_t need);
+static void     ringConsume (PubSubClient_t* self, size_t size);
+static boolean  readHeader  (PubSubClient_t* self);
+static boolean  readStreamHeader(PubSubClient_t* self);
+static uint32_t readPacket  (PubSubClient_t* self, uint8_t** packet, uint8_t* lengthLength);
+static void     dispatch    (PubSubClient_t* self, PubSubMessageView_t* message);
+#if MQTT_STATS
+static unsigned long statsNow(PubSubClient_t* self);
+#endif
+static void     handlePacket(PubSubClient_t* self, uint8_t* packet, uint32_t len, uint8_t llen);
+static void     setState    (PubSubClient_t* self, int state);
+static void     scheduleReconnect(PubSubClient_t* self);
+static void     sendReplay  (replay_t* r);
+static void     replayFilter(const TopicTrieNode_t* node, void* context);
+static void     replaySubscriptions(PubSubClient_t* self);
+static boolean  canSubscribe(PubSubClient_t* self, const char* topic, uint8_t qos, uint8_t sendAddress);
+static void     recordFilter(PubSubClient_t* self, const char* topic, uint8_t qos, uint8_t sendAddress, boolean subscribe);
+static size_t   sendFilters (PubSubClient_t* self, uint8_t header, PubSubFilter_t* filters, size_t count, uint8_t sendAddress, fpSubscribeCallback_t callback);
+static void     completePending(PubSubClient_t* self, uint8_t ack, uint16_t msgId, const uint8_t* codes, size_t count);
+static uint32_t* findInbound(PubSubClient_t* self, uint16_t msgId);
+static boolean  addInbound  (PubSubClient_t* self, uint16_t msgId, uint8_t qos, uint8_t state);
+static void     removeInbound(PubSubClient_t* self, uint32_t* slot);
+static boolean  admitInbound(PubSubClient_t* self, uint16_t msgId, uint8_t qos, boolean defer, boolean* deferred);
+static void     ackInbound  (PubSubClient_t* self, uint16_t msgId, uint8_t qos);
+static void     collectAcks (PubSubClient_t* self);
+static void     queueAck    (PubSubClient_t* self, uint8_t header, uint16_t msgId);
+static boolean  flushAcks   (PubSubClient_t* self);
+static void     failPending (PubSubClient_t* self);
+static boolean  startConnect(PubSubClient_t* self, const char *id, const char *user, const char *pass, const char* willTopic, uint8_t willQos, boolean willRetain, const char* willMessage);
+static void     pollConnect (PubSubClient_t* self);
+static unsigned long keepaliveDeadline(PubSubClient_t* self);
+static unsigned long connectDeadline(PubSubClient_t* self);
+static unsigned long retryDeadline(PubSubClient_t* self, unsigned long deadline);
+
+static uint8_t  buildHeader (uint8_t header, uint8_t* buf, uint32_t length);
+static size_t   writeOut    (PubSubClient_t* self, const uint8_t* buf, size_t size);
+static boolean  whole       (PubSubClient_t* self, size_t written, size_t size);
+static void     charge      (PubSubClient_t* self, size_t bytes, size_t messages);
+static boolean  flushBatch  (PubSubClient_t* self);
+static size_t   transmit    (PubSubClient_t* self, const uint8_t* buf, size_t size);
+static void     plainParts  (PubSubClient_t* self, const char* topic, boolean addAddress, publishParts_t* parts);
+static void     publishParts(PubSubClient_t* self, const char* topic, boolean addAddress, publishParts_t* parts);
+static void     commitPublish(PubSubClient_t* self, const publishParts_t* parts, const char* topic);
+static size_t   putTopic    (PubSubClient_t* self, uint8_t* out, const publishParts_t* parts, const char* topic);
+static int      queuePublish(PubSubClient_t* self, uint8_t header, const publishParts_t* parts, const char* topic, const uint8_t* payload, unsigned int plength, uint16_t msgId, size_t limit);
+static boolean  fitsBroker  (PubSubClient_t* self, size_t remaining);
+static boolean  write       (PubSubClient_t* self, uint8_t header, uint8_t* buf, uint16_t length);
+static boolean  writeAck    (PubSubClient_t* self, uint8_t header, uint16_t msgId);
+static int      framePublish(PubSubClient_t* self, uint8_t header, const publishParts_t* parts, const char* topic, const uint8_t* payload, unsigned int plength, uint16_t msgId, uint8_t* head, uint8_t* id, struct iovec* iov, size_t* size);
+#ifndef MQTT_MAX_TRANSFER_SIZE
+static boolean  publishVec  (PubSubClient_t* self, uint8_t header, const publishParts_t* parts, const char* topic, const uint8_t* payload, unsigned int plength, uint16_t msgId);
+#endif
+static boolean  storing     (PubSubClient_t* self, boolean connected);
+static boolean  storePublish(PubSubClient_t* self, uint8_t header, const publishParts_t* parts, const char* topic, const uint8_t* payload, unsigned int plength);
+static boolean  sendStored  (PubSubClient_t* self);
+static void     drainStore  (PubSubClient_t* self);
+static void     drainQueue  (PubSubClient_t* self);
+static boolean  shapePublish(PubSubClient_t* self, uint8_t header, const char* topic, const uint8_t* payload, unsigned int plength, boolean addAddress, uint8_t cls, size_t limit);
+static boolean  shapeParts  (PubSubClient_t* self, uint8_t header, const publishParts_t* parts, const char* topic, const uint8_t* payload, unsigned int plength, boolean addAddress, uint8_t cls, size_t limit);
+static boolean  sendShaped  (PubSubClient_t* self, uint8_t cls);
+static void     drainShaper (PubSubClient_t* self);
+static boolean  sendPublish (PubSubClient_t* self, uint8_t header, const char* topic, const uint8_t* payload, unsigned int plength, boolean addAddress, uint16_t msgId, size_t limit);
+static boolean  sendParts   (PubSubClient_t* self, uint8_t header, const publishParts_t* parts, const char* topic, const uint8_t* payload, unsigned int plength, uint16_t msgId, size_t limit);
+static PubSubInflight_t* claimInflight(PubSubClient_t* self, size_t remaining);
+static void     sendInflight(PubSubClient_t* self, PubSubInflight_t* slot, boolean dup);
+static void     retryInflight(PubSubClient_t* self, unsigned long t, boolean all);
+static void     renewInflight(PubSubClient_t* self);
+static boolean  completeInflight(PubSubClient_t* self, uint16_t msgId, uint8_t expected);
+static PubSubInflight_t* findInflight(PubSubClient_t* self, uint16_t msgId, uint8_t expected);
+static void     finishInflight(PubSubClient_t* self, PubSubInflight_t* slot);
 static uint16_t copyString  (const char* string, char* buf, uint16_t max);
-static uint16_t writeStringAddAddress(const char* string, char* buf, uint16_t pos);
+static uint16_t writeStringAddAddress(PubSubClient_t* self, const char* string, char* buf, uint16_t pos);
 static uint16_t writeString (const char* string, uint8_t* buf, uint16_t pos);
-static fpMillis_t pMillis;
+#if MQTT_VERSION == MQTT_VERSION_5
+static int      readProperty(const uint8_t* buf, size_t size, uint8_t* id, uint32_t* value);
+static void     readConnackProperties(PubSubClient_t* self, const uint8_t* buf, size_t size);
+#endif
 
 static ENABLE_DEBUG = 0;
 
-/******************************************************************************
- * Private Variable
- *****************************************************************************/
-typedef struct pubSubClientData_t
-{
-    Client_t* client;
-    uint8_t buffer[MQTT_MAX_PACKET_SIZE];
-    uint16_t nextMsgId;
-    unsigned long lastOutActivity;
-    unsigned long lastInActivity;
-    bool pingOutstanding;
-    MQTT_CALLBACK_SIGNATURE;
-    IPAddress_t ip;
-    const char* domain;
-    uint16_t port;
-    int state;
-} pubSubClientData_t;
+// Receive states of PubSubReader_t
+#define PUBSUB_RX_HEADER    0
+#define PUBSUB_RX_PACKET    1
+#define PUBSUB_RX_DISCARD   2
+#define PUBSUB_RX_TOPIC     3
+#define PUBSUB_RX_STREAM    4
+
+#if MQTT_VERSION == MQTT_VERSION_5
+// MQTT 5 property identifiers
+#define MQTT_PROP_RECEIVE_MAXIMUM       0x21
+#define MQTT_PROP_TOPIC_ALIAS_MAXIMUM   0x22
+#define MQTT_PROP_TOPIC_ALIAS           0x23
+#define MQTT_PROP_MAXIMUM_PACKET_SIZE   0x27
+#define MQTT_PROP_SESSION_EXPIRY        0x11
+// Bytes taken by an empty property block
+#define MQTT_NO_PROPERTIES              1
+#else
+#define MQTT_NO_PROPERTIES              0
+#endif
 
-static pubSubClientData_t pubSubData;
+#if MQTT_STATS
+// Stats of the session at hand
+#define STAT_ADD(field, n)          PUBSUB_STAT_ADD(self->stats.field, (n))
+#define STAT_RECORD(field, value)   PubSubStats_record(&self->stats.field, (value))
+#else
+#define STAT_ADD(field, n)
+#define STAT_RECORD(field, value)
+#endif
 
-#define ADDRESS_LENGTH  (25)
+// wrap-safe "a is before b" on millis() values
+#define BEFORE(a, b)        ((long)((a) - (b)) < 0)
+
+// byte i of the unread data in the receive ring
+#define RING_AT(rx, i)      (self->rxRing[(rx)->tail + (i)])
+
+// States of PubSubInflight_t
+#define PUBSUB_INFLIGHT_FREE    0
+#define PUBSUB_INFLIGHT_PUBACK  1
+#define PUBSUB_INFLIGHT_PUBREC  2
+#define PUBSUB_INFLIGHT_PUBCOMP 3
+
+// An entry of the inbound window: message id, QoS and state in one word, so
+// that PubSub_ack() can change it with a single compare-and-swap
+#define INBOUND_ENTRY(msgId, qos, state)    (((uint32_t)(msgId) << 16) | ((uint32_t)(qos) << 8) | (state))
+#define INBOUND_MSGID(entry)                ((uint16_t)((entry) >> 16))
+#define INBOUND_QOS(entry)                  ((uint8_t)(((entry) >> 8) & 0x03))
+#define INBOUND_STATE(entry)                ((uint8_t)((entry) & 0xFF))
+
+// States of an inbound window entry
+#define PUBSUB_INBOUND_FREE         0
+#define PUBSUB_INBOUND_DELIVERED    1   // deferred, waiting for PubSub_ack()
+#define PUBSUB_INBOUND_ACKED        2   // its PUBACK or PUBREC is due
+#define PUBSUB_INBOUND_RECEIVED     3   // QoS 2, PUBREC sent, waiting for the PUBREL
+
+#if (MQTT_INBOUND_WINDOW & (MQTT_INBOUND_WINDOW - 1)) != 0
+#error "MQTT_INBOUND_WINDOW must be a power of two"
+#endif
 
-typedef struct
+/******************************************************************************
+ * Private Variable
+ *****************************************************************************/
+// The default instance keeps its buffers in static storage
+static uint8_t defaultBuffer[MQTT_MAX_PACKET_SIZE];
+static uint8_t defaultRxRing[MQTT_RX_BUFFER_SIZE];
+static char defaultFilter[MQTT_MAX_PACKET_SIZE];
+static char defaultAddress[MQTT_ADDRESS_LENGTH] = "NL/EHV1/DUMMY/";
+static PubSubClient_t pubSubData =
 {
-    char address[ADDRESS_LENGTH];
-/*    char *gLocation;
-    char *lLocation;
-    char *deviceName;*/
-    uint16_t length;
-} address_t;
-
-static address_t myAddress = {"NL/EHV1/DUMMY/\0", 14};
-//static address_t myAddress = {"DWL/KITCHEN/DEVICENAME/\0", 14};
+    .buffer = defaultBuffer, .bufferSize = sizeof(defaultBuffer),
+    .rxRing = defaultRxRing, .rxSize = sizeof(defaultRxRing),
+    .filter = defaultFilter, .filterSize = sizeof(defaultFilter),
+    .myAddress = { defaultAddress, 14, sizeof(defaultAddress) }
+};
+//static PubSubAddress_t myAddress = {"DWL/KITCHEN/DEVICENAME/\0", 14};
 
 /******************************************************************************
  * Private Function Implementation
  *****************************************************************************/
-static void setServerIP(uint8_t * ip, uint16_t port)
+static void setServerIP(PubSubClient_t* self, uint8_t * ip, uint16_t port)
 {
-    memcpy(pubSubData.ip, ip, 4);
+    memcpy(self->ip, ip, 4);
 //    this->ip = addr(ip[0],ip[1],ip[2],ip[3]);
-    pubSubData.port = port;
-    pubSubData.domain = NULL;
+    self->port = port;
+    self->domain = NULL;
+}
+
+static void setServerHost(PubSubClient_t* self, const char * domain, uint16_t port)
+{
+    self->domain = domain;
+    self->port = port;
+}
+
+static void setCallback(PubSubClient_t* self, MQTT_CALLBACK_SIGNATURE)
+{
+    self->callback = callback;
 }
 
-static void setServerHost(const char * domain, uint16_t port)
+static void setClient(PubSubClient_t* self, Client_t* client, fpMillis_t fpMillis)
 {
-    pubSubData.domain = domain;
-    pubSubData.port = port;
+    self->client = client;
+    self->millis = fpMillis;
+}
+
+// Takes the buffers of the session from its allocator, in the sizes set or
+// else the defaults, unless it has them already
+static boolean allocateBuffers(PubSubClient_t* self)
+{
+    if (self->buffer != NULL)
+    {
+        return true;
+    }
+    if (self->bufferSize == 0)
+    {
+        self->bufferSize = MQTT_MAX_PACKET_SIZE;
+    }
+    if (self->rxSize == 0)
+    {
+        self->rxSize = MQTT_RX_BUFFER_SIZE;
+    }
+    if (self->filterSize == 0)
+    {
+        self->filterSize = MQTT_MAX_PACKET_SIZE;
+    }
+    if (self->myAddress.size == 0)
+    {
+        self->myAddress.size = MQTT_ADDRESS_LENGTH;
+    }
+    self->ownBuffers = true;
+    self->buffer = PubSubAlloc_alloc(self->allocator, self->bufferSize);
+    self->rxRing = PubSubAlloc_alloc(self->allocator, self->rxSize);
+    self->filter = PubSubAlloc_alloc(self->allocator, self->filterSize);
+    self->myAddress.address = PubSubAlloc_alloc(self->allocator, self->myAddress.size);
+    if ((self->buffer == NULL) || (self->rxRing == NULL) || (self->filter == NULL) || (self->myAddress.address == NULL))
+    {
+        releaseBuffers(self);
+        return false;
+    }
+    self->myAddress.address[0] = 0;
+    self->myAddress.length = 0;
+    return true;
 }
 
-static void setCallback(MQTT_CALLBACK_SIGNATURE)
+static void releaseBuffers(PubSubClient_t* self)
 {
-    pubSubData.callback = callback;
+    if (self->ownBuffers)
+    {
+        PubSubAlloc_free(self->allocator, self->myAddress.address, self->myAddress.size);
+        PubSubAlloc_free(self->allocator, self->filter, self->filterSize);
+        PubSubAlloc_free(self->allocator, self->rxRing, self->rxSize);
+        PubSubAlloc_free(self->allocator, self->buffer, self->bufferSize);
+    }
+    self->buffer = NULL;
+    self->rxRing = NULL;
+    self->filter = NULL;
+    self->myAddress.address = NULL;
+    self->myAddress.length = 0;
+    self->ownBuffers = false;
 }
 
-static void setClient(Client_t* client)
+// The filter for topic, with our address prefix when asked for, put
+// together in the filter buffer. NULL when it does not fit.
+static char* buildFilter(PubSubClient_t* self, const char* topic, uint8_t sendAddress)
 {
-    pubSubData.client = client;
+    size_t alen = (sendAddress != 0) ? self->myAddress.length : 0;
+    size_t tlen = strlen(topic);
+
+    if (alen + tlen + 1 > self->filterSize)
+    {
+        return NULL;
+    }
+    memcpy(self->filter, self->myAddress.address, alen);
+    memcpy(&self->filter[alen], topic, tlen + 1);
+    return self->filter;
 }
 
-// reads a byte into result
-boolean readByte(uint8_t * result)
+// Unless need bytes are already there, makes room for them from the tail on
+// and reads whatever the client has buffered into the free space. Instead of wrapping around, unread data
+// is moved back to the front once the end of the ring is reached, so every
+// packet that fits is contiguous. That moves less than one packet and only
+// once per pass through the ring.
+static void ringFill(PubSubClient_t* self, size_t need)
 {
-   uint32_t previousMillis = pMillis();
-   while(!pubSubData.client->available()) {
-     uint32_t currentMillis = pMillis();
-     if(currentMillis - previousMillis >= ((int32_t) MQTT_SOCKET_TIMEOUT * 1000)){
-       return false;
-     }
-   }
-   *result = pubSubData.client->read();
-   return true;
+    PubSubReader_t* rx = &self->reader;
+    if (rx->count >= need) {
+        return;
+    }
+    if (rx->count == 0) {
+        rx->tail = 0;
+    } else if ((rx->tail > 0) &&
+               ((rx->tail + need > self->rxSize) || (rx->tail + rx->count == self->rxSize))) {
+        memmove(self->rxRing, &self->rxRing[rx->tail], rx->count);
+        rx->tail = 0;
+    }
+    while (rx->tail + rx->count < self->rxSize) {
+        int available = self->client->available(self->client);
+        if (available <= 0) {
+            break;
+        }
+        size_t space = self->rxSize - (rx->tail + rx->count);
+        if (space > (size_t)available) {
+            space = available;
+        }
+        int rc = self->client->readMulti(self->client, &self->rxRing[rx->tail + rx->count], space);
+        if (rc <= 0) {
+            break;
+        }
+        rx->count += rc;
+        STAT_ADD(bytesIn, rc);
+    }
 }
 
-// reads a byte into result[*index] and increments index
-boolean readBytePos(uint8_t * result, uint16_t * index){
-  uint16_t current_index = *index;
-  uint8_t * write_address = &(result[current_index]);
-  if(readByte(write_address)){
-    *index = current_index + 1;
-    return true;
-  }
-  return false;
+static void ringConsume(PubSubClient_t* self, size_t size)
+{
+    PubSubReader_t* rx = &self->reader;
+    rx->tail += size;
+    rx->count -= size;
 }
 
-static uint16_t readPacket(uint8_t* lengthLength)
+// Decodes the fixed header at the start of the ring and picks how the packet
+// is received. Returns false when the header is not complete yet, or when
+// its remaining length runs past 4 bytes: the stream cannot be followed
+// anymore and the connection is dropped.
+static boolean readHeader(PubSubClient_t* self)
 {
-    uint16_t len = 0;
-    if(!readBytePos(pubSubData.buffer, &len)) return 0;
-    bool isPublish = (pubSubData.buffer[0]&0xF0) == MQTTPUBLISH;
+    PubSubReader_t* rx = &self->reader;
+    uint32_t remaining = 0;
     uint32_t multiplier = 1;
-    uint16_t length = 0;
-    uint8_t digit = 0;
-    uint16_t skip = 0;
-    uint8_t start = 0;
+    uint8_t llen = 0;
+    uint8_t digit;
 
     do {
-        if(!readByte(&digit)) return 0;
-        pubSubData.buffer[len++] = digit;
-        length += (digit & 127) * multiplier;
+        if ((size_t)(1 + llen) >= rx->count) {
+            return false;
+        }
+        digit = RING_AT(rx, 1 + llen);
+        remaining += (digit & 127) * multiplier;
         multiplier *= 128;
-    } while ((digit & 128) != 0);
-    *lengthLength = len-1;
+        llen++;
+    } while ((digit & 128) && (llen < 4));
+    if (digit & 128) {
+        setState(self, MQTT_CONNECTION_LOST);
+        self->client->stop(self->client);
+        return false;
+    }
+
+    rx->lengthLength = llen;
+    rx->remaining = 1 + llen + remaining;
+    if (rx->remaining <= self->rxSize) {
+        rx->state = PUBSUB_RX_PACKET;
+    } else if (((RING_AT(rx, 0) & 0xF0) == MQTTPUBLISH) && (self->chunkCallback != NULL)) {
+        // Too long: take the topic, then stream the payload.
+        rx->state = PUBSUB_RX_TOPIC;
+    } else {
+        // Too long: let it pass through the ring and ignore it.
+        rx->state = PUBSUB_RX_DISCARD;
+        STAT_ADD(droppedOversize, 1);
+    }
+    return true;
+}
+
+// Takes the variable header of a PUBLISH that is streamed: the topic is
+// copied into the buffer, terminated, and passed with every payload chunk.
+// With MQTT 5 the property block is skipped and a topic alias resolved.
+// Returns false when it has not all arrived yet.
+static boolean readStreamHeader(PubSubClient_t* self)
+{
+    PubSubReader_t* rx = &self->reader;
+    size_t start = 1 + rx->lengthLength;
+    boolean hasMsgId = ((RING_AT(rx, 0) & 0x06) != 0);
+
+    if (rx->count < start + 2) {
+        return false;
+    }
+    uint16_t tl = (RING_AT(rx, start) << 8) + RING_AT(rx, start + 1);
+    size_t end = start + 2 + tl + (hasMsgId ? 2 : 0);
+    if ((end > self->rxSize) || (tl >= self->bufferSize)) {
+        rx->state = PUBSUB_RX_DISCARD;
+        STAT_ADD(droppedOversize, 1);
+        return true;
+    }
+    if (rx->count < end) {
+        return false;
+    }
+#if MQTT_VERSION == MQTT_VERSION_5
+    // The property block follows and is taken with the header, so that the
+    // chunks only carry the payload
+    uint32_t plen;
+    uint16_t alias = 0;
+    int used = PubSub_decodeLength(&self->rxRing[rx->tail + end], rx->count - end, &plen);
+    if (used < 0) {
+        setState(self, MQTT_CONNECTION_LOST);
+        self->client->stop(self->client);
+        return false;
+    }
+    if ((used == 0) && (rx->count < self->rxSize)) {
+        return false;
+    }
+    if ((used == 0) || (end + used + plen > self->rxSize)) {
+        rx->state = PUBSUB_RX_DISCARD;
+        STAT_ADD(droppedOversize, 1);
+        return true;
+    }
+    if (rx->count < end + used + plen) {
+        return false;
+    }
+    const uint8_t* properties = &self->rxRing[rx->tail + end + used];
+    uint32_t p = 0;
+    while (p < plen) {
+        uint8_t id;
+        uint32_t value;
+        int size = readProperty(&properties[p], plen - p, &id, &value);
+        if (size <= 0) {
+            break;
+        }
+        if (id == MQTT_PROP_TOPIC_ALIAS) {
+            alias = value;
+        }
+        p += size;
+    }
+    end += used + plen;
+    if ((p < plen) || (alias > MQTT_TOPIC_ALIAS_MAX) ||
+        ((tl == 0) && ((alias == 0) || (self->aliasIn[alias-1][0] == 0)))) {
+        // Malformed, or an alias we never offered or never learned
+        rx->state = PUBSUB_RX_DISCARD;
+        return true;
+    }
+#endif
+
+    memcpy(self->buffer, &self->rxRing[rx->tail + start + 2], tl);
+    self->buffer[tl] = 0;
+#if MQTT_VERSION == MQTT_VERSION_5
+    if (alias != 0) {
+        char* slot = self->aliasIn[alias-1];
+        if (tl == 0) {
+            tl = strlen(slot);
+            memcpy(self->buffer, slot, tl + 1);
+        } else if (tl < MQTT_TOPIC_ALIAS_LENGTH) {
+            memcpy(slot, self->buffer, tl + 1);
+        } else {
+            slot[0] = 0;
+        }
+    }
+#endif
+    rx->qos = (RING_AT(rx, 0) & 0x06) >> 1;
+    rx->msgId = hasMsgId ? ((RING_AT(rx, end - 2) << 8) + RING_AT(rx, end - 1)) : 0;
+    ringConsume(self, end);
+    rx->remaining -= end;
+    rx->offset = 0;
+    rx->state = PUBSUB_RX_STREAM;
+    if (hasMsgId) {
+        boolean deferred;
+        if (!admitInbound(self, rx->msgId, rx->qos, false, &deferred)) {
+            // Delivered before, let the repeat pass unseen
+            rx->state = PUBSUB_RX_DISCARD;
+        }
+    }
+    return true;
+}
+
+// Advances the receive state machine with whatever the client has already
+// buffered. Data is read into the ring in as large pieces as the client
+// allows and complete packets are handed out where they are: *packet then
+// points into the ring and stays valid until the next call. Returns the
+// length of that packet, or 0 when more bytes are needed. Never waits.
+static uint32_t readPacket(PubSubClient_t* self, uint8_t** packet, uint8_t* lengthLength)
+{
+    PubSubReader_t* rx = &self->reader;
+
+    // The previous packet was left in place for its handlers
+    ringConsume(self, rx->release);
+    rx->release = 0;
+
+    while (1)
+    {
+        // Whole packets, and the variable header of streamed ones, must be
+        // contiguous in the ring
+        if (rx->state == PUBSUB_RX_PACKET) {
+            ringFill(self, rx->remaining);
+        } else if (rx->state == PUBSUB_RX_TOPIC) {
+            ringFill(self, self->rxSize);
+        } else {
+            ringFill(self, 5);
+        }
+
+        switch (rx->state)
+        {
+        case PUBSUB_RX_HEADER:
+            if (!readHeader(self))
+            {
+                return 0;
+            }
+            break;
+
+        case PUBSUB_RX_PACKET:
+            if (rx->count < rx->remaining)
+            {
+                return 0;
+            }
+            *packet = &self->rxRing[rx->tail];
+            *lengthLength = rx->lengthLength;
+            STAT_ADD(packetsIn[(*packet)[0] >> 4], 1);
+            rx->release = rx->remaining;
+            rx->state = PUBSUB_RX_HEADER;
+            return rx->remaining;
+
+        case PUBSUB_RX_TOPIC:
+            if (!readStreamHeader(self))
+            {
+                return 0;
+            }
+            break;
+
+        case PUBSUB_RX_STREAM:
+        case PUBSUB_RX_DISCARD:
+        {
+            size_t chunk = rx->count;
+            if (chunk > rx->remaining)
+            {
+                chunk = rx->remaining;
+            }
+            if (chunk == 0)
+            {
+                return 0;
+            }
+            if (rx->state == PUBSUB_RX_STREAM)
+            {
+                self->chunkCallback(self, (char*)self->buffer,
+                                    &self->rxRing[rx->tail], chunk,
+                                    rx->offset, rx->offset + rx->remaining);
+                rx->offset += chunk;
+            }
+            ringConsume(self, chunk);
+            rx->remaining -= chunk;
+            if (rx->remaining == 0)
+            {
+                if (rx->state == PUBSUB_RX_STREAM)
+                {
+                    STAT_ADD(packetsIn[MQTTPUBLISH >> 4], 1);
+                    self->lastInActivity = self->millis();
+                    if (rx->msgId != 0)
+                    {
+                        ackInbound(self, rx->msgId, rx->qos);
+                    }
+                }
+                rx->state = PUBSUB_RX_HEADER;
+            }
+            break;
+        }
+        }
+    }
+}
+
+typedef struct
+{
+    PubSubClient_t* client;
+    char* topic;
+    uint8_t* payload;
+    unsigned int length;
+    int handled;
+} dispatch_t;
+
+static void dispatchHandler(const TopicTrieNode_t* node, void* context)
+{
+    dispatch_t* d = (dispatch_t*)context;
+    if (node->handler != NULL)
+    {
+        node->handler(d->client, d->topic, d->payload, d->length);
+        d->handled++;
+    }
+}
+
+// Runs the handlers of every subscription matching the topic, or else the
+// message callback or the session callback. Our own address prefix is
+// stripped from the topic handed to them, but only when the topic actually
+// carries it.
+static void dispatch(PubSubClient_t* self, PubSubMessageView_t* message)
+{
+    char* topic = (char*)message->topic;
+    uint16_t skip = 0;
+    if ((self->myAddress.length > 0) &&
+        (strncmp(topic, self->myAddress.address, self->myAddress.length) == 0))
+    {
+        skip = self->myAddress.length;
+    }
+
+    if (self->cache != NULL)
+    {
+        PubSubCache_store(self->cache, topic, message->topicLength, message->payload,
+                          message->payloadLength, message->retain, self->millis());
+    }
+
+    // Subscriptions without a handler are only recorded for the replay
+    dispatch_t d = { self, &topic[skip], (uint8_t*)message->payload, message->payloadLength, 0 };
+#if MQTT_STATS
+    unsigned long start = statsNow(self);
+#endif
+    TopicTrie_match(&self->handlers, topic, dispatchHandler, &d);
+    if (d.handled > 0)
+    {
+        // handled by the subscription handlers
+    }
+    else if (self->dispatcher != NULL)
+    {
+        message->topic += skip;
+        message->topicLength -= skip;
+        self->dispatcher->dispatch(self->dispatcher, self, message);
+    }
+    else if (self->messageCallback != NULL)
+    {
+        message->topic += skip;
+        message->topicLength -= skip;
+        self->messageCallback(self, message);
+    }
+    else if (self->callback != NULL)
+    {
+        self->callback(&topic[skip], (uint8_t*)message->payload, message->payloadLength);
+    }
+    STAT_RECORD(callbackTime, statsNow(self) - start);
+}
+
+#if MQTT_STATS
+// Time base of the latency histograms, in microseconds
+static unsigned long statsNow(PubSubClient_t* self)
+{
+    if (self->statsClock != NULL)
+    {
+        return self->statsClock();
+    }
+    return self->millis() * 1000UL;
+}
+#endif
+
+static void handlePacket(PubSubClient_t* self, uint8_t* packet, uint32_t len, uint8_t llen)
+{
+    uint16_t msgId = 0;
+    uint8_t type = packet[0]&0xF0;
+    if (type == MQTTPUBLISH)
+    {
+        PubSubMessageView_t message;
+        if (len < (uint32_t)llen + 3)
+        {
+            // Malformed: no topic length
+            return;
+        }
+        uint16_t tl = (packet[llen+1]<<8)+packet[llen+2];
+        uint32_t start = llen+3+tl;
+        message.qos = (packet[0]&0x06)>>1;
+        message.retain = (packet[0]&0x01) != 0;
+        message.dup = (packet[0]&MQTTDUP) != 0;
+        if (start + ((message.qos > 0) ? 2 : 0) > len)
+        {
+            // Malformed: topic or message id past the end
+            return;
+        }
+        // msgId only present for QOS>0
+        if (message.qos > 0)
+        {
+            msgId = (packet[start]<<8)+packet[start+1];
+            start += 2;
+        }
+        message.properties = NULL;
+        message.propertiesLength = 0;
+#if MQTT_VERSION == MQTT_VERSION_5
+        uint32_t plen;
+        int used = PubSub_decodeLength(&packet[start], len - start, &plen);
+        if ((used <= 0) || (plen > len - start - used))
+        {
+            return;
+        }
+        start += used;
+        message.properties = &packet[start];
+        message.propertiesLength = plen;
+        start += plen;
+
+        uint16_t alias = 0;
+        uint32_t p = 0;
+        while (p < plen)
+        {
+            uint8_t id;
+            uint32_t value;
+            int size = readProperty(&message.properties[p], plen - p, &id, &value);
+            if (size <= 0)
+            {
+                return;
+            }
+            if (id == MQTT_PROP_TOPIC_ALIAS)
+            {
+                alias = value;
+            }
+            p += size;
+        }
+        if ((alias > MQTT_TOPIC_ALIAS_MAX) || ((tl == 0) && ((alias == 0) || (self->aliasIn[alias-1][0] == 0))))
+        {
+            // An alias we never offered or never learned
+            return;
+        }
+#endif
+        // Move the topic one byte down over its length so that it can be
+        // terminated in place without touching the payload
+        char* topic = (char*)&packet[llen+2];
+        memmove(topic, topic+1, tl);
+        topic[tl] = 0;
+#if MQTT_VERSION == MQTT_VERSION_5
+        if (alias != 0)
+        {
+            char* slot = self->aliasIn[alias-1];
+            if (tl == 0)
+            {
+                topic = slot;
+                tl = strlen(slot);
+            }
+            else if (tl < MQTT_TOPIC_ALIAS_LENGTH)
+            {
+                memcpy(slot, topic, tl + 1);
+            }
+            else
+            {
+                // Too long to remember, later alias-only messages are dropped
+                slot[0] = 0;
+            }
+        }
+#endif
+
+        message.topic = topic;
+        message.topicLength = tl;
+        message.payload = &packet[start];
+        message.payloadLength = len - start;
+        message.msgId = msgId;
+        boolean deferred = false;
+        if ((message.qos > 0) && !admitInbound(self, msgId, message.qos, self->deferAck, &deferred))
+        {
+            return;
+        }
+        dispatch(self, &message);
+        if ((message.qos > 0) && !deferred)
+        {
+            ackInbound(self, msgId, message.qos);
+        }
+    }
+    else if (type == MQTTPUBREL)
+    {
+        // The broker releases a QoS 2 message: from now on the id is a new
+        // message. Answered also when unknown, so that it can forget it.
+        if (len < (uint32_t)llen + 3)
+        {
+            // Malformed: no message id
+            return;
+        }
+        msgId = (packet[llen+1]<<8)+packet[llen+2];
+        uint32_t* slot = findInbound(self, msgId);
+        if ((slot != NULL) && (INBOUND_STATE(__atomic_load_n(slot, __ATOMIC_ACQUIRE)) == PUBSUB_INBOUND_RECEIVED))
+        {
+            removeInbound(self, slot);
+        }
+        queueAck(self, MQTTPUBCOMP, msgId);
+    }
+    else if (type == MQTTPINGREQ)
+    {
+        self->buffer[0] = MQTTPINGRESP;
+        self->buffer[1] = 0;
+        if (transmit(self, self->buffer, 2) == 2)
+        {
+            STAT_ADD(packetsOut[MQTTPINGRESP >> 4], 1);
+            charge(self, 2, 1);
+        }
+    }
+    else if (type == MQTTPINGRESP)
+    {
+#if MQTT_STATS
+        if (self->pingOutstanding)
+        {
+            STAT_RECORD(pingRtt, statsNow(self) - self->pingSentAt);
+        }
+#endif
+        self->pingOutstanding = false;
+    }
+    else if ((type == MQTTPUBACK) || (type == MQTTPUBREC) || (type == MQTTPUBCOMP))
+    {
+        if (len < (uint32_t)llen + 3)
+        {
+            // Malformed: no message id
+            return;
+        }
+        msgId = (packet[llen+1]<<8)+packet[llen+2];
+#if MQTT_VERSION == MQTT_VERSION_5
+        // A PUBREC reason code of 0x80 or above ends the exchange, there is
+        // nothing to release
+        if ((type == MQTTPUBREC) && (len > (uint32_t)llen + 3) && (packet[llen+3] >= 0x80)) {
+            PubSubInflight_t* slot = findInflight(self, msgId, PUBSUB_INFLIGHT_PUBREC);
+            if (slot != NULL) {
+                finishInflight(self, slot);
+            }
+            return;
+        }
+#endif
+        if (type == MQTTPUBACK) {
+            completeInflight(self, msgId, PUBSUB_INFLIGHT_PUBACK);
+        } else if (type == MQTTPUBCOMP) {
+            completeInflight(self, msgId, PUBSUB_INFLIGHT_PUBCOMP);
+        } else if (!completeInflight(self, msgId, PUBSUB_INFLIGHT_PUBREC)) {
+            // Unknown or repeated: release it anyway so the broker can forget it
+            writeAck(self, MQTTPUBREL|MQTTQOS1, msgId);
+        }
+    }
+    else if ((type == MQTTSUBACK) || (type == MQTTUNSUBACK))
+    {
+        // Return codes, in MQTT 5 after the properties. Acknowledgements of
+        // single subscribes have no pending slot and are ignored.
+        uint32_t pos = llen + 3;
+        if (len < pos)
+        {
+            return;
+        }
+        msgId = (packet[llen+1]<<8)+packet[llen+2];
+#if MQTT_VERSION == MQTT_VERSION_5
+        uint32_t plen;
+        int used = PubSub_decodeLength(&packet[pos], len - pos, &plen);
+        if ((used <= 0) || (plen > len - pos - used))
+        {
+            return;
+        }
+        pos += used + plen;
+#endif
+        completePending(self, type, msgId, &packet[pos], len - pos);
+    }
+#if MQTT_VERSION == MQTT_VERSION_5
+    else if (type == MQTTDISCONNECT)
+    {
+        // The broker ends the session, the reason code is not kept
+        setState(self, MQTT_CONNECTION_LOST);
+        self->client->stop(self->client);
+    }
+#endif
+    else
+    {
+        //TKE ERROR!!!
+        self->pingOutstanding = false;
+    }
+}
+
+static void setState(PubSubClient_t* self, int state)
+{
+    if (state == MQTT_CONNECTED)
+    {
+        self->reconnectAttempts = 0;
+    }
+    else if (state == MQTT_DISCONNECTED)
+    {
+        // Closed on purpose: no reconnect
+        self->reconnectPending = false;
+    }
+    else if (state != MQTT_CONNECTING)
+    {
+        // Every failed attempt, also one failing like the one before
+        scheduleReconnect(self);
+    }
+    if (self->state != state)
+    {
+        self->state = state;
+        if (self->stateCallback != NULL)
+        {
+            self->stateCallback(self, state);
+        }
+    }
+}
+
+// Exponential backoff with equal jitter: the next attempt is due between half
+// and all of reconnectMin << attempts, capped at reconnectMax
+static void scheduleReconnect(PubSubClient_t* self)
+{
+    unsigned long delay = self->reconnectMin;
+    uint16_t i;
+
+    if ((self->reconnectMax == 0) || (self->connectId == NULL))
+    {
+        return;
+    }
+    for (i = 0; (i < self->reconnectAttempts) && (delay < self->reconnectMax); i++)
+    {
+        delay = (delay > self->reconnectMax / 2) ? self->reconnectMax : delay * 2;
+    }
+    // xorshift32
+    self->jitter ^= self->jitter << 13;
+    self->jitter ^= self->jitter >> 17;
+    self->jitter ^= self->jitter << 5;
+    delay = delay / 2 + self->jitter % (delay - delay / 2 + 1);
+
+    self->reconnectAt = self->millis() + delay;
+    self->reconnectPending = true;
+    if (self->reconnectAttempts < 0xFFFF)
+    {
+        self->reconnectAttempts++;
+    }
+}
+
+static void sendReplay(replay_t* r)
+{
+    if (r->length > 0)
+    {
+        write(r->client, MQTTSUBSCRIBE|MQTTQOS1, r->client->buffer, r->length - 5);
+        r->length = 0;
+    }
+}
+
+// Adds one filter to the SUBSCRIBE in the buffer, sending that first when
+// the filter does not fit anymore. A packet is only opened once a filter fits
+// it, so no SUBSCRIBE goes out without one.
+static void replayFilter(const TopicTrieNode_t* node, void* context)
+{
+    replay_t* r = (replay_t*)context;
+    PubSubClient_t* self = r->client;
+    size_t flen = 0;
+    int tries;
+
+    for (tries = 0; (tries < 2) && (flen == 0); tries++)
+    {
+        // Header, msgId and properties of a packet still to be opened
+        size_t at = (r->length > 0) ? (size_t)r->length : 7 + MQTT_NO_PROPERTIES;
+        // Length, then the filter with its NUL where the options byte goes
+        size_t start = at + 2;
+        size_t room = (start < self->bufferSize) ? self->bufferSize - start : 0;
+        flen = TopicTrie_filter(node, (char*)&self->buffer[start], room);
+        if ((flen == 0) && (r->length == 0))
+        {
+            // Too long for any packet, it is skipped
+            return;
+        }
+        if (flen == 0)
+        {
+            sendReplay(r);
+        }
+    }
+    if (flen == 0)
+    {
+        return;
+    }
+    if (r->length == 0)
+    {
+        // Leave room in the buffer for header and variable length field
+        r->length = 5;
+        self->nextMsgId++;
+        if (self->nextMsgId == 0)
+        {
+            self->nextMsgId = 1;
+        }
+        self->buffer[r->length++] = (self->nextMsgId >> 8);
+        self->buffer[r->length++] = (self->nextMsgId & 0xFF);
+#if MQTT_VERSION == MQTT_VERSION_5
+        self->buffer[r->length++] = 0;
+#endif
+    }
+    self->buffer[r->length++] = (flen >> 8);
+    self->buffer[r->length++] = (flen & 0xFF);
+    r->length += flen;
+    self->buffer[r->length++] = node->qos;
+}
+
+// Whether a SUBSCRIBE to topic can be built in the buffer
+static boolean canSubscribe(PubSubClient_t* self, const char* topic, uint8_t qos, uint8_t sendAddress)
+{
+    if (qos > 2)
+    {
+        return false;
+    }
+    // Header, msgId, properties, topic length, topic and options byte
+    if (self->bufferSize < 10 + MQTT_NO_PROPERTIES + strlen(topic))
+    {
+        // Too long
+        return false;
+    }
+    if( (sendAddress != 0) &&
+        (self->bufferSize < ( 10 + MQTT_NO_PROPERTIES + strlen(topic) + self->myAddress.length)) )
+    {
+        // Too long
+        return false;
+    }
+    return true;
+}
+
+// Records a filter for the replay after a reconnect, keeping the handler it
+// may have, or forgets it
+static void recordFilter(PubSubClient_t* self, const char* topic, uint8_t qos, uint8_t sendAddress, boolean subscribe)
+{
+    char* filter = buildFilter(self, topic, sendAddress);
+    const TopicTrieNode_t* node;
+
+    if (filter == NULL)
+    {
+        // Too long to have been sent either
+        return;
+    }
+    if (!subscribe)
+    {
+        TopicTrie_remove(&self->handlers, filter);
+        return;
+    }
+    node = TopicTrie_find(&self->handlers, filter);
+    TopicTrie_insert(&self->handlers, filter, (node != NULL) ? node->handler : NULL, qos);
+}
+
+// Packs filters into SUBSCRIBE or UNSUBSCRIBE packets, each taking a pending
+// slot, and returns how many were sent
+static size_t sendFilters(PubSubClient_t* self, uint8_t header, PubSubFilter_t* filters, size_t count, uint8_t sendAddress, fpSubscribeCallback_t callback)
+{
+    boolean subscribe = ((header & 0xF0) == MQTTSUBSCRIBE);
+    size_t alen = (sendAddress != 0) ? self->myAddress.length : 0;
+    size_t sent = 0;
+
+    if (!PubSub_connected(self))
+    {
+        return 0;
+    }
+    while (sent < count)
+    {
+        PubSubPending_t* slot = NULL;
+        size_t n = 0;
+        uint16_t i;
+
+        for (i = 0; (i < MQTT_MAX_PENDING_SUBSCRIBES) && (slot == NULL); i++)
+        {
+            if (self->pending[i].ack == 0)
+            {
+                slot = &self->pending[i];
+            }
+        }
+        if (slot == NULL)
+        {
+            break;
+        }
+
+        // Leave room in the buffer for header and variable length field
+        uint16_t length = 5;
+        self->nextMsgId++;
+        if (self->nextMsgId == 0)
+        {
+            self->nextMsgId = 1;
+        }
+        self->buffer[length++] = (self->nextMsgId >> 8);
+        self->buffer[length++] = (self->nextMsgId & 0xFF);
+#if MQTT_VERSION == MQTT_VERSION_5
+        self->buffer[length++] = 0;
+#endif
+        while ((sent + n < count) && (n < 0xFFFF))
+        {
+            PubSubFilter_t* f = &filters[sent + n];
+            size_t entry = 2 + alen + strlen(f->topic) + (subscribe ? 1 : 0);
+            if ((subscribe && (f->qos > 2)) || (length + entry > self->bufferSize))
+            {
+                break;
+            }
+            if (sendAddress == 0)
+            {
+                length = writeString(f->topic, self->buffer, length);
+            }
+            else
+            {
+                length = writeStringAddAddress(self, f->topic, (char*)self->buffer, length);
+            }
+            if (subscribe)
+            {
+                self->buffer[length++] = f->qos;
+            }
+            n++;
+        }
+        if ((n == 0) || !write(self, header, self->buffer, length - 5))
+        {
+            break;
+        }
+
+        slot->filters = &filters[sent];
+        slot->count = n;
+        slot->callback = callback;
+        slot->msgId = self->nextMsgId;
+        slot->ack = subscribe ? MQTTSUBACK : MQTTUNSUBACK;
+        for (i = 0; i < n; i++)
+        {
+            recordFilter(self, filters[sent + i].topic, filters[sent + i].qos, sendAddress, subscribe);
+        }
+        sent += n;
+    }
+    return sent;
+}
+
+// Hands the return codes of a SUBACK or UNSUBACK to the filters of its
+// request. Missing codes count as failed, except for an UNSUBACK without
+// any, which is all MQTT 3.1.1 sends.
+static void completePending(PubSubClient_t* self, uint8_t ack, uint16_t msgId, const uint8_t* codes, size_t count)
+{
+    uint16_t i;
+    uint16_t k;
+
+    for (i = 0; i < MQTT_MAX_PENDING_SUBSCRIBES; i++)
+    {
+        PubSubPending_t* slot = &self->pending[i];
+        if ((slot->ack == ack) && (slot->msgId == msgId))
+        {
+            for (k = 0; k < slot->count; k++)
+            {
+                if (k < count)
+                {
+                    slot->filters[k].result = codes[k];
+                }
+                else
+                {
+                    slot->filters[k].result = ((count == 0) && (ack == MQTTUNSUBACK)) ? 0 : MQTT_SUBSCRIBE_FAILED;
+                }
+            }
+            slot->ack = 0;
+            if (slot->callback != NULL)
+            {
+                slot->callback(self, msgId, slot->filters, slot->count);
+            }
+            return;
+        }
+    }
+}
+
+// Fails every request still waiting for its acknowledgement
+static void failPending(PubSubClient_t* self)
+{
+    uint16_t i;
+    uint16_t k;
+
+    for (i = 0; i < MQTT_MAX_PENDING_SUBSCRIBES; i++)
+    {
+        PubSubPending_t* slot = &self->pending[i];
+        if (slot->ack != 0)
+        {
+            for (k = 0; k < slot->count; k++)
+            {
+                slot->filters[k].result = MQTT_SUBSCRIBE_FAILED;
+            }
+            slot->ack = 0;
+            if (slot->callback != NULL)
+            {
+                slot->callback(self, slot->msgId, slot->filters, slot->count);
+            }
+        }
+    }
+}
+
+// Subscribes again to every recorded filter
+static void replaySubscriptions(PubSubClient_t* self)
+{
+    replay_t r = { self, 0 };
+    TopicTrie_walk(&self->handlers, replayFilter, &r);
+    sendReplay(&r);
+}
+
+// The inbound window slot of msgId, NULL when it is not tracked
+static uint32_t* findInbound(PubSubClient_t* self, uint16_t msgId)
+{
+    uint16_t i;
+    for (i = 0; i < MQTT_INBOUND_WINDOW; i++)
+    {
+        uint32_t* slot = &self->inbound[(msgId + i) & (MQTT_INBOUND_WINDOW - 1)];
+        uint32_t entry = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+        if ((entry != 0) && (INBOUND_MSGID(entry) == msgId))
+        {
+            return slot;
+        }
+    }
+    return NULL;
+}
+
+// false when the window is full
+static boolean addInbound(PubSubClient_t* self, uint16_t msgId, uint8_t qos, uint8_t state)
+{
+    uint16_t i;
+    for (i = 0; i < MQTT_INBOUND_WINDOW; i++)
+    {
+        uint32_t* slot = &self->inbound[(msgId + i) & (MQTT_INBOUND_WINDOW - 1)];
+        if (__atomic_load_n(slot, __ATOMIC_ACQUIRE) == 0)
+        {
+            __atomic_store_n(slot, INBOUND_ENTRY(msgId, qos, state), __ATOMIC_RELEASE);
+            self->inboundCount++;
+            return true;
+        }
+    }
+    return false;
+}
+
+static void removeInbound(PubSubClient_t* self, uint32_t* slot)
+{
+    __atomic_store_n(slot, 0, __ATOMIC_RELEASE);
+    self->inboundCount--;
+}
+
+// Decides about an inbound QoS 1/2 PUBLISH before it is delivered. Returns
+// false for a repeat that must not be delivered again, answering it when it
+// was acknowledged before. With defer the message waits for PubSub_ack(),
+// as far as the window has room: *deferred tells whether it does.
+static boolean admitInbound(PubSubClient_t* self, uint16_t msgId, uint8_t qos, boolean defer, boolean* deferred)
+{
+    *deferred = false;
+    if (self->inboundCount > 0)
+    {
+        uint32_t* slot = findInbound(self, msgId);
+        if (slot != NULL)
+        {
+            if (INBOUND_STATE(__atomic_load_n(slot, __ATOMIC_ACQUIRE)) == PUBSUB_INBOUND_RECEIVED)
+            {
+                queueAck(self, MQTTPUBREC, msgId);
+            }
+            return false;
+        }
+    }
+    if (defer)
+    {
+        *deferred = addInbound(self, msgId, qos, PUBSUB_INBOUND_DELIVERED);
+    }
+    return true;
+}
+
+// Acknowledges a delivered message; QoS 2 ones are remembered until their
+// PUBREL so that repeats are not delivered again
+static void ackInbound(PubSubClient_t* self, uint16_t msgId, uint8_t qos)
+{
+    if (qos == 1)
+    {
+        queueAck(self, MQTTPUBACK, msgId);
+    }
+    else
+    {
+        addInbound(self, msgId, qos, PUBSUB_INBOUND_RECEIVED);
+        queueAck(self, MQTTPUBREC, msgId);
+    }
+}
+
+// Picks up what PubSub_ack() marked since the last call
+static void collectAcks(PubSubClient_t* self)
+{
+    uint16_t i;
+
+    if (!__atomic_exchange_n(&self->ackWaiting, false, __ATOMIC_ACQ_REL))
+    {
+        return;
+    }
+    for (i = 0; i < MQTT_INBOUND_WINDOW; i++)
+    {
+        uint32_t entry = __atomic_load_n(&self->inbound[i], __ATOMIC_ACQUIRE);
+        if (INBOUND_STATE(entry) != PUBSUB_INBOUND_ACKED)
+        {
+            continue;
+        }
+        if (INBOUND_QOS(entry) == 1)
+        {
+            removeInbound(self, &self->inbound[i]);
+            queueAck(self, MQTTPUBACK, INBOUND_MSGID(entry));
+        }
+        else
+        {
+            __atomic_store_n(&self->inbound[i], INBOUND_ENTRY(INBOUND_MSGID(entry), 2, PUBSUB_INBOUND_RECEIVED), __ATOMIC_RELEASE);
+            queueAck(self, MQTTPUBREC, INBOUND_MSGID(entry));
+        }
+    }
+}
+
+// Adds an acknowledgement to the ones sent at the end of PubSub_loop()
+static void queueAck(PubSubClient_t* self, uint8_t header, uint16_t msgId)
+{
+    if (self->ackLength + 4 > MQTT_ACK_BUFFER_SIZE)
+    {
+        flushAcks(self);
+    }
+    uint8_t* ack = &self->acks[self->ackLength];
+    ack[0] = header;
+    ack[1] = 2;
+    ack[2] = (msgId >> 8);
+    ack[3] = (msgId & 0xFF);
+    self->ackLength += 4;
+}
+
+// sends the collected acknowledgements in one write
+static boolean flushAcks(PubSubClient_t* self)
+{
+    uint16_t length = self->ackLength;
+    if (length == 0) {
+        return true;
+    }
+    self->ackLength = 0;
+    if (transmit(self, self->acks, length) != length) {
+        return false;
+    }
+    charge(self, length, length / 4);
+#if MQTT_STATS
+    uint16_t i;
+    for (i = 0; i < length; i += 4) {
+        STAT_ADD(packetsOut[self->acks[i] >> 4], 1);
+    }
+#endif
+    return true;
+}
+
+// Opens the transport and sends CONNECT. The CONNACK is picked up by
+// pollConnect() while the state is MQTT_CONNECTING.
+static boolean startConnect(PubSubClient_t* self, const char *id, const char *user, const char *pass, const char* willTopic, uint8_t willQos, boolean willRetain, const char* willMessage)
+{
+    int result = 0;
+
+    // A failure below schedules the next attempt
+    self->reconnectPending = false;
+    if (!allocateBuffers(self)) {
+        setState(self, MQTT_CONNECT_FAILED);
+        return false;
+    }
+    if (self->domain != NULL) {
+        result = self->client->connectHost(self->client, self->domain, self->port);
+    } else {
+        result = self->client->connectIP(self->client, self->ip, self->port);
+    }
+    if (result != 1) {
+        setState(self, MQTT_CONNECT_FAILED);
+        return false;
+    }
+
+    self->nextMsgId = 1;
+    // Leave room in the buffer for header and variable length field
+    uint16_t length = 5;
+    unsigned int j;
+
+#if MQTT_VERSION == MQTT_VERSION_3_1
+    uint8_t d[9] = {0x00,0x06,'M','Q','I','s','d','p', MQTT_VERSION};
+#define MQTT_HEADER_VERSION_LENGTH 9
+#elif (MQTT_VERSION == MQTT_VERSION_3_1_1) || (MQTT_VERSION == MQTT_VERSION_5)
+    uint8_t d[7] = {0x00,0x04,'M','Q','T','T',MQTT_VERSION};
+#define MQTT_HEADER_VERSION_LENGTH 7
+#endif
+    for (j = 0;j<MQTT_HEADER_VERSION_LENGTH;j++) {
+        self->buffer[length++] = d[j];
+    }
+
+    uint8_t v;
+    if (willTopic) {
+        v = 0x04|(willQos<<3)|(willRetain<<5);
+    } else {
+        v = 0x00;
+    }
+    if (!self->keepSession) {
+        // Clean session, in MQTT 5 clean start
+        v = v|0x02;
+    }
+
+    if(user != NULL) {
+        v = v|0x80;
+
+        if(pass != NULL) {
+            v = v|(0x80>>1);
+        }
+    }
+
+    self->buffer[length++] = v;
+
+    self->buffer[length++] = ((MQTT_KEEPALIVE) >> 8);
+    self->buffer[length++] = ((MQTT_KEEPALIVE) & 0xFF);
+#if MQTT_VERSION == MQTT_VERSION_5
+    // We take as many topic aliases as we keep, and without a chunk
+    // callback nothing larger than the receive ring
+    uint16_t props = length++;
+    // No more unacknowledged QoS 1/2 messages than the inbound window holds
+    self->buffer[length++] = MQTT_PROP_RECEIVE_MAXIMUM;
+    self->buffer[length++] = (MQTT_INBOUND_WINDOW >> 8);
+    self->buffer[length++] = (MQTT_INBOUND_WINDOW & 0xFF);
+    self->buffer[length++] = MQTT_PROP_TOPIC_ALIAS_MAXIMUM;
+    self->buffer[length++] = (MQTT_TOPIC_ALIAS_MAX >> 8);
+    self->buffer[length++] = (MQTT_TOPIC_ALIAS_MAX & 0xFF);
+    if (self->chunkCallback == NULL) {
+        uint32_t size = self->rxSize;
+        self->buffer[length++] = MQTT_PROP_MAXIMUM_PACKET_SIZE;
+        self->buffer[length++] = (size >> 24);
+        self->buffer[length++] = (size >> 16) & 0xFF;
+        self->buffer[length++] = (size >> 8) & 0xFF;
+        self->buffer[length++] = (size & 0xFF);
+    }
+    if (self->keepSession) {
+        // Without an expiry the session would end with the connection
+        uint32_t expiry = MQTT_SESSION_EXPIRY;
+        self->buffer[length++] = MQTT_PROP_SESSION_EXPIRY;
+        self->buffer[length++] = (expiry >> 24);
+        self->buffer[length++] = (expiry >> 16) & 0xFF;
+        self->buffer[length++] = (expiry >> 8) & 0xFF;
+        self->buffer[length++] = (expiry & 0xFF);
+    }
+    self->buffer[props] = length - props - 1;
+
+    self->receiveMaximum = 65535;
+    self->aliasMaximum = 0;
+    self->maximumPacketSize = 0;
+    self->aliasNext = 0;
+    memset(self->aliasOut, 0, sizeof(self->aliasOut));
+    memset(self->aliasIn, 0, sizeof(self->aliasIn));
+#endif
+    length = writeString(id,self->buffer,length);
+    if (willTopic) {
+#if MQTT_VERSION == MQTT_VERSION_5
+        // No will properties
+        self->buffer[length++] = 0;
+#endif
+        length = writeString(willTopic,self->buffer,length);
+        length = writeString(willMessage,self->buffer,length);
+    }
+
+    if(user != NULL) {
+        length = writeString(user,self->buffer,length);
+        if(pass != NULL) {
+            length = writeString(pass,self->buffer,length);
+        }
+    }
+
+    // Acknowledgements of the old connection will not come anymore
+    failPending(self);
+    // Frames batched for the previous connection must not precede CONNECT,
+    // its acknowledgements are answered again when the broker repeats
+    self->batchLength = 0;
+    self->ackLength = 0;
+    // A stored or shaped frame cut off with the old connection is sent again
+    // in full
+    self->storeSent = 0;
+    self->shapedSent = 0;
+    // and a streamed one is given up
+    self->publishRemaining = 0;
+    write(self, MQTTCONNECT,self->buffer,length-5);
+
+    self->lastInActivity = self->lastOutActivity = self->millis();
+    memset(&self->reader, 0, sizeof(self->reader));
+    setState(self, MQTT_CONNECTING);
+    return true;
+}
+
+// Advances a pending handshake without waiting for the CONNACK
+static void pollConnect(PubSubClient_t* self)
+{
+    uint8_t llen;
+    uint8_t* packet;
+    uint32_t len = readPacket(self, &packet, &llen);
+
+    if (len == 0)
+    {
+        if (self->state != MQTT_CONNECTING)
+        {
+            // Dropped on a malformed packet
+            return;
+        }
+        if (!self->client->connected(self->client))
+        {
+            setState(self, MQTT_CONNECT_FAILED);
+            self->client->stop(self->client);
+        }
+        else if (!BEFORE(self->millis(), connectDeadline(self)))
+        {
+            setState(self, MQTT_CONNECTION_TIMEOUT);
+            self->client->stop(self->client);
+        }
+        return;
+    }
+
+    // CONNACK: flags and return code, in MQTT 5 followed by properties
+    if (((packet[0]&0xF0) == MQTTCONNACK) && (len >= (uint32_t)llen + 3))
+    {
+        uint8_t rc = packet[llen+2];
+        if (rc == 0)
+        {
+#if MQTT_VERSION == MQTT_VERSION_5
+            readConnackProperties(self, &packet[llen+3], len - (llen+3));
+#endif
+            self->lastInActivity = self->millis();
+            self->pingOutstanding = false;
+            self->sessionPresent = ((packet[llen+1] & 0x01) != 0);
+            if (!self->sessionPresent)
+            {
+                // A new session: message ids start over
+                uint16_t i;
+                for (i = 0; i < MQTT_INBOUND_WINDOW; i++)
+                {
+                    __atomic_store_n(&self->inbound[i], 0, __ATOMIC_RELEASE);
+                }
+                self->inboundCount = 0;
+            }
+            setState(self, MQTT_CONNECTED);
+            if ((self->reconnectMax > 0) && !self->sessionPresent)
+            {
+                // The broker forgot our subscriptions, or never had them
+                replaySubscriptions(self);
+            }
+            // Anything still in flight from the last session goes out again
+            if (self->sessionPresent)
+            {
+                retryInflight(self, 0, true);
+            }
+            else
+            {
+                renewInflight(self);
+            }
+            return;
+        } else {
+            // MQTT 5 reason codes (0x80 and up) are reported as they are
+            setState(self, rc);
+        }
+    } else {
+        setState(self, MQTT_CONNECT_FAILED);
+    }
+    self->client->stop(self->client);
+}
+
+// when the keepalive ping, or the ping timeout, is due: one keepalive period
+// after the older of the last inbound and outbound activity
+static unsigned long keepaliveDeadline(PubSubClient_t* self)
+{
+    unsigned long last = BEFORE(self->lastInActivity, self->lastOutActivity) ?
+                         self->lastInActivity : self->lastOutActivity;
+    return last + MQTT_KEEPALIVE*1000UL + 1;
+}
+
+// when a pending handshake gives up waiting for the CONNACK
+static unsigned long connectDeadline(PubSubClient_t* self)
+{
+    return self->lastInActivity + MQTT_SOCKET_TIMEOUT*1000UL;
+}
+
+// the earlier of deadline and the next in-flight retry
+static unsigned long retryDeadline(PubSubClient_t* self, unsigned long deadline)
+{
+    uint16_t i;
+    for (i = 0; (i < self->inflightSize) && (self->inflightCount > 0); i++) {
+        PubSubInflight_t* slot = &self->inflight[i];
+        if ((slot->state != PUBSUB_INFLIGHT_FREE) && BEFORE(slot->sentAt + self->retryMillis, deadline)) {
+            deadline = slot->sentAt + self->retryMillis;
+        }
+    }
+    return deadline;
+}
+
+// places the fixed header for a packet with the given remaining length so
+// that it ends at buf[4], returns the number of length bytes used
+static uint8_t buildHeader(uint8_t header, uint8_t* buf, uint32_t length)
+{
+    uint8_t lenBuf[4];
+    uint8_t llen = PubSub_encodeLength(lenBuf, length);
+
+    buf[4-llen] = header;
+    int i;
+    for (i=0;i<llen;i++) {
+        buf[5-llen+i] = lenBuf[i];
+    }
+    return llen;
+}
+
+// writes to the client, in MQTT_MAX_TRANSFER_SIZE pieces when that is set,
+// and returns how much was written
+static size_t writeOut(PubSubClient_t* self, const uint8_t* buf, size_t size)
+{
+    size_t rc;
+#ifdef MQTT_MAX_TRANSFER_SIZE
+    size_t written = 0;
+    do {
+        size_t chunk = size - written;
+        if (chunk > MQTT_MAX_TRANSFER_SIZE) {
+            chunk = MQTT_MAX_TRANSFER_SIZE;
+        }
+        rc = self->client->writeMulti(self->client, buf + written, chunk);
+        written += rc;
+    } while ((rc > 0) && (written < size));
+    rc = written;
+#else
+    rc = self->client->writeMulti(self->client, buf, size);
+#endif
+    self->lastOutActivity = self->millis();
+    STAT_ADD(bytesOut, rc);
+    if (rc < size) {
+        STAT_ADD(shortWrites, 1);
+    }
+    return rc;
+}
+
+// true when a packet went out in full. When only part of it did, the rest
+// cannot follow without mixing into the next packet, so the connection is
+// dropped.
+static boolean whole(PubSubClient_t* self, size_t written, size_t size)
+{
+    if ((written > 0) && (written < size)) {
+        setState(self, MQTT_CONNECTION_LOST);
+        self->client->stop(self->client);
+    }
+    return (written == size);
+}
+
+// counts what was sent against the rate of the shaper, when there is one
+static void charge(PubSubClient_t* self, size_t bytes, size_t messages)
+{
+    if (self->shaper != NULL) {
+        PubSubShaper_charge(self->shaper, bytes, messages);
+    }
+}
+
+// sends the PUBLISH frames waiting in the batch buffer in one write, after
+// the rest of a shaped or stored frame that only went out in part
+static boolean flushBatch(PubSubClient_t* self)
+{
+    if ((self->shapedSent > 0) && !sendShaped(self, self->shapedClass)) {
+        return false;
+    }
+    if ((self->storeSent > 0) && !sendStored(self)) {
+        return false;
+    }
+    size_t length = self->batchLength;
+    if (length == 0) {
+        return true;
+    }
+    self->batchLength = 0;
+    return whole(self, writeOut(self, self->batch, length), length);
+}
+
+// Every packet goes out through here or publishVec(), so batched frames are
+// always sent before anything written after them
+static size_t transmit(PubSubClient_t* self, const uint8_t* buf, size_t size)
+{
+    if (!flushBatch(self)) {
+        return 0;
+    }
+    size_t rc = writeOut(self, buf, size);
+    whole(self, rc, size);
+    return rc;
+}
+
+static boolean write(PubSubClient_t* self, uint8_t header, uint8_t* buf, uint16_t length)
+{
+    uint8_t llen = buildHeader(header, buf, length);
+    size_t size = (size_t)1+llen+length;
+    if (transmit(self, buf+(4-llen), size) != size) {
+        return false;
+    }
+    STAT_ADD(packetsOut[header >> 4], 1);
+    charge(self, size, 1);
+    return true;
+}
+
+static boolean writeAck(PubSubClient_t* self, uint8_t header, uint16_t msgId)
+{
+    uint8_t ack[4];
+    ack[0] = header;
+    ack[1] = 2;
+    ack[2] = (msgId >> 8);
+    ack[3] = (msgId & 0xFF);
+    if (transmit(self, ack, 4) != 4) {
+        return false;
+    }
+    STAT_ADD(packetsOut[header >> 4], 1);
+    charge(self, 4, 1);
+    return true;
+}
+
+// The variable header of a PUBLISH for topic that does not depend on the
+// session: the full address and topic and, in MQTT 5, no properties
+static void plainParts(PubSubClient_t* self, const char* topic, boolean addAddress, publishParts_t* parts)
+{
+    parts->alen = addAddress ? strlen(self->myAddress.address) : 0;
+    parts->tlen = strlen(topic);
+    parts->encoded = NULL;
+    parts->plen = 0;
+    parts->assign = -1;
+#if MQTT_VERSION == MQTT_VERSION_5
+    parts->props[parts->plen++] = 0;
+#endif
+}
+
+// Works out the variable header of a PUBLISH for topic, apart from the
+// message id: how much of the address and topic is sent and, in MQTT 5, the
+// property block with the topic alias. Nothing changes until
+// commitPublish() is called for a packet that actually went out.
+static void publishParts(PubSubClient_t* self, const char* topic, boolean addAddress, publishParts_t* parts)
+{
+    plainParts(self, topic, addAddress, parts);
+#if MQTT_VERSION == MQTT_VERSION_5
+    uint16_t count = (self->aliasMaximum < MQTT_TOPIC_ALIAS_MAX) ? self->aliasMaximum : MQTT_TOPIC_ALIAS_MAX;
+    size_t full = parts->alen + parts->tlen;
+    if ((count == 0) || (full == 0) || (full >= MQTT_TOPIC_ALIAS_LENGTH)) {
+        return;
+    }
+    uint16_t i;
+    for (i = 0; i < count; i++) {
+        const char* slot = self->aliasOut[i];
+        if ((strncmp(slot, self->myAddress.address, parts->alen) == 0) &&
+            (strcmp(&slot[parts->alen], topic) == 0)) {
+            break;
+        }
+    }
+    if (i == count) {
+        // Not known to the broker yet: send the topic along with a new alias
+        i = self->aliasNext;
+        parts->assign = i;
+    } else {
+        parts->alen = 0;
+        parts->tlen = 0;
+    }
+    parts->props[0] = 3;
+    parts->props[parts->plen++] = MQTT_PROP_TOPIC_ALIAS;
+    parts->props[parts->plen++] = ((i + 1) >> 8);
+    parts->props[parts->plen++] = ((i + 1) & 0xFF);
+#endif
+}
+
+// Records the alias a sent PUBLISH introduced to the broker
+static void commitPublish(PubSubClient_t* self, const publishParts_t* parts, const char* topic)
+{
+#if MQTT_VERSION == MQTT_VERSION_5
+    if (parts->assign >= 0) {
+        char* slot = self->aliasOut[parts->assign];
+        uint16_t count = (self->aliasMaximum < MQTT_TOPIC_ALIAS_MAX) ? self->aliasMaximum : MQTT_TOPIC_ALIAS_MAX;
+        memcpy(slot, self->myAddress.address, parts->alen);
+        strcpy(&slot[parts->alen], topic);
+        self->aliasNext = (parts->assign + 1) % count;
+    }
+#endif
+}
+
+// Writes the topic length, address prefix and topic as publishParts() chose
+// them, returns the number of bytes written
+static size_t putTopic(PubSubClient_t* self, uint8_t* out, const publishParts_t* parts, const char* topic)
+{
+    size_t tlen = parts->alen + parts->tlen;
+    if (parts->encoded != NULL) {
+        memcpy(out, parts->encoded, 2 + tlen);
+        return 2 + tlen;
+    }
+    out[0] = (tlen >> 8);
+    out[1] = (tlen & 0xFF);
+    memcpy(&out[2], self->myAddress.address, parts->alen);
+    memcpy(&out[2 + parts->alen], topic, parts->tlen);
+    return 2 + tlen;
+}
+
+// Appends a PUBLISH frame to the batch buffer, flushing it first when the
+// frame would take it past limit. Returns 1 when queued, 0 when the frame is
+// larger than limit on its own and -1 when the flush failed.
+static int queuePublish(PubSubClient_t* self, uint8_t header, const publishParts_t* parts, const char* topic, const uint8_t* payload, unsigned int plength, uint16_t msgId, size_t limit)
+{
+    size_t ilen = (msgId != 0) ? 2 : 0;
+    size_t remaining = 2 + parts->alen + parts->tlen + ilen + parts->plen + plength;
+    uint8_t lenBuf[4];
+    uint8_t llen;
+
+    if (limit > self->batchSize) {
+        limit = self->batchSize;
+    }
+    llen = PubSub_encodeLength(lenBuf, remaining);
+    if (1 + llen + remaining > limit) {
+        return 0;
+    }
+    if ((self->batchLength + 1 + llen + remaining > limit) && !flushBatch(self)) {
+        return -1;
+    }
+    if (self->batchLength == 0) {
+        self->batchSince = self->millis();
+    }
+
+    uint8_t* out = &self->batch[self->batchLength];
+    *out++ = header;
+    memcpy(out, lenBuf, llen);
+    out += llen;
+    out += putTopic(self, out, parts, topic);
+    if (ilen > 0) {
+        *out++ = (msgId >> 8);
+        *out++ = (msgId & 0xFF);
+    }
+    memcpy(out, parts->props, parts->plen);
+    out += parts->plen;
+    memcpy(out, payload, plength);
+    self->batchLength += 1 + llen + remaining;
+    // Counted when queued: the flush only sees bytes
+    STAT_ADD(packetsOut[MQTTPUBLISH >> 4], 1);
+    charge(self, 1 + llen + remaining, 1);
+    return 1;
+}
+
+// Lays out a PUBLISH as separate segments: the fixed header and topic length
+// in head, the address prefix, the topic, the message id in id, the
+// properties and the caller's payload as they are. An encoded topic is one
+// segment with its length. Returns the number of segments, the frame size in
+// size.
+static int framePublish(PubSubClient_t* self, uint8_t header, const publishParts_t* parts, const char* topic, const uint8_t* payload, unsigned int plength, uint16_t msgId, uint8_t* head, uint8_t* id, struct iovec* iov, size_t* size)
+{
+    int count = 0;
+    uint8_t pos = 0;
+    size_t tlen = parts->alen + parts->tlen;
+    size_t ilen = (msgId != 0) ? 2 : 0;
+    size_t remaining = 2 + tlen + ilen + parts->plen + plength;
+
+    head[pos++] = header;
+    pos += PubSub_encodeLength(&head[pos], remaining);
+    if (parts->encoded != NULL) {
+        iov[count].iov_base = head;
+        iov[count++].iov_len = pos;
+        iov[count].iov_base = (void*)parts->encoded;
+        iov[count++].iov_len = 2 + tlen;
+        pos += 2;
+    } else {
+        head[pos++] = (tlen >> 8);
+        head[pos++] = (tlen & 0xFF);
+        iov[count].iov_base = head;
+        iov[count++].iov_len = pos;
+    }
+    if (parts->alen > 0) {
+        iov[count].iov_base = self->myAddress.address;
+        iov[count++].iov_len = parts->alen;
+    }
+    if ((parts->tlen > 0) && (parts->encoded == NULL)) {
+        iov[count].iov_base = (void*)topic;
+        iov[count++].iov_len = parts->tlen;
+    }
+    if (ilen > 0) {
+        id[0] = (msgId >> 8);
+        id[1] = (msgId & 0xFF);
+        iov[count].iov_base = id;
+        iov[count++].iov_len = ilen;
+    }
+    if (parts->plen > 0) {
+        iov[count].iov_base = (void*)parts->props;
+        iov[count++].iov_len = parts->plen;
+    }
+    if (plength > 0) {
+        iov[count].iov_base = (void*)payload;
+        iov[count++].iov_len = plength;
+    }
+    *size = pos - 2 + remaining;
+    return count;
+}
+
+#ifndef MQTT_MAX_TRANSFER_SIZE
+// Sends a PUBLISH through the client's writeVec. Nothing is staged in the
+// buffer, so the payload is not limited by the packet size.
+static boolean publishVec(PubSubClient_t* self, uint8_t header, const publishParts_t* parts, const char* topic, const uint8_t* payload, unsigned int plength, uint16_t msgId)
+{
+    uint8_t head[1+4+2];
+    uint8_t id[2];
+    struct iovec iov[6];
+    size_t size;
+    int count = framePublish(self, header, parts, topic, payload, plength, msgId, head, id, iov, &size);
+
+    if (!flushBatch(self)) {
+        return false;
+    }
+    size_t rc = self->client->writeVec(self->client, iov, count);
+    self->lastOutActivity = self->millis();
+    STAT_ADD(bytesOut, rc);
+    if (rc < size) {
+        STAT_ADD(shortWrites, 1);
+        return whole(self, rc, size);
+    }
+    STAT_ADD(packetsOut[MQTTPUBLISH >> 4], 1);
+    charge(self, size, 1);
+    return true;
+}
+#endif
+
+// true when a QoS 0 publish goes to the offline store: while the session is
+// down, and while older stored frames are still waiting so the order holds
+static boolean storing(PubSubClient_t* self, boolean connected)
+{
+    const uint8_t* data;
+    return (self->store != NULL) && (!connected || (self->store->peek(self->store, &data) > 0));
+}
+
+// Appends a PUBLISH frame with the full topic to the offline store
+static boolean storePublish(PubSubClient_t* self, uint8_t header, const publishParts_t* parts, const char* topic, const uint8_t* payload, unsigned int plength)
+{
+    uint8_t head[1+4+2];
+    uint8_t id[2];
+    struct iovec iov[6];
+    size_t size;
+
+    if ((parts->alen + parts->tlen > 0xFFFF) ||
+        (2 + parts->alen + parts->tlen + parts->plen + plength > MQTT_MAX_REMAINING_LENGTH)) {
+        // Too long
+        return false;
+    }
+    int count = framePublish(self, header, parts, topic, payload, plength, 0, head, id, iov, &size);
+    return self->store->append(self->store, iov, count, self->storeSent);
+}
+
+// Sends the rest of the oldest stored frame, true once it is out in full
+static boolean sendStored(PubSubClient_t* self)
+{
+    const uint8_t* data;
+    size_t size = self->store->peek(self->store, &data);
+    uint32_t length;
+    int used = PubSub_decodeLength(&data[1], size - 1, &length);
+
+    if (used <= 0) {
+        return false;
+    }
+    size_t frame = 1 + used + length;
+    size_t sent = writeOut(self, &data[self->storeSent], frame - self->storeSent);
+    self->storeSent += sent;
+    charge(self, sent, (self->storeSent == frame) ? 1 : 0);
+    if (self->storeSent < frame) {
+        return false;
+    }
+    self->store->consume(self->store, frame);
+    self->storeSent = 0;
+    STAT_ADD(packetsOut[MQTTPUBLISH >> 4], 1);
+    return true;
+}
+
+// Sends stored frames, at most MQTT_STORE_DRAIN_SIZE bytes per call so that a
+// long backlog does not hold up the loop. When the client takes less than
+// offered, the rest waits for the next call. Frames leave the store only once
+// they are completely sent, so that a new session starts on a frame boundary.
+static void drainStore(PubSubClient_t* self)
+{
+    size_t budget = MQTT_STORE_DRAIN_SIZE;
+    const uint8_t* data;
+
+    self->storeBlocked = false;
+    if ((self->shaper != NULL) && PubSubShaper_waiting(self->shaper, PUBSUB_CLASS_REALTIME)) {
+        // Shaped like bulk data
+        return;
+    }
+    if (self->store->peek(self->store, &data) == 0) {
+        return;
+    }
+    // Batched frames and one left partly sent go first, then the store is
+    // written directly: nothing else is sent in between
+    if (!flushBatch(self)) {
+        self->storeBlocked = true;
+        return;
+    }
+    while (budget > 0) {
+        size_t size = self->store->peek(self->store, &data);
+        if (size <= self->storeSent) {
+            return;
+        }
+        size_t offer = size - self->storeSent;
+        if (offer > budget) {
+            offer = budget;
+        }
+        if ((self->shaper != NULL) && !PubSubShaper_admit(self->shaper, offer, self->millis())) {
+            return;
+        }
+        size_t sent = writeOut(self, &data[self->storeSent], offer);
+        self->storeSent += sent;
+
+        size_t done = 0;
+        size_t frames = 0;
+        while (done < self->storeSent) {
+            uint32_t length;
+            int used = PubSub_decodeLength(&data[done+1], size - done - 1, &length);
+            if ((used <= 0) || (done + 1 + used + length > self->storeSent)) {
+                break;
+            }
+            done += 1 + used + length;
+            frames++;
+            STAT_ADD(packetsOut[MQTTPUBLISH >> 4], 1);
+        }
+        if (done > 0) {
+            self->store->consume(self->store, done);
+            self->storeSent -= done;
+        }
+        charge(self, sent, frames);
+        if (sent < offer) {
+            self->storeBlocked = true;
+            return;
+        }
+        budget -= offer;
+    }
+}
+
+// Sends what other threads queued, in order: up to MQTT_QUEUE_DRAIN_COUNT
+// messages batched into one write, or into the offline store while that is
+// in use. Without a way to take them they stay queued.
+static void drainQueue(PubSubClient_t* self)
+{
+    boolean connected = PubSub_connected(self);
+    boolean store = storing(self, connected);
+    const PubSubQueueSlot_t* slot;
+    int i;
+
+    if (!connected && !store) {
+        return;
+    }
+    for (i = 0; (i < MQTT_QUEUE_DRAIN_COUNT) && ((slot = PubSubQueue_peek(self->queue)) != NULL); i++) {
+        uint8_t header = MQTTPUBLISH | (slot->retained ? 1 : 0);
+        boolean rc;
+        if (store) {
+            publishParts_t parts;
+            plainParts(self, slot->data, slot->addAddress, &parts);
+            rc = storePublish(self, header, &parts, slot->data, slot->payload, slot->plength);
+        } else {
+            rc = (self->shaper != NULL)
+                ? shapePublish(self, header, slot->data, slot->payload, slot->plength, slot->addAddress, MQTT_SHAPER_DEFAULT_CLASS, self->batchSize)
+                : sendPublish(self, header, slot->data, slot->payload, slot->plength, slot->addAddress, 0, self->batchSize);
+        }
+        if (!rc) {
+            self->queue->failed++;
+        }
+        PubSubQueue_pop(self->queue);
+    }
+    if (store) {
+        if (connected) {
+            drainStore(self);
+        }
+    } else if (self->coalesceBytes == 0) {
+        // Unless coalescing keeps them for later, the frames go out now
+        flushBatch(self);
+    }
+}
+
+// Sends a QoS 0 PUBLISH at once when nothing of its class or a higher one is
+// waiting and the rate allows it, else queues its frame, with the full topic,
+// in the shaper queue of class cls
+static boolean shapePublish(PubSubClient_t* self, uint8_t header, const char* topic, const uint8_t* payload, unsigned int plength, boolean addAddress, uint8_t cls, size_t limit)
+{
+    publishParts_t parts;
+
+    plainParts(self, topic, addAddress, &parts);
+    return shapeParts(self, header, &parts, topic, payload, plength, addAddress, cls, limit);
+}
+
+// shapePublish() with the full topic laid out by parts
+static boolean shapeParts(PubSubClient_t* self, uint8_t header, const publishParts_t* parts, const char* topic, const uint8_t* payload, unsigned int plength, boolean addAddress, uint8_t cls, size_t limit)
+{
+    PubSubShaper_t* shaper = self->shaper;
+    uint8_t head[1+4+2];
+    uint8_t id[2];
+    struct iovec iov[6];
+    size_t size;
+
+    if (cls >= PUBSUB_CLASSES) {
+        return false;
+    }
+    size_t remaining = 2 + parts->alen + parts->tlen + parts->plen + plength;
+    if ((parts->alen + parts->tlen > 0xFFFF) || !fitsBroker(self, remaining)) {
+        // Too long
+        return false;
+    }
+    uint8_t lenBuf[4];
+    size = 1 + PubSub_encodeLength(lenBuf, remaining) + remaining;
+    if (!PubSubShaper_waiting(shaper, cls) && (self->shapedSent == 0) &&
+        ((cls == PUBSUB_CLASS_CONTROL) || PubSubShaper_admit(shaper, size, self->millis()))) {
+#if MQTT_VERSION == MQTT_VERSION_5
+        // The topic alias lookup takes the place of the full topic
+        return sendPublish(self, header, topic, payload, plength, addAddress, 0, limit);
+#else
+        return sendParts(self, header, parts, topic, payload, plength, 0, limit);
+#endif
+    }
+    int count = framePublish(self, header, parts, topic, payload, plength, 0, head, id, iov, &size);
+    if (!PubSubShaper_append(shaper, cls, iov, count, size)) {
+        return false;
+    }
+    drainShaper(self);
+    return true;
+}
+
+// Sends the rest of the oldest shaped frame of class cls, true once it is
+// out in full. When the client takes less, the rest goes before anything
+// else is written.
+static boolean sendShaped(PubSubClient_t* self, uint8_t cls)
+{
+    PubSubShaper_t* shaper = self->shaper;
+    size_t size = PubSubShaper_frame(shaper, cls);
+    const uint8_t* data;
+
+    while (self->shapedSent < size) {
+        size_t piece = PubSubShaper_peek(shaper, cls, self->shapedSent, &data);
+        size_t sent = writeOut(self, data, piece);
+        self->shapedSent += sent;
+        if (sent < piece) {
+            self->shapedClass = cls;
+            return false;
+        }
+    }
+    self->shapedSent = 0;
+    PubSubShaper_pop(shaper, cls);
+    PubSubShaper_charge(shaper, size, 1);
+    STAT_ADD(packetsOut[MQTTPUBLISH >> 4], 1);
+    return true;
+}
+
+// Sends queued shaped frames, highest class first, as far as the rate
+// allows. The control class is only counted against it.
+static void drainShaper(PubSubClient_t* self)
+{
+    PubSubShaper_t* shaper = self->shaper;
+    unsigned long t = self->millis();
+    int cls;
+
+    if ((self->shapedSent > 0) && !sendShaped(self, self->shapedClass)) {
+        return;
+    }
+    while ((cls = PubSubShaper_next(shaper)) >= 0) {
+        if ((cls != PUBSUB_CLASS_CONTROL) &&
+            !PubSubShaper_admit(shaper, PubSubShaper_frame(shaper, cls), t)) {
+            return;
+        }
+        // Frames batched before go first
+        if (!flushBatch(self) || !sendShaped(self, cls)) {
+            return;
+        }
+    }
+}
+
+// true when a packet with the given remaining length may be sent: the
+// protocol limit and, in MQTT 5, the Maximum Packet Size of the broker
+static boolean fitsBroker(PubSubClient_t* self, size_t remaining)
+{
+    if (remaining > MQTT_MAX_REMAINING_LENGTH) {
+        return false;
+    }
+#if MQTT_VERSION == MQTT_VERSION_5
+    uint8_t lenBuf[4];
+    if ((self->maximumPacketSize != 0) &&
+        (1 + PubSub_encodeLength(lenBuf, remaining) + remaining > self->maximumPacketSize)) {
+        return false;
+    }
+#endif
+    return true;
+}
+
+// Sends a PUBLISH, msgId is only included when it is not 0
+static boolean sendPublish(PubSubClient_t* self, uint8_t header, const char* topic, const uint8_t* payload, unsigned int plength, boolean addAddress, uint16_t msgId, size_t limit)
+{
+    publishParts_t parts;
+
+    publishParts(self, topic, addAddress, &parts);
+    return sendParts(self, header, &parts, topic, payload, plength, msgId, limit);
+}
+
+// Sends a PUBLISH laid out by parts: queued in the batch buffer when limit
+// allows it, through writeVec when the client has it, otherwise staged in the
+// buffer
+static boolean sendParts(PubSubClient_t* self, uint8_t header, const publishParts_t* parts, const char* topic, const uint8_t* payload, unsigned int plength, uint16_t msgId, size_t limit)
+{
+    boolean rc;
+    size_t ilen = (msgId != 0) ? 2 : 0;
+
+    size_t remaining = 2 + parts->alen + parts->tlen + ilen + parts->plen + plength;
+    if ((parts->alen + parts->tlen > 0xFFFF) || !fitsBroker(self, remaining)) {
+        // Too long
+        return false;
+    }
+
+    int queued = (limit > 0) ? queuePublish(self, header, parts, topic, payload, plength, msgId, limit) : 0;
+    if (queued != 0) {
+        rc = (queued > 0);
+    }
+#ifndef MQTT_MAX_TRANSFER_SIZE
+    else if (self->client->writeVec != NULL) {
+        rc = publishVec(self, header, parts, topic, payload, plength, msgId);
+    }
+#endif
+    else if (self->bufferSize < 5 + remaining) {
+        // Too long
+        return false;
+    }
+    else {
+        // Leave room in the buffer for header and variable length field
+        uint16_t length = 5;
+        length += putTopic(self, &self->buffer[length], parts, topic);
+        if (msgId != 0) {
+            self->buffer[length++] = (msgId >> 8);
+            self->buffer[length++] = (msgId & 0xFF);
+        }
+        memcpy(&self->buffer[length], parts->props, parts->plen);
+        length += parts->plen;
+        memcpy(&self->buffer[length], payload, plength);
+        length += plength;
+        rc = write(self, header,self->buffer,length-5);
+    }
+    if (rc) {
+        commitPublish(self, parts, topic);
+    }
+    return rc;
+}
+
+// A free slot of the in-flight window with the next message id, for a
+// PUBLISH of remaining bytes after the fixed header. NULL when not
+// connected, when the window is full or the broker would refuse the packet.
+static PubSubInflight_t* claimInflight(PubSubClient_t* self, size_t remaining)
+{
+    if ((self->inflightSize == 0) || !PubSub_connected(self)) {
+        return NULL;
+    }
+    uint16_t window = self->inflightSize;
+#if MQTT_VERSION == MQTT_VERSION_5
+    if (window > self->receiveMaximum) {
+        window = self->receiveMaximum;
+    }
+    // Retries may have to send the full topic again, so size it without alias
+    remaining += 4;
+#endif
+    if ((self->inflightCount >= window) || !fitsBroker(self, remaining)) {
+        return NULL;
+    }
+
+    // Pick the next id whose slot is free, so acks find their slot directly
+    PubSubInflight_t* slot;
+    do {
+        self->nextMsgId++;
+        if (self->nextMsgId == 0) {
+            self->nextMsgId = 1;
+        }
+        slot = &self->inflight[self->nextMsgId % self->inflightSize];
+    } while (slot->state != PUBSUB_INFLIGHT_FREE);
+    return slot;
+}
+
+// (Re)sends the packet the slot is waiting on: the PUBLISH, or the PUBREL
+// once the broker has sent PUBREC.
+static void sendInflight(PubSubClient_t* self, PubSubInflight_t* slot, boolean dup)
+{
+    slot->sentAt = self->millis();
+    if (slot->state == PUBSUB_INFLIGHT_PUBCOMP) {
+        writeAck(self, MQTTPUBREL|MQTTQOS1, slot->msgId);
+        return;
+    }
+    uint8_t header = MQTTPUBLISH | (slot->qos << 1);
+    if (slot->retained) {
+        header |= 1;
+    }
+    if (dup) {
+        header |= MQTTDUP;
+    }
+    sendPublish(self, header, slot->topic, slot->payload, slot->plength, slot->addAddress, slot->msgId, self->coalesceBytes);
+}
+
+// Resends every in-flight message older than the retry interval, or all of
+// them after a reconnect.
+static void retryInflight(PubSubClient_t* self, unsigned long t, boolean all)
+{
+    uint16_t i;
+    for (i = 0; i < self->inflightSize; i++) {
+        PubSubInflight_t* slot = &self->inflight[i];
+        if ((slot->state != PUBSUB_INFLIGHT_FREE) &&
+            (all || !BEFORE(t, slot->sentAt + self->retryMillis))) {
+            sendInflight(self, slot, true);
+        }
+    }
+}
+
+// After the broker started a new session it knows none of the messages in
+// flight: they are sent again as new ones, without DUP. A QoS 2 message that
+// was already released reached the broker, so it is complete.
+static void renewInflight(PubSubClient_t* self)
+{
+    uint16_t i;
+    for (i = 0; i < self->inflightSize; i++) {
+        PubSubInflight_t* slot = &self->inflight[i];
+        if (slot->state == PUBSUB_INFLIGHT_PUBCOMP) {
+            finishInflight(self, slot);
+        } else if (slot->state != PUBSUB_INFLIGHT_FREE) {
+            sendInflight(self, slot, false);
+        }
+    }
+}
+
+// Matches an acknowledgement to its in-flight slot, returns false when no
+// message is waiting for it
+static boolean completeInflight(PubSubClient_t* self, uint16_t msgId, uint8_t expected)
+{
+    PubSubInflight_t* slot = findInflight(self, msgId, expected);
+    if (slot == NULL) {
+        return false;
+    }
+    if (expected == PUBSUB_INFLIGHT_PUBREC) {
+        // QoS 2, part 2: release the message
+        slot->state = PUBSUB_INFLIGHT_PUBCOMP;
+        sendInflight(self, slot, false);
+        return true;
+    }
+    finishInflight(self, slot);
+    return true;
+}
+
+// The slot waiting for this acknowledgement, NULL when there is none
+static PubSubInflight_t* findInflight(PubSubClient_t* self, uint16_t msgId, uint8_t expected)
+{
+    if (self->inflightSize == 0) {
+        return NULL;
+    }
+    PubSubInflight_t* slot = &self->inflight[msgId % self->inflightSize];
+    if ((slot->msgId != msgId) || (slot->state != expected)) {
+        return NULL;
+    }
+    return slot;
+}
+
+// Frees a slot whose exchange is over and tells the publisher
+static void finishInflight(PubSubClient_t* self, PubSubInflight_t* slot)
+{
+    slot->state = PUBSUB_INFLIGHT_FREE;
+    self->inflightCount--;
+    if (slot->callback != NULL) {
+        slot->callback(self, slot->msgId);
+    }
+}
+
+static uint16_t copyString(const char* string, char* buf, uint16_t max)
+{
+    const char* p = string;
+    uint16_t pos = 0;
+    while( (*p) && (pos<max))
+    {
+        buf[pos++] = *p++;
+    }
+    return pos;
+}
+
+static uint16_t writeStringAddAddress(PubSubClient_t* self, const char* string, char* buf, uint16_t pos)
+{
+    uint16_t start = pos;
+    pos += 2;
+    pos += copyString ((char*)self->myAddress.address,  &buf[pos], strlen(self->myAddress.address));
+    pos += copyString ((char*)string,             &buf[pos], strlen(string));
+
+    buf[start]   = ((pos-start-2) >> 8);
+    buf[start+1] = ((pos-start-2) & 0xFF);
+    return pos;
+}
+
+static uint16_t writeString(const char* string, uint8_t* buf, uint16_t pos)
+{
+    const char* idp = string;
+    uint16_t i = 0;
+    pos += 2;
+    while (*idp)
+    {
+        buf[pos++] = *idp++;
+        i++;
+    }
+    buf[pos-i-2] = (i >> 8);
+    buf[pos-i-1] = (i & 0xFF);
+    return pos;
+}
+
+#if MQTT_VERSION == MQTT_VERSION_5
+// Reads one MQTT 5 property. Integer values are returned in value, strings
+// and binary data are skipped. Returns the bytes used, or -1 when the
+// property is unknown or runs past size.
+static int readProperty(const uint8_t* buf, size_t size, uint8_t* id, uint32_t* value)
+{
+    size_t used = 0;
+    if (size < 1) {
+        return -1;
+    }
+    *id = buf[0];
+    *value = 0;
+    switch (*id) {
+    case 0x01: case 0x17: case 0x19: case 0x24:
+    case 0x25: case 0x28: case 0x29: case 0x2A:
+        used = 1;
+        break;
+    case 0x13: case 0x21: case 0x22: case 0x23:
+        used = 2;
+        break;
+    case 0x02: case 0x11: case 0x18: case 0x27:
+        used = 4;
+        break;
+    case 0x0B: {
+        int n = PubSub_decodeLength(&buf[1], size - 1, value);
+        return (n > 0) ? (1 + n) : -1;
+    }
+    case 0x03: case 0x08: case 0x09: case 0x12: case 0x15:
+    case 0x16: case 0x1A: case 0x1C: case 0x1F: case 0x26: {
+        // Length prefixed string or binary data, a user property is two
+        size_t pos = 1;
+        int strings = (*id == 0x26) ? 2 : 1;
+        while (strings--) {
+            if (pos + 2 > size) {
+                return -1;
+            }
+            pos += 2 + ((buf[pos] << 8) | buf[pos+1]);
+        }
+        return (pos <= size) ? (int)pos : -1;
+    }
+    default:
+        return -1;
+    }
+    if (1 + used > size) {
+        return -1;
+    }
+    size_t i;
+    for (i = 1; i <= used; i++) {
+        *value = (*value << 8) | buf[i];
+    }
+    return 1 + used;
+}
+
+// Takes the broker's limits from the CONNACK property block
+static void readConnackProperties(PubSubClient_t* self, const uint8_t* buf, size_t size)
+{
+    uint32_t plen;
+    int used = PubSub_decodeLength(buf, size, &plen);
+    if ((used <= 0) || (plen > size - used)) {
+        return;
+    }
+    buf += used;
+    while (plen > 0) {
+        uint8_t id;
+        uint32_t value;
+        int n = readProperty(buf, plen, &id, &value);
+        if (n <= 0) {
+            return;
+        }
+        if (id == MQTT_PROP_RECEIVE_MAXIMUM) {
+            self->receiveMaximum = value;
+        } else if (id == MQTT_PROP_TOPIC_ALIAS_MAXIMUM) {
+            self->aliasMaximum = value;
+        } else if (id == MQTT_PROP_MAXIMUM_PACKET_SIZE) {
+            self->maximumPacketSize = value;
+        }
+        buf += n;
+        plen -= n;
+    }
+}
+#endif
+/******************************************************************************
+ * Function implementation
+ *****************************************************************************/
+
+boolean PubSub_setMyAddress(PubSubClient_t* self,
+                            const char* globalLocation,
+                            const char* localLocation,
+                            const char* deviceName)
+{
+    if (!allocateBuffers(self) ||
+        (strlen(globalLocation) + strlen(localLocation) + strlen(deviceName) + 4 > self->myAddress.size))
+    {
+        return false;
+    }
+    char *p = self->myAddress.address;
+
+    p += copyString(globalLocation, p, strlen(globalLocation));
+    *(p++) = '/';
+    *(p) = 0x0;
+
+    p += copyString(localLocation,  p, strlen(localLocation));
+    *(p++) = '/';
+    *(p) = 0x0;
+
+    p += copyString(deviceName,     p, strlen(deviceName));
+    *(p++) = '/';
+    *(p) = 0x0;
+
+    self->myAddress.length =  p - self->myAddress.address;
+    return true;
+}
+
+void PubSub_init(PubSubClient_t* self, Client_t* client, fpMillis_t fpMillis)
+{
+    self->state = MQTT_DISCONNECTED;
+    setClient(self, client, fpMillis);
+    allocateBuffers(self);
+}
+
+void PubSub_initIP(PubSubClient_t* self, Client_t* client, fpMillis_t fpMillis, uint8_t *ip, uint16_t port)
+{
+    PubSub_initIPCallback(self, client, fpMillis, ip, port, NULL);
+}
+
+void PubSub_initIPCallback(PubSubClient_t* self, Client_t* client, fpMillis_t fpMillis, uint8_t *ip, uint16_t port, MQTT_CALLBACK_SIGNATURE)
+{
+    self->state = MQTT_DISCONNECTED;
+    setServerIP(self, ip, port);
+    setCallback(self, callback);
+    setClient(self, client, fpMillis);
+    allocateBuffers(self);
+}
+
+void PubSub_initHost(PubSubClient_t* self, Client_t* client, fpMillis_t fpMillis, const char* domain, uint16_t port)
+{
+    PubSub_initHostCallback(self, client, fpMillis, domain, port, NULL);
+}
+
+void PubSub_initHostCallback(PubSubClient_t* self, Client_t* client, fpMillis_t fpMillis, const char* domain, uint16_t port, MQTT_CALLBACK_SIGNATURE)
+{
+    self->state = MQTT_DISCONNECTED;
+    setServerHost(self, domain,port);
+    setCallback(self, callback);
+    setClient(self, client, fpMillis);
+    allocateBuffers(self);
+}
+
+boolean PubSub_connectId(PubSubClient_t* self, const char *id)
+{
+    return PubSub_connect(self, id,NULL,NULL,0,0,0,0);
+}
+
+boolean PubSub_connectIdUserPass(PubSubClient_t* self, const char *id, const char *user, const char *pass)
+{
+    return PubSub_connect(self, id,user,pass,0,0,0,0);
+}
+
+/*boolean PubSubClient::connect(const char *id, const char* willTopic, uint8_t willQos, boolean willRetain, const char* willMessage) {
+    return connect(id,NULL,NULL,willTopic,willQos,willRetain,willMessage);
+}*/
+
+boolean PubSub_connect(PubSubClient_t* self, const char *id, const char *user, const char *pass, const char* willTopic, uint8_t willQos, boolean willRetain, const char* willMessage) {
+    if (PubSub_connected(self))
+    {
+        return true;
+    }
+    if (self->state != MQTT_CONNECTING)
+    {
+        if (self->jitter == 0)
+        {
+            // Seed the backoff jitter differently for every client
+            uint32_t seed = 2166136261UL ^ self->millis() ^ (uint32_t)(uintptr_t)self;
+            const char* c;
+            for (c = id; *c != 0; c++)
+            {
+                seed = (seed ^ (uint8_t)*c) * 16777619UL;
+            }
+            self->jitter = (seed != 0) ? seed : 1;
+        }
+        self->connectId = id;
+        self->connectUser = user;
+        self->connectPass = pass;
+        self->willTopic = willTopic;
+        self->willQos = willQos;
+        self->willRetain = willRetain;
+        self->willMessage = willMessage;
+        if (!startConnect(self, id, user, pass, willTopic, willQos, willRetain, willMessage))
+        {
+            return false;
+        }
+    }
+    if (self->asyncConnect)
+    {
+        // PubSub_loop() finishes the handshake
+        return true;
+    }
+    while (self->state == MQTT_CONNECTING)
+    {
+        if (self->client->wait != NULL)
+        {
+            // Sleep until the CONNACK arrives or it is too late for it
+            unsigned long t = self->millis();
+            unsigned long deadline = connectDeadline(self);
+            self->client->wait(self->client, BEFORE(t, deadline) ? deadline - t : 0);
+        }
+        pollConnect(self);
+    }
+    return (self->state == MQTT_CONNECTED);
+}
+
+boolean PubSub_loop(PubSubClient_t* self)
+{
+    if (self->state == MQTT_CONNECTING)
+    {
+        pollConnect(self);
+        if (self->state != MQTT_CONNECTED)
+        {
+            return (self->state == MQTT_CONNECTING);
+        }
+    }
+    if (self->publishRemaining > 0)
+    {
+        // Nothing may go out in the middle of a streamed publish
+        return PubSub_connected(self);
+    }
+    if (PubSub_connected(self))
+    {
+        unsigned long t = self->millis();
+
+        if ((self->batchLength > 0) && !BEFORE(t, self->batchSince + self->coalesceDelay))
+        {
+            flushBatch(self);
+        }
+        if (!BEFORE(t, keepaliveDeadline(self)))
+        {
+            if (self->pingOutstanding) {
+                setState(self, MQTT_CONNECTION_TIMEOUT);
+                self->client->stop(self->client);
+                return false;
+            } else {
+                self->buffer[0] = MQTTPINGREQ;
+                self->buffer[1] = 0;
+                if (transmit(self, self->buffer, 2) == 2) {
+                    STAT_ADD(packetsOut[MQTTPINGREQ >> 4], 1);
+                    charge(self, 2, 1);
+                }
+#if MQTT_STATS
+                self->pingSentAt = statsNow(self);
+#endif
+                self->lastOutActivity = t;
+                self->lastInActivity = t;
+                self->pingOutstanding = true;
+            }
+        }
+        uint8_t llen;
+        uint8_t* packet;
+        uint32_t len;
+        if (self->inflightCount > 0)
+        {
+            retryInflight(self, t, false);
+        }
+        if (self->store != NULL)
+        {
+            drainStore(self);
+        }
+        if (self->queue != NULL)
+        {
+            drainQueue(self);
+        }
+        if (self->shaper != NULL)
+        {
+            drainShaper(self);
+        }
+        // Handle every complete packet that is already buffered, as long as
+        // the dispatcher can take what comes
+        while (!PubSub_inputHeld(self) && ((len = readPacket(self, &packet, &llen)) > 0))
+        {
+            self->lastInActivity = t;
+            handlePacket(self, packet, len, llen);
+            if (self->state != MQTT_CONNECTED)
+            {
+                return false;
+            }
+        }
+        if (self->state != MQTT_CONNECTED)
+        {
+            // Dropped on a malformed packet
+            return false;
+        }
+        collectAcks(self);
+        flushAcks(self);
+        return true;
+    }
+    if ((self->queue != NULL) && (self->store != NULL))
+    {
+        // Offline: queued publishes go to the store
+        drainQueue(self);
+    }
+    if ((self->client != NULL) && self->reconnectPending && !BEFORE(self->millis(), self->reconnectAt))
+    {
+        // The CONNACK is picked up by the next calls
+        return startConnect(self, self->connectId, self->connectUser, self->connectPass,
+                            self->willTopic, self->willQos, self->willRetain, self->willMessage);
+    }
+    return false;
+}
+
+unsigned long PubSub_nextDeadline(PubSubClient_t* self)
+{
+    unsigned long t = self->millis();
+    unsigned long deadline = t + MQTT_KEEPALIVE*1000UL;
+
+    if ((self->client == NULL) || ((self->state != MQTT_CONNECTING) && !PubSub_connected(self)))
+    {
+        if ((self->queue != NULL) && (self->store != NULL) && (PubSubQueue_peek(self->queue) != NULL))
+        {
+            return t;
+        }
+        if (self->reconnectPending && BEFORE(self->reconnectAt, deadline))
+        {
+            return BEFORE(self->reconnectAt, t) ? t : self->reconnectAt;
+        }
+        return deadline;
+    }
+    // Input held back may already sit in the receive ring
+    boolean held = PubSub_inputHeld(self);
+    if (!held && (self->client->available(self->client) > 0))
+    {
+        return t;
+    }
+    if (self->state == MQTT_CONNECTING)
+    {
+        return connectDeadline(self);
+    }
+    deadline = keepaliveDeadline(self);
+    if (held && BEFORE(t + 1, deadline))
+    {
+        // See whether the dispatcher has made room
+        deadline = t + 1;
+    }
+    if ((self->batchLength > 0) && BEFORE(self->batchSince + self->coalesceDelay, deadline))
+    {
+        deadline = self->batchSince + self->coalesceDelay;
+    }
+    if ((self->queue != NULL) && (PubSubQueue_peek(self->queue) != NULL))
+    {
+        return t;
+    }
+    if ((self->ackLength > 0) || __atomic_load_n(&self->ackWaiting, __ATOMIC_ACQUIRE))
+    {
+        return t;
+    }
+    if ((self->store != NULL) && !self->storeBlocked)
+    {
+        // Stored frames left after the last drain budget
+        const uint8_t* data;
+        size_t size = self->store->peek(self->store, &data);
+        if (size > 0)
+        {
+            if (self->shaper == NULL)
+            {
+                return t;
+            }
+            if (!PubSubShaper_waiting(self->shaper, PUBSUB_CLASS_REALTIME))
+            {
+                // The chunk drainStore() offers next
+                size_t chunk = (size > self->storeSent) ? size - self->storeSent : 0;
+                if (chunk > MQTT_STORE_DRAIN_SIZE)
+                {
+                    chunk = MQTT_STORE_DRAIN_SIZE;
+                }
+                unsigned long wait = PubSubShaper_wait(self->shaper, chunk, t);
+                if (wait == 0)
+                {
+                    return t;
+                }
+                if (BEFORE(t + wait, deadline))
+                {
+                    deadline = t + wait;
+                }
+            }
+        }
+    }
+    if ((self->shaper != NULL) && (self->shapedSent == 0))
+    {
+        // Shaped frames become due as tokens come in
+        int cls = PubSubShaper_next(self->shaper);
+        if (cls == PUBSUB_CLASS_CONTROL)
+        {
+            return t;
+        }
+        if (cls > 0)
+        {
+            unsigned long wait = PubSubShaper_wait(self->shaper, PubSubShaper_frame(self->shaper, cls), t);
+            if (wait == 0)
+            {
+                return t;
+            }
+            if (BEFORE(t + wait, deadline))
+            {
+                deadline = t + wait;
+            }
+        }
+    }
+    return retryDeadline(self, deadline);
+}
+
+boolean PubSub_publish(PubSubClient_t* self, const char* topic, const uint8_t* payload, unsigned int plength, boolean addAddress)
+{
+    return PubSub_publishRetained(self, topic, payload, plength, false, addAddress);
+}
+
+boolean PubSub_publishRetained(PubSubClient_t* self, const char* topic, const uint8_t* payload, unsigned int plength, boolean retained, boolean addAddress)
+{
+    return PubSub_publishClass(self, topic, payload, plength, retained, addAddress, MQTT_SHAPER_DEFAULT_CLASS);
+}
+
+boolean PubSub_publishClass(PubSubClient_t* self, const char* topic, const uint8_t* payload, unsigned int plength, boolean retained, boolean addAddress, uint8_t cls)
+{
+    ENABLE_DEBUG=1;
+    boolean connected = PubSub_connected(self);
+    uint8_t header = MQTTPUBLISH;
+    if (retained) {
+        header |= 1;
+    }
+    if (storing(self, connected)) {
+        publishParts_t parts;
+        plainParts(self, topic, addAddress, &parts);
+        boolean rc = storePublish(self, header, &parts, topic, payload, plength);
+        if (connected) {
+            drainStore(self);
+        }
+        return rc;
+    }
+    if (connected) {
+        if (self->shaper != NULL) {
+            return shapePublish(self, header, topic, payload, plength, addAddress, cls, self->coalesceBytes);
+        }
+        return sendPublish(self, header, topic, payload, plength, addAddress, 0, self->coalesceBytes);
+    }
+    return false;
+}
+
+boolean PubSub_preparePublish(PubSubClient_t* self, PubSubPrepared_t* handle, const char* topic, uint8_t qos, boolean retained, boolean addAddress)
+{
+    size_t alen = addAddress ? strlen(self->myAddress.address) : 0;
+    size_t tlen = strlen(topic);
+    if ((qos > 2) || (alen + tlen >= MQTT_PREPARED_TOPIC_LENGTH)) {
+        return false;
+    }
+    handle->header = MQTTPUBLISH | (qos << 1);
+    if (retained) {
+        handle->header |= 1;
+    }
+    handle->length = alen + tlen;
+    handle->encoded[0] = (handle->length >> 8);
+    handle->encoded[1] = (handle->length & 0xFF);
+    memcpy(&handle->encoded[2], self->myAddress.address, alen);
+    memcpy(&handle->encoded[2 + alen], topic, tlen + 1);
+    return true;
+}
+
+boolean PubSub_publishPrepared(PubSubClient_t* self, const PubSubPrepared_t* handle, const uint8_t* payload, unsigned int plength)
+{
+    uint8_t qos = (handle->header >> 1) & 0x03;
+    const char* topic = (const char*)&handle->encoded[2];
+    publishParts_t parts;
+    parts.alen = 0;
+    parts.tlen = handle->length;
+    parts.encoded = handle->encoded;
+    parts.plen = 0;
+    parts.assign = -1;
+#if MQTT_VERSION == MQTT_VERSION_5
+    parts.props[parts.plen++] = 0;
+#endif
+    if (qos > 0) {
+        // Into the window like PubSub_publishQOS(), but sent from the
+        // prepared topic; only a retry looks the topic up again
+        PubSubInflight_t* slot = claimInflight(self, 2 + handle->length + 2 + plength);
+        if (slot == NULL) {
+            return false;
+        }
+        slot->topic = topic;
+        slot->payload = payload;
+        slot->plength = plength;
+        slot->msgId = self->nextMsgId;
+        slot->qos = qos;
+        slot->retained = (handle->header & 1);
+        slot->addAddress = false;
+        slot->callback = NULL;
+        slot->state = (qos == 1) ? PUBSUB_INFLIGHT_PUBACK : PUBSUB_INFLIGHT_PUBREC;
+        slot->sentAt = self->millis();
+        self->inflightCount++;
+#if MQTT_VERSION == MQTT_VERSION_5
+        publishParts(self, topic, false, &parts);
+#endif
+        sendParts(self, handle->header, &parts, topic, payload, plength, slot->msgId, self->coalesceBytes);
+        return true;
+    }
+    boolean connected = PubSub_connected(self);
+    if (storing(self, connected)) {
+        boolean rc = storePublish(self, handle->header, &parts, topic, payload, plength);
+        if (connected) {
+            drainStore(self);
+        }
+        return rc;
+    }
+    if (!connected) {
+        return false;
+    }
+    if (self->shaper != NULL) {
+        return shapeParts(self, handle->header, &parts, topic, payload, plength, false, MQTT_SHAPER_DEFAULT_CLASS, self->coalesceBytes);
+    }
+#if MQTT_VERSION == MQTT_VERSION_5
+    // The topic alias lookup takes the place of the prepared topic
+    publishParts(self, topic, false, &parts);
+#endif
+    return sendParts(self, handle->header, &parts, topic, payload, plength, 0, self->coalesceBytes);
+}
+
+uint16_t PubSub_publishQOS(PubSubClient_t* self, const char* topic, const uint8_t* payload, unsigned int plength, uint8_t qos, boolean retained, boolean addAddress, fpPublishCallback_t callback)
+{
+    if ((qos < 1) || (qos > 2)) {
+        return 0;
+    }
+    PubSubInflight_t* slot = claimInflight(self, 2 + (addAddress ? self->myAddress.length : 0) + strlen(topic) + 2 + plength);
+    if (slot == NULL) {
+        return 0;
+    }
+    slot->topic = topic;
+    slot->payload = payload;
+    slot->plength = plength;
+    slot->msgId = self->nextMsgId;
+    slot->qos = qos;
+    slot->retained = retained;
+    slot->addAddress = addAddress;
+    slot->callback = callback;
+    slot->state = (qos == 1) ? PUBSUB_INFLIGHT_PUBACK : PUBSUB_INFLIGHT_PUBREC;
+    self->inflightCount++;
+
+    sendInflight(self, slot, false);
+    return slot->msgId;
+}
+
+boolean PubSub_setInflightWindow(PubSubClient_t* self, PubSubInflight_t* slots, uint16_t count, unsigned long retryMillis)
+{
+    if (self->inflightCount > 0) {
+        // Their slots and callbacks would be lost
+        return false;
+    }
+    memset(slots, 0, count * sizeof(PubSubInflight_t));
+    self->inflight = slots;
+    self->inflightSize = count;
+    self->inflightCount = 0;
+    self->retryMillis = retryMillis;
+    return true;
+}
+
+uint16_t PubSub_inflight(PubSubClient_t* self)
+{
+    return self->inflightCount;
+}
+
+boolean PubSub_beginPublish(PubSubClient_t* self, const char* topic, unsigned int plength, boolean retained, boolean addAddress)
+{
+    if (PubSub_connected(self)) {
+        publishParts_t parts;
+        publishParts(self, topic, addAddress, &parts);
+        size_t head = 2 + parts.alen + parts.tlen + parts.plen;
+        if ((self->bufferSize < 5 + head) || !fitsBroker(self, head + plength)) {
+            // Too long
+            return false;
+        }
+        uint16_t length = 5;
+        length += putTopic(self, &self->buffer[length], &parts, topic);
+        memcpy(&self->buffer[length], parts.props, parts.plen);
+        length += parts.plen;
+        uint8_t header = MQTTPUBLISH;
+        if (retained) {
+            header |= 1;
+        }
+        uint8_t llen = buildHeader(header, self->buffer, (length-5) + plength);
+        size_t size = 1 + llen + (length-5);
+        if (transmit(self, self->buffer+(4-llen), size) != size) {
+            return false;
+        }
+        self->publishRemaining = plength;
+        STAT_ADD(packetsOut[MQTTPUBLISH >> 4], 1);
+        charge(self, size + plength, 1);
+        commitPublish(self, &parts, topic);
+        return true;
+    }
+    return false;
+}
+
+size_t PubSub_writePayload(PubSubClient_t* self, const uint8_t* buf, size_t size)
+{
+    if (size > self->publishRemaining) {
+        size = self->publishRemaining;
+    }
+    if (size == 0) {
+        return 0;
+    }
+    size_t rc = writeOut(self, buf, size);
+    self->publishRemaining -= rc;
+    return rc;
+}
+
+boolean PubSub_endPublish(PubSubClient_t* self)
+{
+    boolean complete = (self->publishRemaining == 0);
+    if (!complete) {
+        // The rest of the payload can never follow
+        self->publishRemaining = 0;
+        setState(self, MQTT_CONNECTION_LOST);
+        self->client->stop(self->client);
+    }
+    return complete;
+}
+
+void PubSub_setBatchBuffer(PubSubClient_t* self, uint8_t* buf, size_t size)
+{
+    flushBatch(self);
+    self->batch = buf;
+    self->batchSize = (buf != NULL) ? size : 0;
+}
+
+void PubSub_setCoalescing(PubSubClient_t* self, size_t maxBytes, unsigned long maxDelay)
+{
+    self->coalesceBytes = maxBytes;
+    self->coalesceDelay = maxDelay;
+    if (maxBytes == 0) {
+        flushBatch(self);
+    }
+}
+
+size_t PubSub_publishBatch(PubSubClient_t* self, const PubSubMessage_t* messages, size_t count)
+{
+    size_t sent = 0;
+    size_t i;
+    boolean connected = PubSub_connected(self);
+    if (storing(self, connected)) {
+        for (i = 0; i < count; i++) {
+            const PubSubMessage_t* m = &messages[i];
+            publishParts_t parts;
+            plainParts(self, m->topic, m->addAddress, &parts);
+            if (!storePublish(self, MQTTPUBLISH | (m->retained ? 1 : 0), &parts, m->topic, m->payload, m->plength)) {
+                break;
+            }
+            sent++;
+        }
+        if (connected) {
+            drainStore(self);
+        }
+        return sent;
+    }
+    if (!connected) {
+        return 0;
+    }
+    for (i = 0; i < count; i++) {
+        const PubSubMessage_t* m = &messages[i];
+        uint8_t header = MQTTPUBLISH | (m->retained ? 1 : 0);
+        boolean rc = (self->shaper != NULL)
+            ? shapePublish(self, header, m->topic, m->payload, m->plength, m->addAddress, MQTT_SHAPER_DEFAULT_CLASS, self->batchSize)
+            : sendPublish(self, header, m->topic, m->payload, m->plength, m->addAddress, 0, self->batchSize);
+        if (!rc) {
+            break;
+        }
+        sent++;
+    }
+    // Unless coalescing keeps them for later, the frames go out now
+    if ((self->coalesceBytes == 0) && !flushBatch(self)) {
+        return 0;
+    }
+    return sent;
+}
+
+boolean PubSub_flush(PubSubClient_t* self)
+{
+    if ((self->store != NULL) && PubSub_connected(self)) {
+        drainStore(self);
+    }
+    if ((self->shaper != NULL) && PubSub_connected(self)) {
+        drainShaper(self);
+    }
+    return flushBatch(self);
+}
+
+void PubSub_setStore(PubSubClient_t* self, PubSubStore_t* store)
+{
+    self->store = store;
+    self->storeBlocked = false;
+}
+
+void PubSub_setQueue(PubSubClient_t* self, PubSubQueue_t* queue)
+{
+    self->queue = queue;
+}
+
+void PubSub_setShaper(PubSubClient_t* self, PubSubShaper_t* shaper)
+{
+    self->shaper = shaper;
+    self->shapedSent = 0;
+}
+
+void PubSub_setDispatcher(PubSubClient_t* self, PubSubDispatcher_t* dispatcher)
+{
+    self->dispatcher = dispatcher;
+}
+
+boolean PubSub_inputHeld(PubSubClient_t* self)
+{
+    return (self->dispatcher != NULL) && !self->dispatcher->ready(self->dispatcher);
+}
+
+void PubSub_setCache(PubSubClient_t* self, PubSubCache_t* cache)
+{
+    self->cache = cache;
+}
+
+boolean PubSub_getLatest(PubSubClient_t* self, const char* topic, PubSubCacheValue_t* value)
+{
+    return (self->cache != NULL) && PubSubCache_get(self->cache, topic, value);
+}
+
+void PubSub_setDeferredAck(PubSubClient_t* self, boolean deferred)
+{
+    self->deferAck = deferred;
+}
+
+boolean PubSub_ack(PubSubClient_t* self, uint16_t msgId)
+{
+    uint32_t* slot = findInbound(self, msgId);
+    if (slot == NULL)
+    {
+        return false;
+    }
+    uint32_t entry = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+    uint32_t expected = INBOUND_ENTRY(msgId, INBOUND_QOS(entry), PUBSUB_INBOUND_DELIVERED);
+    if (!__atomic_compare_exchange_n(slot, &expected, INBOUND_ENTRY(msgId, INBOUND_QOS(entry), PUBSUB_INBOUND_ACKED),
+                                     false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+    {
+        return false;
+    }
+    __atomic_store_n(&self->ackWaiting, true, __ATOMIC_RELEASE);
+    if ((self->queue != NULL) && (self->queue->notify != NULL))
+    {
+        self->queue->notify(self->queue->notifyContext);
+    }
+    return true;
+}
+
+boolean PubSub_subscribe(PubSubClient_t* self, const char* topic)
+{
+    return PubSub_subscribeQOS(self, topic, 0, 1);
+}
+
+boolean PubSub_subscribeQOS(PubSubClient_t* self, const char* topic, uint8_t qos, uint8_t sendAddress)
+{
+    if (!canSubscribe(self, topic, qos, sendAddress))
+    {
+        return false;
+    }
+
+    recordFilter(self, topic, qos, sendAddress, true);
+
+    if (PubSub_connected(self))
+    {
+        // Leave room in the buffer for header and variable length field
+        uint16_t length = 5;
+        self->nextMsgId++;
+        if (self->nextMsgId == 0)
+        {
+            self->nextMsgId = 1;
+        }
+
+        self->buffer[length++] = (self->nextMsgId >> 8);
+        self->buffer[length++] = (self->nextMsgId & 0xFF);
+#if MQTT_VERSION == MQTT_VERSION_5
+        self->buffer[length++] = 0;
+#endif
+        if(sendAddress == 0)
+        {
+            length = writeString((char*)topic, self->buffer,length);
+        }
+        else
+        {
+            length = writeStringAddAddress(self, (char*)topic, (char*)self->buffer,length);
+        }
+
+        self->buffer[length++] = qos;
+        return write(self, MQTTSUBSCRIBE|MQTTQOS1,self->buffer,length-5);
+    }
+    return false;
+}
+
+boolean PubSub_subscribeHandler(PubSubClient_t* self, const char* topic, uint8_t qos, uint8_t sendAddress, fpTopicHandler_t handler)
+{
+    char* filter;
+
+    if (!canSubscribe(self, topic, qos, sendAddress))
+    {
+        // Refused, so not kept for the replay either
+        return false;
+    }
+    filter = buildFilter(self, topic, sendAddress);
+    if ((filter == NULL) || !TopicTrie_insert(&self->handlers, filter, handler, qos))
+    {
+        return false;
+    }
+    return PubSub_subscribeQOS(self, topic, qos, sendAddress);
+}
+
+boolean PubSub_unsubscribe(PubSubClient_t* self, const char* topic, uint8_t sendAddress)
+{
+    // As SUBSCRIBE, without the options byte
+    if (self->bufferSize < 9 + MQTT_NO_PROPERTIES + strlen(topic)) {
+        // Too long
+        return false;
+    }
+    if ((sendAddress != 0) &&
+        (self->bufferSize < 9 + MQTT_NO_PROPERTIES + strlen(topic) + self->myAddress.length)) {
+        // Too long
+        return false;
+    }
+    recordFilter(self, topic, 0, sendAddress, false);
+    if (PubSub_connected(self)) {
+        uint16_t length = 5;
+        self->nextMsgId++;
+        if (self->nextMsgId == 0) {
+            self->nextMsgId = 1;
+        }
+        self->buffer[length++] = (self->nextMsgId >> 8);
+        self->buffer[length++] = (self->nextMsgId & 0xFF);
+#if MQTT_VERSION == MQTT_VERSION_5
+        self->buffer[length++] = 0;
+#endif
+        if (sendAddress == 0) {
+            length = writeString(topic, self->buffer,length);
+        } else {
+            length = writeStringAddAddress(self, topic, (char*)self->buffer,length);
+        }
+        return write(self, MQTTUNSUBSCRIBE|MQTTQOS1,self->buffer,length-5);
+    }
+    return false;
+}
+
+size_t PubSub_subscribeMany(PubSubClient_t* self, PubSubFilter_t* filters, size_t count, uint8_t sendAddress, fpSubscribeCallback_t callback)
+{
+    return sendFilters(self, MQTTSUBSCRIBE|MQTTQOS1, filters, count, sendAddress, callback);
+}
+
+size_t PubSub_unsubscribeMany(PubSubClient_t* self, PubSubFilter_t* filters, size_t count, uint8_t sendAddress, fpSubscribeCallback_t callback)
+{
+    return sendFilters(self, MQTTUNSUBSCRIBE|MQTTQOS1, filters, count, sendAddress, callback);
+}
+
+void PubSub_disconnect(PubSubClient_t* self)
+{
+    self->buffer[0] = MQTTDISCONNECT;
+    self->buffer[1] = 0;
+    if (transmit(self, self->buffer, 2) == 2) {
+        STAT_ADD(packetsOut[MQTTDISCONNECT >> 4], 1);
+        charge(self, 2, 1);
+    }
+    setState(self, MQTT_DISCONNECTED);
+    self->client->stop(self->client);
+    self->lastInActivity = self->lastOutActivity = self->millis();
+}
+
+boolean PubSub_connected(PubSubClient_t* self)
+{
+    boolean rc;
+    if (self->client == NULL ) {
+        rc = false;
+    } else {
+        rc = (int)self->client->connected(self->client);
+        if (!rc) {
+            if (self->state == MQTT_CONNECTED) {
+                setState(self, MQTT_CONNECTION_LOST);
+                self->client->flush(self->client);
+                self->client->stop(self->client);
+            }
+        } else if (self->state == MQTT_CONNECTING) {
+            // Handshake still waiting for CONNACK
+            rc = false;
+        }
+    }
+    return rc;
+}
+
+void PubSub_deinit(PubSubClient_t* self)
+{
+    TopicTrie_free(&self->handlers);
+    releaseBuffers(self);
+}
+
+boolean PubSub_configure(PubSubClient_t* self, const PubSubConfig_t* config)
+{
+    if ((self->client != NULL) && (PubSub_connected(self) || (self->state == MQTT_CONNECTING)))
+    {
+        return false;
+    }
+    if ((config->packetSize > 65535) ||
+        ((self->handlers.root != NULL) && (config->registryAllocator != self->handlers.allocator)))
+    {
+        return false;
+    }
+    releaseBuffers(self);
+    self->allocator = config->allocator;
+    self->handlers.allocator = config->registryAllocator;
+    self->bufferSize = config->packetSize;
+    self->rxSize = config->rxSize;
+    self->filterSize = config->filterSize;
+    self->myAddress.size = config->addressSize;
+    memset(&self->reader, 0, sizeof(self->reader));
+    return allocateBuffers(self);
+}
+
+void PubSub_setAsyncConnect(PubSubClient_t* self, boolean async)
+{
+    self->asyncConnect = async;
+}
+
+void PubSub_setChunkCallback(PubSubClient_t* self, fpChunkCallback_t callback)
+{
+    self->chunkCallback = callback;
+}
+
+void PubSub_setMessageCallback(PubSubClient_t* self, fpMessageCallback_t callback)
+{
+    self->messageCallback = callback;
+}
 
-    if (isPublish) {
-        // Read in topic length to calculate bytes to skip over for Stream writing
-        if(!readBytePos(pubSubData.buffer, &len)) return 0;
-        if(!readBytePos(pubSubData.buffer, &len)) return 0;
-        skip = (pubSubData.buffer[*lengthLength+1]<<8)+pubSubData.buffer[*lengthLength+2];
-        start = 2;
-        if (pubSubData.buffer[0]&MQTTQOS1) {
-            // skip message id
-            skip += 2;
-        }
-    }
+void PubSub_setStateCallback(PubSubClient_t* self, fpStateCallback_t callback)
+{
+    self->stateCallback = callback;
+}
 
-    uint16_t i;
-    for (i = start;i<length;i++)
+void PubSub_setReconnect(PubSubClient_t* self, unsigned long minDelay, unsigned long maxDelay)
+{
+    self->reconnectMin = (minDelay > 0) ? minDelay : 1;
+    self->reconnectMax = ((maxDelay > 0) && (maxDelay < self->reconnectMin)) ? self->reconnectMin : maxDelay;
+    self->reconnectAttempts = 0;
+    if (self->reconnectMax == 0)
     {
-        if(!readByte(&digit))
-        {
-            return 0;
-        }
-        if (len < MQTT_MAX_PACKET_SIZE)
-        {
-            pubSubData.buffer[len] = digit;
-        }
-        len++;
+        self->reconnectPending = false;
     }
+}
 
-    if (len > MQTT_MAX_PACKET_SIZE)
-    {
-        len = 0; // This will cause the packet to be ignored.
-    }
+void PubSub_setCleanSession(PubSubClient_t* self, boolean clean)
+{
+    self->keepSession = !clean;
+}
 
-    return len;
+boolean PubSub_sessionPresent(PubSubClient_t* self)
+{
+    return self->sessionPresent;
 }
 
-static boolean write(uint8_t header, uint8_t* buf, uint16_t length)
+// encodes the MQTT remaining length into buf, returns the number of bytes used
+uint8_t PubSub_encodeLength(uint8_t* buf, uint32_t length)
 {
-    uint8_t lenBuf[4];
     uint8_t llen = 0;
     uint8_t digit;
-    uint8_t pos = 0;
-    uint16_t rc;
-    uint16_t len = length;
     do {
-        digit = len % 128;
-        len = len / 128;
-        if (len > 0) {
+        digit = length % 128;
+        length = length / 128;
+        if (length > 0) {
             digit |= 0x80;
         }
-        lenBuf[pos++] = digit;
-        llen++;
-    } while(len>0);
+        buf[llen++] = digit;
+    } while(length>0);
+    return llen;
+}
 
-    buf[4-llen] = header;
-    int i;
-    for (i=0;i<llen;i++) {
-        buf[5-llen+i] = lenBuf[i];
+// decodes a remaining length from the start of buf, returns the number of
+// bytes it took, 0 when buf ends before it does or -1 when it is malformed
+int PubSub_decodeLength(const uint8_t* buf, size_t size, uint32_t* length)
+{
+    uint32_t value = 0;
+    uint32_t multiplier = 1;
+    size_t i;
+    for (i = 0; i < size; i++) {
+        value += (buf[i] & 127) * multiplier;
+        if ((buf[i] & 128) == 0) {
+            *length = value;
+            return (int)(i + 1);
+        }
+        if (i == 3) {
+            return -1;
+        }
+        multiplier *= 128;
     }
-
-#ifdef MQTT_MAX_TRANSFER_SIZE
-    uint8_t* writeBuf = buf+(4-llen);
-    uint16_t bytesRemaining = length+1+llen;  //Match the length type
-    uint8_t bytesToWrite;
-    boolean result = true;
-    while((bytesRemaining > 0) && result) {
-        bytesToWrite = (bytesRemaining > MQTT_MAX_TRANSFER_SIZE)?MQTT_MAX_TRANSFER_SIZE:bytesRemaining;
-        rc = pubSubData.client->writeMulti(writeBuf,bytesToWrite);
-        result = (rc == bytesToWrite);
-        bytesRemaining -= rc;
-        writeBuf += rc;
-    }
-    return result;
-#else
-    rc = pubSubData.client->writeMulti(buf+(4-llen),length+1+llen);
-    pubSubData.lastOutActivity = pMillis();
-    return (rc == 1+llen+length);
-#endif
+    return 0;
 }
 
-static uint16_t copyString(const char* string, char* buf, uint16_t max)
+int PubSub_state(PubSubClient_t* self)
 {
-    const char* p = string;
-    uint16_t pos = 0;
-    while( (*p) && (pos<max))
-    {
-        buf[pos++] = *p++;
-    }
-    return pos;
+    return self->state;
 }
 
-static uint16_t writeStringAddAddress(const char* string, char* buf, uint16_t pos)
+const PubSubStats_t* PubSub_getStats(PubSubClient_t* self)
 {
-    uint16_t start = pos;
-    pos += 2;
-    pos += copyString ((char*)myAddress.address,  &buf[pos], strlen(myAddress.address));
-    pos += copyString ((char*)string,             &buf[pos], strlen(string));
+#if MQTT_STATS
+    return &self->stats;
+#else
+    return NULL;
+#endif
+}
 
-    buf[start]   = ((pos-start-2) >> 8);
-    buf[start+1] = ((pos-start-2) & 0xFF);
-    return pos;
+void PubSub_resetStats(PubSubClient_t* self)
+{
+#if MQTT_STATS
+    memset(&self->stats, 0, sizeof(self->stats));
+#endif
 }
 
-static uint16_t writeString(const char* string, uint8_t* buf, uint16_t pos)
+void PubSub_setStatsClock(PubSubClient_t* self, fpMillis_t micros)
 {
-    const char* idp = string;
-    uint16_t i = 0;
-    pos += 2;
-    while (*idp)
-    {
-        buf[pos++] = *idp++;
-        i++;
-    }
-    buf[pos-i-2] = (i >> 8);
-    buf[pos-i-1] = (i & 0xFF);
-    return pos;
+#if MQTT_STATS
+    self->statsClock = micros;
+#endif
 }
+
 /******************************************************************************
- * Function implementation
+ * Default instance
  *****************************************************************************/
-
-void PubSubClient_setMyAddress( const char* globalLocation,
-                                const char* localLocation,
-                                const char* deviceName)
+PubSubClient_t* PubSubClient_getDefault(void)
 {
-    char *p = myAddress.address;
-
-    p += copyString(globalLocation, p, strlen(globalLocation));
-    *(p++) = '/';
-    *(p) = 0x0;
-
-    p += copyString(localLocation,  p, strlen(localLocation));
-    *(p++) = '/';
-    *(p) = 0x0;
-
-    p += copyString(deviceName,     p, strlen(deviceName));
-    *(p++) = '/';
-    *(p) = 0x0;
+    return &pubSubData;
+}
 
-    myAddress.length =  p - myAddress.address;
+boolean PubSubClient_setMyAddress( const char* globalLocation,
+                                   const char* localLocation,
+                                   const char* deviceName)
+{
+    return PubSub_setMyAddress(&pubSubData, globalLocation, localLocation, deviceName);
 }
 
 void PubSubClient_init(Client_t* client, fpMillis_t fpMillis)
 {
-    pubSubData.state = MQTT_DISCONNECTED;
-    setClient(client);
-    pMillis = fpMillis;
+    PubSub_init(&pubSubData, client, fpMillis);
 }
 
 void PubSubClient_initIP(Client_t* client, fpMillis_t fpMillis, uint8_t *ip, uint16_t port)
 {
-    PubSubClient_initIPCallback(client, fpMillis, ip, port, NULL);
+    PubSub_initIP(&pubSubData, client, fpMillis, ip, port);
 }
 
 void PubSubClient_initIPCallback(Client_t* client, fpMillis_t fpMillis, uint8_t *ip, uint16_t port, MQTT_CALLBACK_SIGNATURE)
 {
-    pubSubData.state = MQTT_DISCONNECTED;
-    setServerIP(ip, port);
-    setCallback(callback);
-    setClient(client);
-    pMillis = fpMillis;
+    PubSub_initIPCallback(&pubSubData, client, fpMillis, ip, port, callback);
 }
 
 void PubSubClient_initHost(Client_t* client, fpMillis_t fpMillis, const char* domain, uint16_t port)
 {
-    PubSubClient_initHostCallback(client, fpMillis, domain, port, NULL);
+    PubSub_initHost(&pubSubData, client, fpMillis, domain, port);
 }
 
 void PubSubClient_initHostCallback(Client_t* client, fpMillis_t fpMillis, const char* domain, uint16_t port, MQTT_CALLBACK_SIGNATURE)
 {
-    pubSubData.state = MQTT_DISCONNECTED;
-    setServerHost(domain,port);
-    setCallback(callback);
-    setClient(client);
-    pMillis = fpMillis;
+    PubSub_initHostCallback(&pubSubData, client, fpMillis, domain, port, callback);
 }
 
 boolean PubSubClient_connectId(const char *id)
 {
-    return PubSubClient_connect(id,NULL,NULL,0,0,0,0);
+    return PubSub_connectId(&pubSubData, id);
 }
 
 boolean PubSubClient_connectIdUserPass(const char *id, const char *user, const char *pass)
 {
-    return PubSubClient_connect(id,user,pass,0,0,0,0);
+    return PubSub_connectIdUserPass(&pubSubData, id, user, pass);
 }
 
-/*boolean PubSubClient::connect(const char *id, const char* willTopic, uint8_t willQos, boolean willRetain, const char* willMessage) {
-    return connect(id,NULL,NULL,willTopic,willQos,willRetain,willMessage);
-}*/
-
-boolean PubSubClient_connect(const char *id, const char *user, const char *pass, const char* willTopic, uint8_t willQos, boolean willRetain, const char* willMessage) {
-    if (!PubSubClient_connected())
-    {
-        int result = 0;
-
-        if (pubSubData.domain != NULL) {
-            result = pubSubData.client->connectHost(pubSubData.domain, pubSubData.port);
-        } else {
-            result = pubSubData.client->connectIP(pubSubData.ip, pubSubData.port);
-        }
-        if (result == 1) {
-            pubSubData.nextMsgId = 1;
-            // Leave room in the buffer for header and variable length field
-            uint16_t length = 5;
-            unsigned int j;
+boolean PubSubClient_connect(const char *id, const char *user, const char *pass, const char* willTopic, uint8_t willQos, boolean willRetain, const char* willMessage)
+{
+    return PubSub_connect(&pubSubData, id, user, pass, willTopic, willQos, willRetain, willMessage);
+}
 
-#if MQTT_VERSION == MQTT_VERSION_3_1
-            uint8_t d[9] = {0x00,0x06,'M','Q','I','s','d','p', MQTT_VERSION};
-#define MQTT_HEADER_VERSION_LENGTH 9
-#elif MQTT_VERSION == MQTT_VERSION_3_1_1
-            uint8_t d[7] = {0x00,0x04,'M','Q','T','T',MQTT_VERSION};
-#define MQTT_HEADER_VERSION_LENGTH 7
-#endif
-            for (j = 0;j<MQTT_HEADER_VERSION_LENGTH;j++) {
-                pubSubData.buffer[length++] = d[j];
-            }
+void PubSubClient_disconnect()
+{
+    PubSub_disconnect(&pubSubData);
+}
 
-            uint8_t v;
-            if (willTopic) {
-                v = 0x06|(willQos<<3)|(willRetain<<5);
-            } else {
-                v = 0x02;
-            }
+void PubSubClient_setReconnect(unsigned long minDelay, unsigned long maxDelay)
+{
+    PubSub_setReconnect(&pubSubData, minDelay, maxDelay);
+}
 
-            if(user != NULL) {
-                v = v|0x80;
+void PubSubClient_setCleanSession(boolean clean)
+{
+    PubSub_setCleanSession(&pubSubData, clean);
+}
 
-                if(pass != NULL) {
-                    v = v|(0x80>>1);
-                }
-            }
+boolean PubSubClient_sessionPresent()
+{
+    return PubSub_sessionPresent(&pubSubData);
+}
 
-            pubSubData.buffer[length++] = v;
+boolean PubSubClient_publish(const char* topic, const uint8_t* payload, unsigned int plength, boolean addAddress)
+{
+    return PubSub_publish(&pubSubData, topic, payload, plength, addAddress);
+}
 
-            pubSubData.buffer[length++] = ((MQTT_KEEPALIVE) >> 8);
-            pubSubData.buffer[length++] = ((MQTT_KEEPALIVE) & 0xFF);
-            length = writeString(id,pubSubData.buffer,length);
-            if (willTopic) {
-                length = writeString(willTopic,pubSubData.buffer,length);
-                length = writeString(willMessage,pubSubData.buffer,length);
-            }
+boolean PubSubClient_publishRetained(const char* topic, const uint8_t* payload, unsigned int plength, boolean retained, boolean addAddress)
+{
+    return PubSub_publishRetained(&pubSubData, topic, payload, plength, retained, addAddress);
+}
 
-            if(user != NULL) {
-                length = writeString(user,pubSubData.buffer,length);
-                if(pass != NULL) {
-                    length = writeString(pass,pubSubData.buffer,length);
-                }
-            }
+boolean PubSubClient_publishClass(const char* topic, const uint8_t* payload, unsigned int plength, boolean retained, boolean addAddress, uint8_t cls)
+{
+    return PubSub_publishClass(&pubSubData, topic, payload, plength, retained, addAddress, cls);
+}
 
-            write(MQTTCONNECT,pubSubData.buffer,length-5);
+size_t PubSubClient_publishBatch(const PubSubMessage_t* messages, size_t count)
+{
+    return PubSub_publishBatch(&pubSubData, messages, count);
+}
 
-            pubSubData.lastInActivity = pubSubData.lastOutActivity = pMillis();
+boolean PubSubClient_preparePublish(PubSubPrepared_t* handle, const char* topic, uint8_t qos, boolean retained, boolean addAddress)
+{
+    return PubSub_preparePublish(&pubSubData, handle, topic, qos, retained, addAddress);
+}
 
-            while (!pubSubData.client->available()) {
-                unsigned long t = pMillis();
-                if (t-pubSubData.lastInActivity >= ((int32_t) MQTT_SOCKET_TIMEOUT*1000UL)) {
-                    pubSubData.state = MQTT_CONNECTION_TIMEOUT;
-                    pubSubData.client->stop();
-                    return false;
-                }
-            }
-            uint8_t llen;
-            uint16_t len = readPacket(&llen);
+boolean PubSubClient_publishPrepared(const PubSubPrepared_t* handle, const uint8_t* payload, unsigned int plength)
+{
+    return PubSub_publishPrepared(&pubSubData, handle, payload, plength);
+}
 
-            if (len == 4)
-            {
-                if (pubSubData.buffer[3] == 0)
-                {
-                    pubSubData.lastInActivity = pMillis();
-                    pubSubData.pingOutstanding = false;
-                    pubSubData.state = MQTT_CONNECTED;
-                    return true;
-                } else {
-                    pubSubData.state = pubSubData.buffer[3];
-                }
-            }
-            pubSubData.client->stop();
-        } else {
-            pubSubData.state = MQTT_CONNECT_FAILED;
-        }
-        return false;
-    }
-    return true;
+boolean PubSubClient_subscribe(const char* topic)
+{
+    return PubSub_subscribe(&pubSubData, topic);
 }
 
+boolean PubSubClient_subscribeQOS(const char* topic, uint8_t qos, uint8_t sendAddress)
+{
+    return PubSub_subscribeQOS(&pubSubData, topic, qos, sendAddress);
+}
 
-boolean PubSubClient_loop()
+boolean PubSubClient_unsubscribe(const char* topic)
 {
-    if (PubSubClient_connected())
-    {
-        unsigned long t = pMillis();
-        
-        if( (t - pubSubData.lastInActivity > MQTT_KEEPALIVE*1000UL) ||       //TKE CHANGE 500 BACK TO 1000!
-            (t - pubSubData.lastOutActivity > MQTT_KEEPALIVE*1000UL))        //TKE CHANGE 500 BACK TO 1000!
-        {
-            if (pubSubData.pingOutstanding) {
-                pubSubData.state = MQTT_CONNECTION_TIMEOUT;
-                pubSubData.client->stop();
-                return false;
-            } else {
-                pubSubData.buffer[0] = MQTTPINGREQ;
-                pubSubData.buffer[1] = 0;
-                pubSubData.client->writeMulti(pubSubData.buffer,2);
-                pubSubData.lastOutActivity = t;
-                pubSubData.lastInActivity = t;
-                pubSubData.pingOutstanding = true;
-            }
-        }
-        if (pubSubData.client->available())
-        {
-            uint8_t llen;
-            uint16_t len = readPacket(&llen);
-            uint16_t msgId = 0;
-            uint8_t *payload;
-            if (len > 0) {
-                pubSubData.lastInActivity = t;
-                uint8_t type = pubSubData.buffer[0]&0xF0;
-                if (type == MQTTPUBLISH)
-                {
-                    uint16_t tl = (pubSubData.buffer[llen+1]<<8)+pubSubData.buffer[llen+2];
-                    uint16_t i;
-                    char topic[tl+1];
-                    for (i=0;i<tl;i++)
-                    {
-                        topic[i] = pubSubData.buffer[llen+3+i];
-                    }
-                    topic[tl] = 0;
-                    // msgId only present for QOS>0
-                    if ((pubSubData.buffer[0]&0x06) == MQTTQOS1)
-                    {
-                        msgId = (pubSubData.buffer[llen+3+tl]<<8)+pubSubData.buffer[llen+3+tl+1];
-                        payload = pubSubData.buffer+llen+3+tl+2;
-                        pubSubData.callback(topic,payload,len-llen-3-tl-2);
-
-                        pubSubData.buffer[0] = MQTTPUBACK;
-                        pubSubData.buffer[1] = 2;
-                        pubSubData.buffer[2] = (msgId >> 8);
-                        pubSubData.buffer[3] = (msgId & 0xFF);
-                        pubSubData.client->writeMulti(pubSubData.buffer,4);
-                        pubSubData.lastOutActivity = t;
-                    }
-                    else
-                    {
-                        payload = pubSubData.buffer+llen+3+tl;
-                        //TKE: remove myAddress!!!
-                        pubSubData.callback(&topic[myAddress.length],payload,len-llen-3-tl);
-                    }
-                }
-                else if (type == MQTTPINGREQ)
-                {
-                    pubSubData.buffer[0] = MQTTPINGRESP;
-                    pubSubData.buffer[1] = 0;
-                    pubSubData.client->writeMulti(pubSubData.buffer,2);
-                }
-                else if (type == MQTTPINGRESP)
-                {
-                    pubSubData.pingOutstanding = false;
-                }
-                else if (type == MQTTSUBACK)
-                {
-                    //Ignore
-                }
-                else
-                {
-                    //TKE ERROR!!!
-                    pubSubData.pingOutstanding = false;
-                }
-            }
-        }
-        return true;
-    }
-    return false;
+    return PubSub_unsubscribe(&pubSubData, topic, 1);
 }
 
-boolean PubSubClient_publish(const char* topic, const uint8_t* payload, unsigned int plength, boolean addAddress)
+size_t PubSubClient_subscribeMany(PubSubFilter_t* filters, size_t count, uint8_t sendAddress, fpSubscribeCallback_t callback)
 {
-    return PubSubClient_publishRetained(topic, payload, plength, false, addAddress);
+    return PubSub_subscribeMany(&pubSubData, filters, count, sendAddress, callback);
 }
 
-boolean PubSubClient_publishRetained(const char* topic, const uint8_t* payload, unsigned int plength, boolean retained, boolean addAddress)
+size_t PubSubClient_unsubscribeMany(PubSubFilter_t* filters, size_t count, uint8_t sendAddress, fpSubscribeCallback_t callback)
 {
-    ENABLE_DEBUG=1;
-    if (PubSubClient_connected()) {
-        if (MQTT_MAX_PACKET_SIZE < 5 + 2+strlen(topic) + plength) {
-            // Too long
-            return false;
-        }
-        // Leave room in the buffer for header and variable length field
-        uint16_t length = 5;
-        if(addAddress == false)
-        {
-            length = writeString(topic,pubSubData.buffer,length);
-        }
-        else
-        {
-            length = writeStringAddAddress(topic,(char*)pubSubData.buffer,length);
-        }
+    return PubSub_unsubscribeMany(&pubSubData, filters, count, sendAddress, callback);
+}
 
-        //TKE: Add Address!!!
+void PubSubClient_setDeferredAck(boolean deferred)
+{
+    PubSub_setDeferredAck(&pubSubData, deferred);
+}
 
-        uint16_t i;
-        for (i=0;i<plength;i++) {
-            pubSubData.buffer[length++] = payload[i];
-        }
-        uint8_t header = MQTTPUBLISH;
-        if (retained) {
-            header |= 1;
-        }
-        return write(header,pubSubData.buffer,length-5);
-    }
-    return false;
+boolean PubSubClient_ack(uint16_t msgId)
+{
+    return PubSub_ack(&pubSubData, msgId);
 }
 
+boolean PubSubClient_loop()
+{
+    return PubSub_loop(&pubSubData);
+}
 
-boolean PubSubClient_subscribe(const char* topic)
+unsigned long PubSubClient_nextDeadline()
 {
-    return PubSubClient_subscribeQOS(topic, 0, 1);
+    return PubSub_nextDeadline(&pubSubData);
 }
 
-boolean PubSubClient_subscribeQOS(const char* topic, uint8_t qos, uint8_t sendAddress)
+void PubSubClient_setStore(PubSubStore_t* store)
 {
-    if (qos < 0 || qos > 1)
-    {
-        return false;
-    }
-    if (MQTT_MAX_PACKET_SIZE < 9 + strlen(topic))
-    {
-        // Too long
-        return false;
-    }
-    if( (sendAddress != 0) &&
-        (MQTT_MAX_PACKET_SIZE < ( 9 + strlen(topic) + myAddress.length)) )
-    {
-        // Too long
-        return false;
-    }
+    PubSub_setStore(&pubSubData, store);
+}
 
-    if (PubSubClient_connected())
-    {
-        // Leave room in the buffer for header and variable length field
-        uint16_t length = 5;
-        pubSubData.nextMsgId++;
-        if (pubSubData.nextMsgId == 0)
-        {
-            pubSubData.nextMsgId = 1;
-        }
+void PubSubClient_setQueue(PubSubQueue_t* queue)
+{
+    PubSub_setQueue(&pubSubData, queue);
+}
 
-        pubSubData.buffer[length++] = (pubSubData.nextMsgId >> 8);
-        pubSubData.buffer[length++] = (pubSubData.nextMsgId & 0xFF);
-        if(sendAddress == 0)
-        {
-            length = writeString((char*)topic, pubSubData.buffer,length);
-        }
-        else
-        {
-            length = writeStringAddAddress((char*)topic, (char*)pubSubData.buffer,length);
-        }
+void PubSubClient_setShaper(PubSubShaper_t* shaper)
+{
+    PubSub_setShaper(&pubSubData, shaper);
+}
 
-        pubSubData.buffer[length++] = qos;
-        return write(MQTTSUBSCRIBE|MQTTQOS1,pubSubData.buffer,length-5);
-    }
-    return false;
+void PubSubClient_setDispatcher(PubSubDispatcher_t* dispatcher)
+{
+    PubSub_setDispatcher(&pubSubData, dispatcher);
 }
 
-boolean PubSubClient_unsubscribe(const char* topic)
+void PubSubClient_setCache(PubSubCache_t* cache)
 {
-    if (MQTT_MAX_PACKET_SIZE < 9 + strlen(topic)) {
-        // Too long
-        return false;
-    }
-    if (PubSubClient_connected()) {
-        uint16_t length = 5;
-        pubSubData.nextMsgId++;
-        if (pubSubData.nextMsgId == 0) {
-            pubSubData.nextMsgId = 1;
-        }
-        pubSubData.buffer[length++] = (pubSubData.nextMsgId >> 8);
-        pubSubData.buffer[length++] = (pubSubData.nextMsgId & 0xFF);
-        length = writeString(topic, pubSubData.buffer,length);
-        return write(MQTTUNSUBSCRIBE|MQTTQOS1,pubSubData.buffer,length-5);
-    }
-    return false;
+    PubSub_setCache(&pubSubData, cache);
 }
 
-void PubSubClient_disconnect()
+boolean PubSubClient_getLatest(const char* topic, PubSubCacheValue_t* value)
 {
-    pubSubData.buffer[0] = MQTTDISCONNECT;
-    pubSubData.buffer[1] = 0;
-    pubSubData.client->writeMulti(pubSubData.buffer,2);
-    pubSubData.state = MQTT_DISCONNECTED;
-    pubSubData.client->stop();
-    pubSubData.lastInActivity = pubSubData.lastOutActivity = pMillis();
+    return PubSub_getLatest(&pubSubData, topic, value);
 }
 
 boolean PubSubClient_connected()
 {
-    boolean rc;
-    if (pubSubData.client == NULL ) {
-        rc = false;
-    } else {
-        rc = (int)pubSubData.client->connected();
-        if (!rc) {
-            if (pubSubData.state == MQTT_CONNECTED) {
-                pubSubData.state = MQTT_CONNECTION_LOST;
-                pubSubData.client->flush();
-                pubSubData.client->stop();
-            }
-        }
-    }
-    return rc;
+    return PubSub_connected(&pubSubData);
+}
+
+const PubSubStats_t* PubSubClient_getStats()
+{
+    return PubSub_getStats(&pubSubData);
 }
 
+int PubSubClient_state()
+{
+    return PubSub_state(&pubSubData);
+}
@@ -0,0 +1,262 @@
+/*
+ PubSubEpoll.c - epoll driver for many PubSubClient_t sessions on
+  SocketClient_t transports.
+*/
+
+#include "PubSubEpoll.h"
+#include <errno.h>
+#include <limits.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+#define PUBSUBEPOLL_EVENTS  64
+
+// wrap-safe "a is before b" on millis values
+#define BEFORE(a, b)        ((long)((a) - (b)) < 0)
+
+/******************************************************************************
+ * Private Function Prototypes
+ *****************************************************************************/
+static void swap     (PubSubEpoll_t* self, size_t a, size_t b);
+static void siftUp   (PubSubEpoll_t* self, size_t i);
+static void siftDown (PubSubEpoll_t* self, size_t i);
+static void reschedule(PubSubEpoll_t* self, PubSubEpollEntry_t* entry);
+static void service  (PubSubEpoll_t* self, PubSubEpollEntry_t* entry);
+
+/******************************************************************************
+ * Private Function Implementation
+ *****************************************************************************/
+static void swap(PubSubEpoll_t* self, size_t a, size_t b)
+{
+    PubSubEpollEntry_t* tmp = self->heap[a];
+    self->heap[a] = self->heap[b];
+    self->heap[b] = tmp;
+    self->heap[a]->heapIndex = a;
+    self->heap[b]->heapIndex = b;
+}
+
+static void siftUp(PubSubEpoll_t* self, size_t i)
+{
+    while (i > 0)
+    {
+        size_t parent = (i - 1) / 2;
+        if (!BEFORE(self->heap[i]->deadline, self->heap[parent]->deadline))
+        {
+            break;
+        }
+        swap(self, i, parent);
+        i = parent;
+    }
+}
+
+static void siftDown(PubSubEpoll_t* self, size_t i)
+{
+    while (1)
+    {
+        size_t first = i;
+        size_t left = 2 * i + 1;
+        size_t right = left + 1;
+        if ((left < self->count) && BEFORE(self->heap[left]->deadline, self->heap[first]->deadline))
+        {
+            first = left;
+        }
+        if ((right < self->count) && BEFORE(self->heap[right]->deadline, self->heap[first]->deadline))
+        {
+            first = right;
+        }
+        if (first == i)
+        {
+            break;
+        }
+        swap(self, i, first);
+        i = first;
+    }
+}
+
+// refreshes the epoll registration and the deadline of one session
+static void reschedule(PubSubEpoll_t* self, PubSubEpollEntry_t* entry)
+{
+    int fd = SocketClient_fd(entry->socket);
+    // Not readable while the session holds input back: its deadline polls
+    uint32_t events = (PubSub_inputHeld(entry->session) ? 0 : EPOLLIN) |
+                      (SocketClient_pending(entry->socket) ? EPOLLOUT : 0);
+    struct epoll_event ev;
+
+    ev.events = events;
+    ev.data.ptr = entry;
+    if ((fd != entry->fd) || (entry->socket->generation != entry->generation))
+    {
+        if (entry->fd >= 0)
+        {
+            // Fails harmlessly when the old fd has already been closed
+            epoll_ctl(self->epfd, EPOLL_CTL_DEL, entry->fd, NULL);
+        }
+        entry->fd = -1;
+        if ((fd >= 0) && (epoll_ctl(self->epfd, EPOLL_CTL_ADD, fd, &ev) == 0))
+        {
+            entry->fd = fd;
+            entry->generation = entry->socket->generation;
+            entry->events = events;
+        }
+    }
+    else if ((fd >= 0) && (events != entry->events))
+    {
+        if (epoll_ctl(self->epfd, EPOLL_CTL_MOD, fd, &ev) == 0)
+        {
+            entry->events = events;
+        }
+    }
+
+    unsigned long now = entry->session->millis();
+    unsigned long deadline = PubSub_nextDeadline(entry->session);
+    if (!BEFORE(now, deadline))
+    {
+        // Already due: try again shortly rather than spinning
+        deadline = now + 1;
+    }
+    entry->deadline = deadline;
+    siftUp(self, entry->heapIndex);
+    siftDown(self, entry->heapIndex);
+}
+
+static void service(PubSubEpoll_t* self, PubSubEpollEntry_t* entry)
+{
+    PubSub_loop(entry->session);
+    entry->socket->base.flush(&entry->socket->base);
+    reschedule(self, entry);
+}
+
+/******************************************************************************
+ * Function implementation
+ *****************************************************************************/
+bool PubSubEpoll_init(PubSubEpoll_t* self, PubSubEpollEntry_t** heap, size_t capacity)
+{
+    self->epfd = epoll_create1(EPOLL_CLOEXEC);
+    self->heap = heap;
+    self->capacity = capacity;
+    self->count = 0;
+    return (self->epfd >= 0);
+}
+
+void PubSubEpoll_close(PubSubEpoll_t* self)
+{
+    if (self->epfd >= 0)
+    {
+        close(self->epfd);
+    }
+    self->epfd = -1;
+    self->count = 0;
+}
+
+bool PubSubEpoll_add(PubSubEpoll_t* self, PubSubEpollEntry_t* entry, PubSubClient_t* session, SocketClient_t* socket)
+{
+    if (self->count >= self->capacity)
+    {
+        return false;
+    }
+    entry->session = session;
+    entry->socket = socket;
+    // One session waiting on its socket would hold up all the others
+    SocketClient_setWriteTimeout(socket, 0);
+    entry->fd = -1;
+    entry->generation = 0;
+    entry->events = 0;
+    entry->heapIndex = self->count;
+    self->heap[self->count++] = entry;
+    reschedule(self, entry);
+    return true;
+}
+
+void PubSubEpoll_remove(PubSubEpoll_t* self, PubSubEpollEntry_t* entry)
+{
+    size_t i = entry->heapIndex;
+    if ((i >= self->count) || (self->heap[i] != entry))
+    {
+        return;
+    }
+    if (entry->fd >= 0)
+    {
+        epoll_ctl(self->epfd, EPOLL_CTL_DEL, entry->fd, NULL);
+        entry->fd = -1;
+    }
+    self->count--;
+    if (i != self->count)
+    {
+        swap(self, i, self->count);
+        siftUp(self, i);
+        siftDown(self, i);
+    }
+}
+
+bool PubSubEpoll_watch(PubSubEpoll_t* self, PubSubEpollEntry_t* entry)
+{
+    reschedule(self, entry);
+    return (entry->fd >= 0);
+}
+
+int PubSubEpoll_run(PubSubEpoll_t* self, int timeoutMs)
+{
+    struct epoll_event events[PUBSUBEPOLL_EVENTS];
+    int serviced = 0;
+    int wait = timeoutMs;
+    int n;
+    int i;
+
+    if (self->count > 0)
+    {
+        PubSubEpollEntry_t* first = self->heap[0];
+        long due = (long)(first->deadline - first->session->millis());
+        if (due < 0)
+        {
+            due = 0;
+        }
+        if (due > INT_MAX)
+        {
+            due = INT_MAX;
+        }
+        if ((wait < 0) || (due < wait))
+        {
+            wait = (int)due;
+        }
+    }
+
+    n = epoll_wait(self->epfd, events, PUBSUBEPOLL_EVENTS, wait);
+    if (n < 0)
+    {
+        return (errno == EINTR) ? 0 : -1;
+    }
+
+    for (i = 0; i < n; i++)
+    {
+        PubSubEpollEntry_t* entry = (PubSubEpollEntry_t*)events[i].data.ptr;
+        bool drained = false;
+        if (events[i].events & EPOLLOUT)
+        {
+            entry->socket->base.flush(&entry->socket->base);
+            // Room again for output the session held back, such as stored frames
+            drained = !SocketClient_pending(entry->socket);
+        }
+        if (drained || (events[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)))
+        {
+            service(self, entry);
+            serviced++;
+        }
+        else
+        {
+            reschedule(self, entry);
+        }
+    }
+
+    // Sessions with an expired keepalive, CONNACK or retry deadline
+    while (self->count > 0)
+    {
+        PubSubEpollEntry_t* first = self->heap[0];
+        if (BEFORE(first->session->millis(), first->deadline))
+        {
+            break;
+        }
+        service(self, first);
+        serviced++;
+    }
+    return serviced;
+}
@@ -0,0 +1,378 @@
+/*
+ PubSubFileStore.c - Offline publish store in a memory-mapped file (POSIX).
+*/
+
+#include "PubSubFileStore.h"
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define STORE_MAGIC     0x4D515346UL    // "MQSF"
+#define STORE(c)        ((PubSubFileStore_t*)(c))
+
+// Start of the file. head and tail share one 64 bit word so that every
+// change of the stored range is a single store, whenever the process stops.
+typedef struct
+{
+    uint32_t magic;
+    uint32_t capacity;
+    uint64_t position;      // head << 32 | tail
+} storeHeader_t;
+
+#define HEADER(s)       ((storeHeader_t*)(s)->map)
+#define DATA(s)         ((s)->map + sizeof(storeHeader_t))
+
+/******************************************************************************
+ * Private Function Prototypes
+ *****************************************************************************/
+static size_t  headOf      (PubSubFileStore_t* self);
+static size_t  tailOf      (PubSubFileStore_t* self);
+static void    setPosition (PubSubFileStore_t* self, size_t head, size_t tail);
+static size_t  frameSize   (const uint8_t* buf, size_t size);
+static bool    scan        (PubSubFileStore_t* self);
+static bool    mapFile     (PubSubFileStore_t* self, size_t capacity);
+static void    unmapFile   (PubSubFileStore_t* self);
+static bool    resize      (PubSubFileStore_t* self, size_t capacity);
+static bool    room        (PubSubFileStore_t* self, size_t size, size_t* at);
+
+static bool    storeAppend (PubSubStore_t* c, const struct iovec* frame, int count, size_t keep);
+static size_t  storePeek   (PubSubStore_t* c, const uint8_t** data);
+static void    storeConsume(PubSubStore_t* c, size_t size);
+
+/******************************************************************************
+ * Private Function Implementation
+ *****************************************************************************/
+static size_t headOf(PubSubFileStore_t* self)
+{
+    return (size_t)(HEADER(self)->position >> 32);
+}
+
+static size_t tailOf(PubSubFileStore_t* self)
+{
+    return (size_t)(HEADER(self)->position & 0xFFFFFFFFUL);
+}
+
+static void setPosition(PubSubFileStore_t* self, size_t head, size_t tail)
+{
+    HEADER(self)->position = ((uint64_t)head << 32) | tail;
+}
+
+// size of the PUBLISH frame at buf, 0 when there is none that fits size
+static size_t frameSize(const uint8_t* buf, size_t size)
+{
+    uint32_t length;
+    int used;
+
+    if ((size < 2) || ((buf[0] & 0xF0) != MQTTPUBLISH))
+    {
+        return 0;
+    }
+    used = PubSub_decodeLength(&buf[1], size - 1, &length);
+    if ((used <= 0) || (1 + used + length > size))
+    {
+        return 0;
+    }
+    return 1 + used + length;
+}
+
+// Checks the frames from head on and finds the end of the older ones when
+// the ring has wrapped: the end of the segment or a 0 byte, which no frame
+// starts with
+static bool scan(PubSubFileStore_t* self)
+{
+    size_t head = headOf(self);
+    size_t tail = tailOf(self);
+    size_t pos = head;
+    size_t stop = (tail < head) ? self->capacity : tail;
+
+    if ((head > self->capacity) || (tail > self->capacity))
+    {
+        return false;
+    }
+    while ((pos < stop) && ((tail >= head) || (DATA(self)[pos] != 0)))
+    {
+        size_t size = frameSize(&DATA(self)[pos], stop - pos);
+        if (size == 0)
+        {
+            return false;
+        }
+        pos += size;
+    }
+    self->end = pos;
+    if (tail < head)
+    {
+        if (pos == head)
+        {
+            // Stopped right after the last older frame was sent
+            setPosition(self, 0, tail);
+        }
+        for (pos = 0; pos < tail; pos += frameSize(&DATA(self)[pos], tail - pos))
+        {
+            if (frameSize(&DATA(self)[pos], tail - pos) == 0)
+            {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+static bool mapFile(PubSubFileStore_t* self, size_t capacity)
+{
+    void* map = mmap(NULL, sizeof(storeHeader_t) + capacity, PROT_READ | PROT_WRITE, MAP_SHARED, self->fd, 0);
+    if (map == MAP_FAILED)
+    {
+        return false;
+    }
+    self->map = map;
+    self->capacity = capacity;
+    return true;
+}
+
+static void unmapFile(PubSubFileStore_t* self)
+{
+    if (self->map != NULL)
+    {
+        munmap(self->map, sizeof(storeHeader_t) + self->capacity);
+    }
+    self->map = NULL;
+}
+
+// Moves the stored frames into a segment of the new capacity, dropping the
+// oldest when they do not all fit
+static bool resize(PubSubFileStore_t* self, size_t capacity)
+{
+    size_t head = headOf(self);
+    size_t tail = tailOf(self);
+    uint8_t* saved = malloc(PubSubFileStore_length(self) + 1);
+    size_t copied = 0;
+    size_t skip = 0;
+
+    if (saved == NULL)
+    {
+        return false;
+    }
+    if (tail < head)
+    {
+        memcpy(saved, &DATA(self)[head], self->end - head);
+        copied = self->end - head;
+        head = 0;
+    }
+    memcpy(&saved[copied], &DATA(self)[head], tail - head);
+    copied += tail - head;
+    while (copied - skip > capacity)
+    {
+        skip += frameSize(&saved[skip], copied - skip);
+        self->dropped++;
+    }
+    unmapFile(self);
+    if ((ftruncate(self->fd, sizeof(storeHeader_t) + capacity) != 0) || !mapFile(self, capacity))
+    {
+        free(saved);
+        return false;
+    }
+    memcpy(DATA(self), &saved[skip], copied - skip);
+    HEADER(self)->capacity = capacity;
+    setPosition(self, 0, copied - skip);
+    self->end = copied - skip;
+    free(saved);
+    return true;
+}
+
+// Finds a contiguous place for size bytes, false when there is none
+static bool room(PubSubFileStore_t* self, size_t size, size_t* at)
+{
+    size_t head = headOf(self);
+    size_t tail = tailOf(self);
+
+    if (tail < head)
+    {
+        *at = tail;
+        return (tail + size < head);
+    }
+    if (tail + size <= self->capacity)
+    {
+        *at = tail;
+        return true;
+    }
+    // Wrap to the front, leaving a gap between tail and head
+    *at = 0;
+    return (size < head);
+}
+
+static bool storeAppend(PubSubStore_t* c, const struct iovec* frame, int count, size_t keep)
+{
+    PubSubFileStore_t* self = STORE(c);
+    size_t size = 0;
+    size_t at;
+    int i;
+
+    for (i = 0; i < count; i++)
+    {
+        size += frame[i].iov_len;
+    }
+    if (size > self->capacity)
+    {
+        self->dropped++;
+        return false;
+    }
+    while (!room(self, size, &at))
+    {
+        const uint8_t* data;
+        size_t oldest = 0;
+        if (self->policy == PUBSUB_STORE_DROP_OLDEST)
+        {
+            size_t peeked = storePeek(c, &data);
+            oldest = frameSize(data, peeked);
+        }
+        // The first frame is not dropped while it is partly sent
+        if ((oldest == 0) || (keep > 0))
+        {
+            self->dropped++;
+            return false;
+        }
+        storeConsume(c, oldest);
+        self->dropped++;
+    }
+
+    size_t tail = tailOf(self);
+    uint8_t* out = &DATA(self)[at];
+    for (i = 0; i < count; i++)
+    {
+        memcpy(out, frame[i].iov_base, frame[i].iov_len);
+        out += frame[i].iov_len;
+    }
+    if ((at == 0) && (tail > 0))
+    {
+        // Wrapped: mark where the older frames stop
+        if (tail < self->capacity)
+        {
+            DATA(self)[tail] = 0;
+        }
+        self->end = tail;
+    }
+    setPosition(self, headOf(self), at + size);
+    return true;
+}
+
+// The older frames first when the ring has wrapped
+static size_t storePeek(PubSubStore_t* c, const uint8_t** data)
+{
+    PubSubFileStore_t* self = STORE(c);
+    size_t head = headOf(self);
+    size_t tail = tailOf(self);
+
+    *data = &DATA(self)[head];
+    return (tail < head) ? (self->end - head) : (tail - head);
+}
+
+static void storeConsume(PubSubStore_t* c, size_t size)
+{
+    PubSubFileStore_t* self = STORE(c);
+    size_t head = headOf(self) + size;
+    size_t tail = tailOf(self);
+
+    if (tail < headOf(self))
+    {
+        if (head >= self->end)
+        {
+            // The older frames are gone, the ring is straight again
+            head = 0;
+            self->end = tail;
+        }
+    }
+    else if (head >= tail)
+    {
+        // Empty: start over at the front
+        head = tail = 0;
+        self->end = 0;
+    }
+    setPosition(self, head, tail);
+}
+
+/******************************************************************************
+ * Function implementation
+ *****************************************************************************/
+bool PubSubFileStore_open(PubSubFileStore_t* self, const char* path, size_t capacity, uint8_t policy)
+{
+    storeHeader_t header;
+    struct stat st;
+    bool kept;
+
+    self->base.append = storeAppend;
+    self->base.peek = storePeek;
+    self->base.consume = storeConsume;
+    self->fd = -1;
+    self->map = NULL;
+    self->capacity = 0;
+    self->end = 0;
+    self->policy = policy;
+    self->dropped = 0;
+    if ((capacity == 0) || (capacity > 0xFFFFFFFFUL))
+    {
+        return false;
+    }
+    self->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if ((self->fd < 0) || (fstat(self->fd, &st) != 0))
+    {
+        PubSubFileStore_close(self);
+        return false;
+    }
+
+    kept = ((size_t)st.st_size > sizeof(header)) &&
+           (pread(self->fd, &header, sizeof(header), 0) == sizeof(header)) &&
+           (header.magic == STORE_MAGIC) &&
+           ((size_t)st.st_size == sizeof(header) + header.capacity) &&
+           mapFile(self, header.capacity);
+    if (kept && !scan(self))
+    {
+        unmapFile(self);
+        kept = false;
+    }
+    if (kept && (header.capacity != capacity))
+    {
+        kept = resize(self, capacity);
+    }
+    if (!kept)
+    {
+        // New or unusable: start empty
+        unmapFile(self);
+        if ((ftruncate(self->fd, 0) != 0) ||
+            (ftruncate(self->fd, sizeof(header) + capacity) != 0) ||
+            !mapFile(self, capacity))
+        {
+            PubSubFileStore_close(self);
+            return false;
+        }
+        HEADER(self)->magic = STORE_MAGIC;
+        HEADER(self)->capacity = capacity;
+        setPosition(self, 0, 0);
+        self->end = 0;
+    }
+    return true;
+}
+
+void PubSubFileStore_close(PubSubFileStore_t* self)
+{
+    unmapFile(self);
+    if (self->fd >= 0)
+    {
+        close(self->fd);
+    }
+    self->fd = -1;
+}
+
+size_t PubSubFileStore_length(PubSubFileStore_t* self)
+{
+    size_t head = headOf(self);
+    size_t tail = tailOf(self);
+    return (tail < head) ? (self->end - head + tail) : (tail - head);
+}
+
+bool PubSubFileStore_sync(PubSubFileStore_t* self)
+{
+    return msync(self->map, sizeof(storeHeader_t) + self->capacity, MS_SYNC) == 0;
+}
@@ -0,0 +1,167 @@
+/*
+ PubSubQueue.c - Bounded lock-free multi-producer publish queue.
+
+ The slot for position p is slots[p & mask]. Its sequence is p while the
+ slot is free for position p, p + 1 once the message for p is ready, and
+ p + count again after the network thread took it out, which frees it for
+ the producer one lap later.
+*/
+
+#include "PubSubQueue.h"
+#include <string.h>
+
+/******************************************************************************
+ * Private Function Prototypes
+ *****************************************************************************/
+static PubSubQueueSlot_t* claim (PubSubQueue_t* self, size_t* position);
+static void               commit(PubSubQueue_t* self, PubSubQueueSlot_t* slot, size_t position);
+
+/******************************************************************************
+ * Private Function Implementation
+ *****************************************************************************/
+// Takes the slot at the enqueue position, NULL when the queue is full
+static PubSubQueueSlot_t* claim(PubSubQueue_t* self, size_t* position)
+{
+    size_t pos = __atomic_load_n(&self->enqueue, __ATOMIC_RELAXED);
+
+    while (1)
+    {
+        PubSubQueueSlot_t* slot = &self->slots[pos & self->mask];
+        size_t sequence = __atomic_load_n(&slot->sequence, __ATOMIC_ACQUIRE);
+        intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+
+        if (diff == 0)
+        {
+            if (__atomic_compare_exchange_n(&self->enqueue, &pos, pos + 1, true,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            {
+                *position = pos;
+                return slot;
+            }
+            // Another producer took it, pos now holds the new position
+        }
+        else if (diff < 0)
+        {
+            // Not yet taken out by the network thread: a lap behind
+            __atomic_fetch_add(&self->full, 1, __ATOMIC_RELAXED);
+            return NULL;
+        }
+        else
+        {
+            pos = __atomic_load_n(&self->enqueue, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+// Hands the filled slot to the network thread, waking it when the queue was
+// empty before
+static void commit(PubSubQueue_t* self, PubSubQueueSlot_t* slot, size_t position)
+{
+    __atomic_store_n(&slot->sequence, position + 1, __ATOMIC_SEQ_CST);
+    if ((self->notify != NULL) && (__atomic_load_n(&self->dequeue, __ATOMIC_SEQ_CST) == position))
+    {
+        self->notify(self->notifyContext);
+    }
+}
+
+/******************************************************************************
+ * Function implementation
+ *****************************************************************************/
+bool PubSubQueue_init(PubSubQueue_t* self, PubSubQueueSlot_t* slots, size_t count)
+{
+    size_t i;
+
+    if ((count < 2) || ((count & (count - 1)) != 0))
+    {
+        return false;
+    }
+    memset(self, 0, sizeof(*self));
+    self->slots = slots;
+    self->mask = count - 1;
+    for (i = 0; i < count; i++)
+    {
+        slots[i].sequence = i;
+    }
+    return true;
+}
+
+void PubSubQueue_setNotify(PubSubQueue_t* self, fpQueueNotify_t notify, void* context)
+{
+    self->notify = notify;
+    self->notifyContext = context;
+}
+
+bool PubSubQueue_publish(PubSubQueue_t* self, const char* topic, const uint8_t* payload, unsigned int plength, bool retained, bool addAddress)
+{
+    size_t tlen = strlen(topic);
+    size_t position;
+    PubSubQueueSlot_t* slot;
+
+    if (tlen + 1 + plength > MQTT_QUEUE_SLOT_SIZE)
+    {
+        return false;
+    }
+    slot = claim(self, &position);
+    if (slot == NULL)
+    {
+        return false;
+    }
+    memcpy(slot->data, topic, tlen + 1);
+    memcpy(&slot->data[tlen + 1], payload, plength);
+    slot->payload = (const uint8_t*)&slot->data[tlen + 1];
+    slot->plength = plength;
+    slot->release = NULL;
+    slot->retained = retained;
+    slot->addAddress = addAddress;
+    commit(self, slot, position);
+    return true;
+}
+
+bool PubSubQueue_publishOwned(PubSubQueue_t* self, const char* topic, const uint8_t* payload, unsigned int plength, bool retained, bool addAddress, fpQueueRelease_t release, void* context)
+{
+    size_t tlen = strlen(topic);
+    size_t position;
+    PubSubQueueSlot_t* slot;
+
+    if (tlen + 1 > MQTT_QUEUE_SLOT_SIZE)
+    {
+        return false;
+    }
+    slot = claim(self, &position);
+    if (slot == NULL)
+    {
+        return false;
+    }
+    memcpy(slot->data, topic, tlen + 1);
+    slot->payload = payload;
+    slot->plength = plength;
+    slot->release = release;
+    slot->context = context;
+    slot->retained = retained;
+    slot->addAddress = addAddress;
+    commit(self, slot, position);
+    return true;
+}
+
+const PubSubQueueSlot_t* PubSubQueue_peek(PubSubQueue_t* self)
+{
+    PubSubQueueSlot_t* slot = &self->slots[self->dequeue & self->mask];
+    if (__atomic_load_n(&slot->sequence, __ATOMIC_SEQ_CST) != self->dequeue + 1)
+    {
+        return NULL;
+    }
+    return slot;
+}
+
+void PubSubQueue_pop(PubSubQueue_t* self)
+{
+    PubSubQueueSlot_t* slot = &self->slots[self->dequeue & self->mask];
+    size_t position = self->dequeue;
+
+    if (slot->release != NULL)
+    {
+        slot->release(slot->context, slot->payload, slot->plength);
+    }
+    __atomic_store_n(&self->dequeue, position + 1, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&slot->sequence, position + self->mask + 1, __ATOMIC_RELEASE);
+}
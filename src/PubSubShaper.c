@@ -0,0 +1,285 @@
+/*
+ PubSubShaper.c - Outbound traffic shaping: priority classes and token
+  bucket rate limits.
+
+ Every queue is a ring of bytes holding each frame after a 4 byte length;
+ both may wrap around its end. Buckets count tokens in thousandths, so that
+ a rate of r per second adds r of them every millisecond.
+*/
+
+#include "PubSubShaper.h"
+#include <string.h>
+
+#define PREFIX          4
+// Refills are capped at an hour, far more than any burst takes
+#define MAX_ELAPSED     3600000UL
+
+/******************************************************************************
+ * Private Function Prototypes
+ *****************************************************************************/
+static void     ringWrite   (PubSubShaperQueue_t* q, size_t offset, const void* src, size_t size);
+static void     ringRead    (const PubSubShaperQueue_t* q, size_t offset, void* dst, size_t size);
+static void     refill      (PubSubBucket_t* bucket, unsigned long elapsed);
+static unsigned long shortfall(const PubSubBucket_t* bucket, size_t need);
+static void     setBucket   (PubSubBucket_t* bucket, uint32_t rate, uint32_t burst);
+
+/******************************************************************************
+ * Private Function Implementation
+ *****************************************************************************/
+// Copies size bytes to offset from the head, wrapping at the end of the ring
+static void ringWrite(PubSubShaperQueue_t* q, size_t offset, const void* src, size_t size)
+{
+    size_t pos = (q->head + offset) % q->size;
+    size_t first = q->size - pos;
+
+    if (first > size)
+    {
+        first = size;
+    }
+    memcpy(&q->data[pos], src, first);
+    memcpy(q->data, (const uint8_t*)src + first, size - first);
+}
+
+static void ringRead(const PubSubShaperQueue_t* q, size_t offset, void* dst, size_t size)
+{
+    size_t pos = (q->head + offset) % q->size;
+    size_t first = q->size - pos;
+
+    if (first > size)
+    {
+        first = size;
+    }
+    memcpy(dst, &q->data[pos], first);
+    memcpy((uint8_t*)dst + first, q->data, size - first);
+}
+
+static void refill(PubSubBucket_t* bucket, unsigned long elapsed)
+{
+    int64_t cap = (int64_t)bucket->burst * 1000;
+
+    if (bucket->rate == 0)
+    {
+        return;
+    }
+    if (elapsed > MAX_ELAPSED)
+    {
+        elapsed = MAX_ELAPSED;
+    }
+    bucket->tokens += (int64_t)elapsed * bucket->rate;
+    if (bucket->tokens > cap)
+    {
+        bucket->tokens = cap;
+    }
+}
+
+// Millis until the bucket holds need tokens, or a full burst when need is
+// larger
+static unsigned long shortfall(const PubSubBucket_t* bucket, size_t need)
+{
+    int64_t missing;
+
+    if (bucket->rate == 0)
+    {
+        return 0;
+    }
+    if (need > bucket->burst)
+    {
+        need = bucket->burst;
+    }
+    missing = (int64_t)need * 1000 - bucket->tokens;
+    if (missing <= 0)
+    {
+        return 0;
+    }
+    return (unsigned long)((missing + bucket->rate - 1) / bucket->rate);
+}
+
+static void setBucket(PubSubBucket_t* bucket, uint32_t rate, uint32_t burst)
+{
+    if (burst == 0)
+    {
+        burst = rate;
+    }
+    bucket->rate = rate;
+    bucket->burst = burst;
+    bucket->tokens = (int64_t)burst * 1000;
+}
+
+/******************************************************************************
+ * Function implementation
+ *****************************************************************************/
+void PubSubShaper_init(PubSubShaper_t* self)
+{
+    memset(self, 0, sizeof(*self));
+}
+
+bool PubSubShaper_setQueue(PubSubShaper_t* self, uint8_t cls, void* memory, size_t size)
+{
+    PubSubShaperQueue_t* q;
+
+    if ((cls >= PUBSUB_CLASSES) || (size <= PREFIX))
+    {
+        return false;
+    }
+    q = &self->queues[cls];
+    memset(q, 0, sizeof(*q));
+    q->data = (uint8_t*)memory;
+    q->size = size;
+    return true;
+}
+
+void PubSubShaper_setRate(PubSubShaper_t* self, uint32_t bytesPerSecond, uint32_t byteBurst, uint32_t messagesPerSecond, uint32_t messageBurst)
+{
+    setBucket(&self->bytes, bytesPerSecond, byteBurst);
+    setBucket(&self->messages, messagesPerSecond, messageBurst);
+}
+
+unsigned long PubSubShaper_wait(PubSubShaper_t* self, size_t size, unsigned long now)
+{
+    unsigned long bytes;
+    unsigned long messages;
+
+    if (!self->started)
+    {
+        self->started = true;
+        self->last = now;
+    }
+    refill(&self->bytes, now - self->last);
+    refill(&self->messages, now - self->last);
+    self->last = now;
+
+    bytes = shortfall(&self->bytes, size);
+    messages = shortfall(&self->messages, 1);
+    return (bytes > messages) ? bytes : messages;
+}
+
+bool PubSubShaper_admit(PubSubShaper_t* self, size_t size, unsigned long now)
+{
+    bool admitted = (PubSubShaper_wait(self, size, now) == 0);
+
+    if (!admitted && !self->throttling)
+    {
+        self->throttling = true;
+        self->throttledSince = now;
+    }
+    else if (admitted && self->throttling)
+    {
+        self->throttling = false;
+        self->throttled += now - self->throttledSince;
+    }
+    return admitted;
+}
+
+void PubSubShaper_charge(PubSubShaper_t* self, size_t bytes, size_t messages)
+{
+    if (self->bytes.rate != 0)
+    {
+        self->bytes.tokens -= (int64_t)bytes * 1000;
+    }
+    if (self->messages.rate != 0)
+    {
+        self->messages.tokens -= (int64_t)messages * 1000;
+    }
+}
+
+unsigned long PubSubShaper_throttled(const PubSubShaper_t* self, unsigned long now)
+{
+    return self->throttled + (self->throttling ? (now - self->throttledSince) : 0);
+}
+
+bool PubSubShaper_append(PubSubShaper_t* self, uint8_t cls, const struct iovec* iov, int count, size_t size)
+{
+    PubSubShaperQueue_t* q = &self->queues[cls];
+    size_t offset = q->length;
+    uint8_t prefix[PREFIX];
+    int i;
+
+    if ((size > 0xFFFFFFFFUL) || (q->size - q->length < PREFIX + size))
+    {
+        q->dropped++;
+        return false;
+    }
+    prefix[0] = (size >> 24) & 0xFF;
+    prefix[1] = (size >> 16) & 0xFF;
+    prefix[2] = (size >> 8) & 0xFF;
+    prefix[3] = size & 0xFF;
+    ringWrite(q, offset, prefix, PREFIX);
+    offset += PREFIX;
+    for (i = 0; i < count; i++)
+    {
+        ringWrite(q, offset, iov[i].iov_base, iov[i].iov_len);
+        offset += iov[i].iov_len;
+    }
+    q->length = offset;
+    q->frames++;
+    return true;
+}
+
+int PubSubShaper_next(const PubSubShaper_t* self)
+{
+    int cls;
+
+    for (cls = 0; cls < PUBSUB_CLASSES; cls++)
+    {
+        if (self->queues[cls].frames > 0)
+        {
+            return cls;
+        }
+    }
+    return -1;
+}
+
+bool PubSubShaper_waiting(const PubSubShaper_t* self, uint8_t cls)
+{
+    int next = PubSubShaper_next(self);
+    return (next >= 0) && (next <= cls);
+}
+
+size_t PubSubShaper_frame(const PubSubShaper_t* self, uint8_t cls)
+{
+    const PubSubShaperQueue_t* q = &self->queues[cls];
+    uint8_t prefix[PREFIX];
+
+    if (q->frames == 0)
+    {
+        return 0;
+    }
+    ringRead(q, 0, prefix, PREFIX);
+    return ((size_t)prefix[0] << 24) | ((size_t)prefix[1] << 16) | ((size_t)prefix[2] << 8) | prefix[3];
+}
+
+size_t PubSubShaper_peek(const PubSubShaper_t* self, uint8_t cls, size_t offset, const uint8_t** data)
+{
+    const PubSubShaperQueue_t* q = &self->queues[cls];
+    size_t size = PubSubShaper_frame(self, cls);
+    size_t pos;
+    size_t piece;
+
+    if (offset >= size)
+    {
+        return 0;
+    }
+    pos = (q->head + PREFIX + offset) % q->size;
+    piece = q->size - pos;
+    if (piece > size - offset)
+    {
+        piece = size - offset;
+    }
+    *data = &q->data[pos];
+    return piece;
+}
+
+void PubSubShaper_pop(PubSubShaper_t* self, uint8_t cls)
+{
+    PubSubShaperQueue_t* q = &self->queues[cls];
+    size_t size = PubSubShaper_frame(self, cls);
+
+    if (q->frames == 0)
+    {
+        return;
+    }
+    q->head = (q->head + PREFIX + size) % q->size;
+    q->length -= PREFIX + size;
+    q->frames--;
+    q->sent++;
+}
@@ -0,0 +1,180 @@
+/*
+ PubSubStats.c - Counters and latency histograms of a session, with text
+  and JSON output for monitoring.
+*/
+
+#include "PubSubStats.h"
+#include <limits.h>
+#include <stdarg.h>
+#include <stdio.h>
+
+// Output being formatted: length keeps counting past size
+typedef struct
+{
+    char* buf;
+    size_t size;
+    size_t length;
+} output_t;
+
+// Packet type names, by type
+static const char* const packetNames[16] =
+{
+    "reserved", "connect", "connack", "publish", "puback", "pubrec", "pubrel", "pubcomp",
+    "subscribe", "suback", "unsubscribe", "unsuback", "pingreq", "pingresp", "disconnect", "auth"
+};
+
+/******************************************************************************
+ * Private Function Prototypes
+ *****************************************************************************/
+static void     append      (output_t* out, const char* format, ...);
+static void     textCounter (output_t* out, const char* prefix, const char* name, unsigned long value);
+static void     textPackets (output_t* out, const char* prefix, const char* name, const unsigned long* packets);
+static void     textHistogram(output_t* out, const char* prefix, const char* name, const PubSubHistogram_t* histogram);
+static void     jsonPackets (output_t* out, const char* name, const unsigned long* packets);
+static void     jsonHistogram(output_t* out, const char* name, const PubSubHistogram_t* histogram);
+
+/******************************************************************************
+ * Private Function Implementation
+ *****************************************************************************/
+static void append(output_t* out, const char* format, ...)
+{
+    va_list args;
+    int rc;
+    size_t room = (out->length < out->size) ? out->size - out->length : 0;
+
+    va_start(args, format);
+    rc = vsnprintf((room > 0) ? &out->buf[out->length] : NULL, room, format, args);
+    va_end(args);
+    if (rc > 0)
+    {
+        out->length += rc;
+    }
+}
+
+static void textCounter(output_t* out, const char* prefix, const char* name, unsigned long value)
+{
+    append(out, "# TYPE %s_%s counter\n%s_%s %lu\n", prefix, name, prefix, name, value);
+}
+
+static void textPackets(output_t* out, const char* prefix, const char* name, const unsigned long* packets)
+{
+    uint8_t i;
+    append(out, "# TYPE %s_%s counter\n", prefix, name);
+    for (i = 1; i < 16; i++)
+    {
+        append(out, "%s_%s{type=\"%s\"} %lu\n", prefix, name, packetNames[i], PUBSUB_STAT_LOAD(packets[i]));
+    }
+}
+
+// Prometheus buckets are cumulative
+static void textHistogram(output_t* out, const char* prefix, const char* name, const PubSubHistogram_t* histogram)
+{
+    unsigned long total = 0;
+    uint8_t i;
+
+    append(out, "# TYPE %s_%s histogram\n", prefix, name);
+    for (i = 0; i < MQTT_STATS_BUCKETS - 1; i++)
+    {
+        total += PUBSUB_STAT_LOAD(histogram->buckets[i]);
+        append(out, "%s_%s_bucket{le=\"%lu\"} %lu\n", prefix, name, PubSubStats_bucketLimit(i), total);
+    }
+    total += PUBSUB_STAT_LOAD(histogram->buckets[i]);
+    append(out, "%s_%s_bucket{le=\"+Inf\"} %lu\n", prefix, name, total);
+    append(out, "%s_%s_sum %lu\n", prefix, name, PUBSUB_STAT_LOAD(histogram->sum));
+    append(out, "%s_%s_count %lu\n", prefix, name, PUBSUB_STAT_LOAD(histogram->count));
+    append(out, "# TYPE %s_%s_max gauge\n%s_%s_max %lu\n", prefix, name, prefix, name, PUBSUB_STAT_LOAD(histogram->max));
+}
+
+static void jsonPackets(output_t* out, const char* name, const unsigned long* packets)
+{
+    uint8_t i;
+    append(out, "\"%s\":{", name);
+    for (i = 1; i < 16; i++)
+    {
+        append(out, "%s\"%s\":%lu", (i > 1) ? "," : "", packetNames[i], PUBSUB_STAT_LOAD(packets[i]));
+    }
+    append(out, "}");
+}
+
+static void jsonHistogram(output_t* out, const char* name, const PubSubHistogram_t* histogram)
+{
+    uint8_t i;
+    append(out, "\"%s\":{\"count\":%lu,\"sum\":%lu,\"max\":%lu,\"buckets\":[", name,
+           PUBSUB_STAT_LOAD(histogram->count), PUBSUB_STAT_LOAD(histogram->sum), PUBSUB_STAT_LOAD(histogram->max));
+    for (i = 0; i < MQTT_STATS_BUCKETS; i++)
+    {
+        append(out, "%s%lu", (i > 0) ? "," : "", PUBSUB_STAT_LOAD(histogram->buckets[i]));
+    }
+    append(out, "]}");
+}
+
+/******************************************************************************
+ * Function implementation
+ *****************************************************************************/
+void PubSubStats_record(PubSubHistogram_t* histogram, unsigned long value)
+{
+    uint8_t bucket = 0;
+    unsigned long v;
+
+    for (v = value; (v > 0) && (bucket < MQTT_STATS_BUCKETS - 1); v >>= 1)
+    {
+        bucket++;
+    }
+    PUBSUB_STAT_ADD(histogram->buckets[bucket], 1);
+    PUBSUB_STAT_ADD(histogram->count, 1);
+    PUBSUB_STAT_ADD(histogram->sum, value);
+    if (value > histogram->max)
+    {
+        PUBSUB_STAT_SET(histogram->max, value);
+    }
+}
+
+unsigned long PubSubStats_bucketLimit(uint8_t i)
+{
+    if ((i >= MQTT_STATS_BUCKETS - 1) || (i >= sizeof(unsigned long) * CHAR_BIT))
+    {
+        return ULONG_MAX;
+    }
+    return (1UL << i) - 1;
+}
+
+size_t PubSubStats_formatText(const PubSubStats_t* stats, const char* prefix, char* buf, size_t size)
+{
+    output_t out = { buf, size, 0 };
+
+    if (size > 0)
+    {
+        buf[0] = 0;
+    }
+    textPackets(&out, prefix, "packets_in_total", stats->packetsIn);
+    textPackets(&out, prefix, "packets_out_total", stats->packetsOut);
+    textCounter(&out, prefix, "bytes_in_total", PUBSUB_STAT_LOAD(stats->bytesIn));
+    textCounter(&out, prefix, "bytes_out_total", PUBSUB_STAT_LOAD(stats->bytesOut));
+    textCounter(&out, prefix, "dropped_oversize_total", PUBSUB_STAT_LOAD(stats->droppedOversize));
+    textCounter(&out, prefix, "short_writes_total", PUBSUB_STAT_LOAD(stats->shortWrites));
+    textHistogram(&out, prefix, "ping_rtt_microseconds", &stats->pingRtt);
+    textHistogram(&out, prefix, "callback_microseconds", &stats->callbackTime);
+    return out.length;
+}
+
+size_t PubSubStats_formatJson(const PubSubStats_t* stats, char* buf, size_t size)
+{
+    output_t out = { buf, size, 0 };
+
+    if (size > 0)
+    {
+        buf[0] = 0;
+    }
+    append(&out, "{");
+    jsonPackets(&out, "packets_in", stats->packetsIn);
+    append(&out, ",");
+    jsonPackets(&out, "packets_out", stats->packetsOut);
+    append(&out, ",\"bytes_in\":%lu,\"bytes_out\":%lu,\"dropped_oversize\":%lu,\"short_writes\":%lu,",
+           PUBSUB_STAT_LOAD(stats->bytesIn), PUBSUB_STAT_LOAD(stats->bytesOut),
+           PUBSUB_STAT_LOAD(stats->droppedOversize), PUBSUB_STAT_LOAD(stats->shortWrites));
+    jsonHistogram(&out, "ping_rtt_us", &stats->pingRtt);
+    append(&out, ",");
+    jsonHistogram(&out, "callback_us", &stats->callbackTime);
+    append(&out, "}");
+    return out.length;
+}
@@ -0,0 +1,222 @@
+/*
+ PubSubWorkers.c - Pool of worker threads running the message callback
+  (POSIX threads).
+
+ Every worker has a ring of depth slots with one producer, the network
+ thread, filling the slot at tail and one consumer, the worker, handling the
+ one at head. Both do so outside the lock, which only guards count and the
+ wakeup of an idle worker. count is also read without the lock to see
+ whether the sessions may read on.
+*/
+
+#include "PubSubWorkers.h"
+#include <string.h>
+
+#define POOL(d)     ((PubSubWorkers_t*)(d))
+
+/******************************************************************************
+ * Private Function Prototypes
+ *****************************************************************************/
+static uint32_t hashTopic   (const char* topic, uint16_t length);
+static void*    run         (void* context);
+static bool     poolReady   (PubSubDispatcher_t* d);
+static void     poolDispatch(PubSubDispatcher_t* d, PubSubClient_t* client, const PubSubMessageView_t* message);
+
+/******************************************************************************
+ * Private Function Implementation
+ *****************************************************************************/
+// FNV-1a, picks the worker of a topic
+static uint32_t hashTopic(const char* topic, uint16_t length)
+{
+    uint32_t h = 2166136261UL;
+    uint16_t i;
+    for (i = 0; i < length; i++)
+    {
+        h ^= (uint8_t)topic[i];
+        h *= 16777619UL;
+    }
+    return h;
+}
+
+static void* run(void* context)
+{
+    PubSubWorker_t* worker = (PubSubWorker_t*)context;
+    PubSubWorkers_t* pool = worker->pool;
+
+    pthread_mutex_lock(&worker->lock);
+    while (1)
+    {
+        while ((worker->count == 0) && __atomic_load_n(&pool->running, __ATOMIC_ACQUIRE))
+        {
+            pthread_cond_wait(&worker->filled, &worker->lock);
+        }
+        if (worker->count == 0)
+        {
+            // Stopped and nothing left
+            break;
+        }
+        pthread_mutex_unlock(&worker->lock);
+
+        PubSubWorkerSlot_t* slot = &worker->slots[worker->head];
+        PubSubMessageView_t message;
+        message.topic = slot->data;
+        message.topicLength = slot->topicLength;
+        message.properties = (slot->propertiesLength > 0) ? (const uint8_t*)&slot->data[slot->topicLength + 1] : NULL;
+        message.propertiesLength = slot->propertiesLength;
+        message.payload = (const uint8_t*)&slot->data[slot->topicLength + 1 + slot->propertiesLength];
+        message.payloadLength = slot->payloadLength;
+        message.msgId = slot->msgId;
+        message.qos = slot->qos;
+        message.retain = slot->retain;
+        message.dup = slot->dup;
+        pool->callback(slot->client, &message);
+        worker->head = (worker->head + 1) % pool->depth;
+
+        pthread_mutex_lock(&worker->lock);
+        bool wasFull = (worker->count == pool->depth);
+        __atomic_store_n(&worker->count, worker->count - 1, __ATOMIC_RELEASE);
+        if (wasFull && (pool->notify != NULL))
+        {
+            pthread_mutex_unlock(&worker->lock);
+            pool->notify(pool->notifyContext);
+            pthread_mutex_lock(&worker->lock);
+        }
+    }
+    pthread_mutex_unlock(&worker->lock);
+    return NULL;
+}
+
+// Ready while every queue has a free slot: which one the next message needs
+// is not known before it is read
+static bool poolReady(PubSubDispatcher_t* d)
+{
+    PubSubWorkers_t* pool = POOL(d);
+    size_t i;
+
+    for (i = 0; i < pool->count; i++)
+    {
+        if (__atomic_load_n(&pool->workers[i].count, __ATOMIC_ACQUIRE) >= pool->depth)
+        {
+            if (!pool->held)
+            {
+                pool->held = true;
+                __atomic_fetch_add(&pool->stalls, 1, __ATOMIC_RELAXED);
+            }
+            return false;
+        }
+    }
+    pool->held = false;
+    return true;
+}
+
+static void poolDispatch(PubSubDispatcher_t* d, PubSubClient_t* client, const PubSubMessageView_t* message)
+{
+    PubSubWorkers_t* pool = POOL(d);
+    PubSubWorker_t* worker;
+    size_t size = (size_t)message->topicLength + 1 + message->propertiesLength + message->payloadLength;
+
+    if (pool->count == 0)
+    {
+        // Stopped
+        __atomic_fetch_add(&pool->dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    worker = &pool->workers[hashTopic(message->topic, message->topicLength) % pool->count];
+    if ((size > MQTT_WORKER_SLOT_SIZE) || (__atomic_load_n(&worker->count, __ATOMIC_ACQUIRE) >= pool->depth))
+    {
+        __atomic_fetch_add(&pool->dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    PubSubWorkerSlot_t* slot = &worker->slots[worker->tail];
+    slot->client = client;
+    slot->topicLength = message->topicLength;
+    slot->propertiesLength = message->propertiesLength;
+    slot->payloadLength = message->payloadLength;
+    slot->msgId = message->msgId;
+    slot->qos = message->qos;
+    slot->retain = message->retain;
+    slot->dup = message->dup;
+    memcpy(slot->data, message->topic, message->topicLength);
+    slot->data[message->topicLength] = 0;
+    if (message->propertiesLength > 0)
+    {
+        memcpy(&slot->data[message->topicLength + 1], message->properties, message->propertiesLength);
+    }
+    memcpy(&slot->data[message->topicLength + 1 + message->propertiesLength], message->payload, message->payloadLength);
+    worker->tail = (worker->tail + 1) % pool->depth;
+
+    pthread_mutex_lock(&worker->lock);
+    __atomic_store_n(&worker->count, worker->count + 1, __ATOMIC_RELEASE);
+    if (worker->count == 1)
+    {
+        pthread_cond_signal(&worker->filled);
+    }
+    pthread_mutex_unlock(&worker->lock);
+}
+
+/******************************************************************************
+ * Function implementation
+ *****************************************************************************/
+bool PubSubWorkers_start(PubSubWorkers_t* self, PubSubWorker_t* workers, size_t count, PubSubWorkerSlot_t* slots, size_t depth, fpMessageCallback_t callback)
+{
+    size_t i;
+
+    if ((count == 0) || (depth == 0) || (callback == NULL))
+    {
+        return false;
+    }
+    memset(self, 0, sizeof(*self));
+    self->base.ready = poolReady;
+    self->base.dispatch = poolDispatch;
+    self->workers = workers;
+    self->depth = depth;
+    self->callback = callback;
+    self->running = true;
+    for (i = 0; i < count; i++)
+    {
+        PubSubWorker_t* worker = &workers[i];
+        memset(worker, 0, sizeof(*worker));
+        worker->pool = self;
+        worker->slots = &slots[i * depth];
+        pthread_mutex_init(&worker->lock, NULL);
+        pthread_cond_init(&worker->filled, NULL);
+        if (pthread_create(&worker->thread, NULL, run, worker) != 0)
+        {
+            pthread_cond_destroy(&worker->filled);
+            pthread_mutex_destroy(&worker->lock);
+            PubSubWorkers_stop(self);
+            return false;
+        }
+        self->count = i + 1;
+    }
+    return true;
+}
+
+void PubSubWorkers_setNotify(PubSubWorkers_t* self, fpQueueNotify_t notify, void* context)
+{
+    self->notify = notify;
+    self->notifyContext = context;
+}
+
+void PubSubWorkers_stop(PubSubWorkers_t* self)
+{
+    size_t i;
+
+    __atomic_store_n(&self->running, false, __ATOMIC_RELEASE);
+    for (i = 0; i < self->count; i++)
+    {
+        PubSubWorker_t* worker = &self->workers[i];
+        pthread_mutex_lock(&worker->lock);
+        pthread_cond_broadcast(&worker->filled);
+        pthread_mutex_unlock(&worker->lock);
+    }
+    for (i = 0; i < self->count; i++)
+    {
+        PubSubWorker_t* worker = &self->workers[i];
+        pthread_join(worker->thread, NULL);
+        pthread_cond_destroy(&worker->filled);
+        pthread_mutex_destroy(&worker->lock);
+    }
+    self->count = 0;
+}
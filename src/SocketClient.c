@@ -0,0 +1,459 @@
+/*
+ SocketClient.c - Non-blocking POSIX TCP implementation of Client_t.
+*/
+
+#include "SocketClient.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <netdb.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+#define SOCKET(c)   ((SocketClient_t*)(c))
+
+/******************************************************************************
+ * Private Function Prototypes
+ *****************************************************************************/
+static int     openSocket  (SocketClient_t* self, const struct sockaddr* addr, socklen_t len);
+static int     fill        (SocketClient_t* self);
+static size_t  queue       (SocketClient_t* self, const uint8_t* buf, size_t size);
+static bool    sendRest    (SocketClient_t* self, const struct iovec* iov, int count, size_t* sent);
+static unsigned long nowMs (void);
+static void    closeSocket (SocketClient_t* self);
+
+static int     clientConnectIP   (Client_t* c, IPAddress_t ip, uint16_t port);
+static int     clientConnectHost (Client_t* c, const char* host, uint16_t port);
+static uint8_t clientConnected   (Client_t* c);
+static size_t  clientWrite       (Client_t* c, uint8_t b);
+static size_t  clientWriteMulti  (Client_t* c, const uint8_t* buf, size_t size);
+static size_t  clientWriteVec    (Client_t* c, const struct iovec* iov, int count);
+static int     clientAvailable   (Client_t* c);
+static int     clientRead        (Client_t* c);
+static int     clientReadMulti   (Client_t* c, uint8_t* buf, size_t size);
+static int     clientPeek        (Client_t* c);
+static void    clientFlush       (Client_t* c);
+static void    clientStop        (Client_t* c);
+static int     clientWait        (Client_t* c, unsigned long timeoutMs);
+
+/******************************************************************************
+ * Private Function Implementation
+ *****************************************************************************/
+// starts a non-blocking connect; success means connected or in progress
+static int openSocket(SocketClient_t* self, const struct sockaddr* addr, socklen_t len)
+{
+    int one = 1;
+
+    closeSocket(self);
+    self->fd = socket(addr->sa_family, SOCK_STREAM, 0);
+    if (self->fd < 0)
+    {
+        return 0;
+    }
+    self->generation++;
+    fcntl(self->fd, F_SETFL, fcntl(self->fd, F_GETFL, 0) | O_NONBLOCK);
+    setsockopt(self->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    if ((connect(self->fd, addr, len) != 0) && (errno != EINPROGRESS))
+    {
+        closeSocket(self);
+        return 0;
+    }
+    self->open = true;
+    return 1;
+}
+
+// refills the empty receive buffer with one recv, returns the bytes buffered
+static int fill(SocketClient_t* self)
+{
+    if (self->rxHead != self->rxTail)
+    {
+        return self->rxTail - self->rxHead;
+    }
+    self->rxHead = self->rxTail = 0;
+    if (!self->open)
+    {
+        return 0;
+    }
+    ssize_t rc = recv(self->fd, self->rx, sizeof(self->rx), 0);
+    if (rc > 0)
+    {
+        self->rxTail = rc;
+        return rc;
+    }
+    if ((rc == 0) || ((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR)))
+    {
+        // Peer closed or error: buffered data stays readable
+        self->open = false;
+    }
+    return 0;
+}
+
+// keeps what the socket did not take, returns the bytes accepted
+static size_t queue(SocketClient_t* self, const uint8_t* buf, size_t size)
+{
+    if (self->txHead > 0)
+    {
+        memmove(self->tx, &self->tx[self->txHead], self->txTail - self->txHead);
+        self->txTail -= self->txHead;
+        self->txHead = 0;
+    }
+    if (size > sizeof(self->tx) - self->txTail)
+    {
+        size = sizeof(self->tx) - self->txTail;
+    }
+    memcpy(&self->tx[self->txTail], buf, size);
+    self->txTail += size;
+    return size;
+}
+
+// sends the segments past the first *sent bytes as far as the socket takes
+// them without waiting, false when the connection failed
+static bool sendRest(SocketClient_t* self, const struct iovec* iov, int count, size_t* sent)
+{
+    size_t skip = *sent;
+    int i;
+
+    for (i = 0; i < count; i++)
+    {
+        size_t len = iov[i].iov_len;
+        while (skip < len)
+        {
+            ssize_t rc = send(self->fd, (const uint8_t*)iov[i].iov_base + skip, len - skip, MSG_NOSIGNAL);
+            if (rc <= 0)
+            {
+                return (rc < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR));
+            }
+            skip += rc;
+            *sent += rc;
+        }
+        skip -= len;
+    }
+    return true;
+}
+
+static unsigned long nowMs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (unsigned long)ts.tv_sec * 1000UL + ts.tv_nsec / 1000000L;
+}
+
+static void closeSocket(SocketClient_t* self)
+{
+    if (self->fd >= 0)
+    {
+        close(self->fd);
+    }
+    self->fd = -1;
+    self->open = false;
+    self->rxHead = self->rxTail = 0;
+    self->txHead = self->txTail = 0;
+}
+
+static int clientConnectIP(Client_t* c, IPAddress_t ip, uint16_t port)
+{
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    memcpy(&addr.sin_addr, ip, 4);
+    return openSocket(SOCKET(c), (struct sockaddr*)&addr, sizeof(addr));
+}
+
+static int clientConnectHost(Client_t* c, const char* host, uint16_t port)
+{
+    struct addrinfo hints;
+    struct addrinfo* res;
+    struct addrinfo* ai;
+    char service[6];
+    int rc = 0;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(service, sizeof(service), "%u", port);
+    if (getaddrinfo(host, service, &hints, &res) != 0)
+    {
+        return 0;
+    }
+    // The first address whose connect does not fail at once
+    for (ai = res; (ai != NULL) && (rc == 0); ai = ai->ai_next)
+    {
+        rc = openSocket(SOCKET(c), ai->ai_addr, ai->ai_addrlen);
+    }
+    freeaddrinfo(res);
+    return rc;
+}
+
+static uint8_t clientConnected(Client_t* c)
+{
+    SocketClient_t* self = SOCKET(c);
+    return self->open || (self->rxHead != self->rxTail);
+}
+
+static size_t clientWrite(Client_t* c, uint8_t b)
+{
+    return clientWriteMulti(c, &b, 1);
+}
+
+static size_t clientWriteMulti(Client_t* c, const uint8_t* buf, size_t size)
+{
+    struct iovec iov;
+    iov.iov_base = (void*)buf;
+    iov.iov_len = size;
+    return clientWriteVec(c, &iov, 1);
+}
+
+// takes all of the segments or none, so a frame is never cut short: sends
+// directly when nothing is queued and queues the rest to keep the order, for
+// flush() to push out. Only a frame larger than the send buffer waits, for
+// the socket to take the difference, at most writeTimeout in all; it drops
+// the connection if the socket stalls. Without a timeout such a frame is
+// refused.
+static size_t clientWriteVec(Client_t* c, const struct iovec* iov, int count)
+{
+    SocketClient_t* self = SOCKET(c);
+    size_t sent = 0;
+    size_t total = 0;
+    unsigned long start;
+    int i;
+
+    if (!self->open)
+    {
+        return 0;
+    }
+    for (i = 0; i < count; i++)
+    {
+        total += iov[i].iov_len;
+    }
+    clientFlush(c);
+    if (self->txHead != self->txTail)
+    {
+        if (total > sizeof(self->tx) - (self->txTail - self->txHead))
+        {
+            return 0;
+        }
+    }
+    else if ((total > sizeof(self->tx)) && (self->writeTimeout == 0))
+    {
+        return 0;
+    }
+    else
+    {
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = (struct iovec*)iov;
+        msg.msg_iovlen = count;
+        ssize_t rc = sendmsg(self->fd, &msg, MSG_NOSIGNAL);
+        if (rc > 0)
+        {
+            sent = rc;
+        }
+        else if ((rc < 0) && (errno != EAGAIN) && (errno != EWOULDBLOCK) &&
+                 (errno != EINTR) && (errno != ENOTCONN))
+        {
+            self->open = false;
+            return 0;
+        }
+        start = nowMs();
+        while (total - sent > sizeof(self->tx))
+        {
+            struct pollfd pfd;
+            unsigned long spent = nowMs() - start;
+            pfd.fd = self->fd;
+            pfd.events = POLLOUT;
+            pfd.revents = 0;
+            rc = (spent < self->writeTimeout)
+                ? poll(&pfd, 1, (self->writeTimeout - spent > INT_MAX) ? INT_MAX : (int)(self->writeTimeout - spent))
+                : 0;
+            if ((rc < 0) && (errno == EINTR))
+            {
+                continue;
+            }
+            if ((rc <= 0) || !sendRest(self, iov, count, &sent))
+            {
+                // Part of the frame is out, the rest can never follow
+                self->open = false;
+                return 0;
+            }
+        }
+    }
+
+    for (i = 0; i < count; i++)
+    {
+        size_t len = iov[i].iov_len;
+        if (sent >= len)
+        {
+            sent -= len;
+            continue;
+        }
+        queue(self, (const uint8_t*)iov[i].iov_base + sent, len - sent);
+        sent = 0;
+    }
+    return total;
+}
+
+static int clientAvailable(Client_t* c)
+{
+    return fill(SOCKET(c));
+}
+
+static int clientRead(Client_t* c)
+{
+    SocketClient_t* self = SOCKET(c);
+    if (fill(self) == 0)
+    {
+        return -1;
+    }
+    return self->rx[self->rxHead++];
+}
+
+// large reads on an empty buffer go straight into the caller's buffer
+static int clientReadMulti(Client_t* c, uint8_t* buf, size_t size)
+{
+    SocketClient_t* self = SOCKET(c);
+    size_t buffered = self->rxTail - self->rxHead;
+
+    if ((buffered == 0) && (size >= sizeof(self->rx)) && self->open)
+    {
+        ssize_t rc = recv(self->fd, buf, size, 0);
+        if (rc > 0)
+        {
+            return rc;
+        }
+        if ((rc == 0) || ((errno != EAGAIN) && (errno != EWOULDBLOCK) && (errno != EINTR)))
+        {
+            self->open = false;
+        }
+        return 0;
+    }
+
+    buffered = fill(self);
+    if (size > buffered)
+    {
+        size = buffered;
+    }
+    memcpy(buf, &self->rx[self->rxHead], size);
+    self->rxHead += size;
+    return size;
+}
+
+static int clientPeek(Client_t* c)
+{
+    SocketClient_t* self = SOCKET(c);
+    if (fill(self) == 0)
+    {
+        return -1;
+    }
+    return self->rx[self->rxHead];
+}
+
+// pushes queued data out as far as the socket takes it, without waiting
+static void clientFlush(Client_t* c)
+{
+    SocketClient_t* self = SOCKET(c);
+    while (self->open && (self->txHead != self->txTail))
+    {
+        ssize_t rc = send(self->fd, &self->tx[self->txHead], self->txTail - self->txHead, MSG_NOSIGNAL);
+        if (rc > 0)
+        {
+            self->txHead += rc;
+        }
+        else
+        {
+            if ((rc < 0) && (errno != EAGAIN) && (errno != EWOULDBLOCK) &&
+                (errno != EINTR) && (errno != ENOTCONN))
+            {
+                self->open = false;
+            }
+            break;
+        }
+    }
+    if (self->txHead == self->txTail)
+    {
+        self->txHead = self->txTail = 0;
+    }
+}
+
+static void clientStop(Client_t* c)
+{
+    SocketClient_t* self = SOCKET(c);
+    clientFlush(c);
+    closeSocket(self);
+}
+
+// sleeps in poll() until the socket is readable, pushing queued data out if
+// it becomes writable meanwhile
+static int clientWait(Client_t* c, unsigned long timeoutMs)
+{
+    SocketClient_t* self = SOCKET(c);
+    struct pollfd pfd;
+    int rc;
+
+    if (self->rxHead != self->rxTail)
+    {
+        return 1;
+    }
+    if (!self->open)
+    {
+        return -1;
+    }
+    pfd.fd = self->fd;
+    pfd.events = POLLIN | ((self->txHead != self->txTail) ? POLLOUT : 0);
+    pfd.revents = 0;
+    rc = poll(&pfd, 1, (timeoutMs > INT_MAX) ? INT_MAX : (int)timeoutMs);
+    if (rc < 0)
+    {
+        return (errno == EINTR) ? 0 : -1;
+    }
+    if (pfd.revents & POLLOUT)
+    {
+        clientFlush(c);
+    }
+    return (pfd.revents & (POLLIN | POLLERR | POLLHUP)) ? 1 : 0;
+}
+
+/******************************************************************************
+ * Function implementation
+ *****************************************************************************/
+void SocketClient_init(SocketClient_t* self)
+{
+    memset(self, 0, sizeof(*self));
+    self->fd = -1;
+    self->writeTimeout = SOCKETCLIENT_WRITE_TIMEOUT;
+    self->base.connectIP   = clientConnectIP;
+    self->base.connectHost = clientConnectHost;
+    self->base.connected   = clientConnected;
+    self->base.write       = clientWrite;
+    self->base.writeMulti  = clientWriteMulti;
+    self->base.available   = clientAvailable;
+    self->base.read        = clientRead;
+    self->base.readMulti   = clientReadMulti;
+    self->base.peek        = clientPeek;
+    self->base.flush       = clientFlush;
+    self->base.stop        = clientStop;
+    self->base.writeVec    = clientWriteVec;
+    self->base.wait        = clientWait;
+}
+
+int SocketClient_fd(SocketClient_t* self)
+{
+    return self->fd;
+}
+
+bool SocketClient_pending(SocketClient_t* self)
+{
+    return (self->txHead != self->txTail);
+}
+
+void SocketClient_setWriteTimeout(SocketClient_t* self, unsigned long timeoutMs)
+{
+    self->writeTimeout = timeoutMs;
+}
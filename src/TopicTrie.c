@@ -0,0 +1,427 @@
+/*
+ TopicTrie.c - Registry of subscription filters, one trie level per topic
+  level, with MQTT '+' and '#' wildcard matching.
+
+ Every node holds its children in a small open addressing table keyed by the
+ level string, with the wildcard children kept aside. Matching a topic costs
+ one table lookup per topic level (plus the wildcard branches), regardless of
+ how many filters are registered.
+*/
+
+#include "TopicTrie.h"
+#include <string.h>
+
+// bytes taken by a node and its level string
+#define NODE_SIZE(length)   (sizeof(TopicTrieNode_t) + (length) + 1)
+
+/******************************************************************************
+ * Private Function Prototypes
+ *****************************************************************************/
+static uint32_t         hashLevel   (const char* level, uint16_t length);
+static TopicTrieNode_t* newNode     (TopicTrie_t* self, TopicTrieNode_t* parent, const char* level, uint16_t length);
+static TopicTrieNode_t* findChild   (const TopicTrieNode_t* node, const char* level, uint16_t length, uint32_t* index);
+static bool             addChild    (TopicTrie_t* self, TopicTrieNode_t* node, TopicTrieNode_t* child);
+static void             removeChild (TopicTrieNode_t* node, TopicTrieNode_t* child);
+static TopicTrieNode_t* findNode    (TopicTrie_t* self, const char* filter, bool create);
+static void             prune       (TopicTrie_t* self, TopicTrieNode_t* node);
+static int              matchLevel  (const TopicTrieNode_t* node, const char* level, bool first, fpTopicTrieVisit_t visit, void* context);
+static void             walkNode    (const TopicTrieNode_t* node, fpTopicTrieVisit_t visit, void* context);
+static void             releaseNode (TopicTrie_t* self, TopicTrieNode_t* node);
+static void             freeNode    (TopicTrie_t* self, TopicTrieNode_t* node);
+
+/******************************************************************************
+ * Private Function Implementation
+ *****************************************************************************/
+// FNV-1a
+static uint32_t hashLevel(const char* level, uint16_t length)
+{
+    uint32_t h = 2166136261UL;
+    uint16_t i;
+    for (i = 0; i < length; i++)
+    {
+        h = (h ^ (uint8_t)level[i]) * 16777619UL;
+    }
+    return h;
+}
+
+static TopicTrieNode_t* newNode(TopicTrie_t* self, TopicTrieNode_t* parent, const char* level, uint16_t length)
+{
+    TopicTrieNode_t* node = PubSubAlloc_alloc(self->allocator, NODE_SIZE(length));
+    if (node != NULL)
+    {
+        memset(node, 0, sizeof(TopicTrieNode_t));
+        node->parent = parent;
+        node->length = length;
+        memcpy(node->level, level, length);
+        node->level[length] = 0;
+    }
+    return node;
+}
+
+// looks up an exact-match child; index receives the slot it occupies or the
+// free slot where it would go
+static TopicTrieNode_t* findChild(const TopicTrieNode_t* node, const char* level, uint16_t length, uint32_t* index)
+{
+    if (node->childCapacity == 0)
+    {
+        return NULL;
+    }
+    uint32_t mask = node->childCapacity - 1;
+    uint32_t i = hashLevel(level, length) & mask;
+    while (node->children[i] != NULL)
+    {
+        TopicTrieNode_t* child = node->children[i];
+        if ((child->length == length) && (memcmp(child->level, level, length) == 0))
+        {
+            if (index != NULL)
+            {
+                *index = i;
+            }
+            return child;
+        }
+        i = (i + 1) & mask;
+    }
+    if (index != NULL)
+    {
+        *index = i;
+    }
+    return NULL;
+}
+
+static bool addChild(TopicTrie_t* self, TopicTrieNode_t* node, TopicTrieNode_t* child)
+{
+    uint32_t index;
+
+    // Keep the table at most 3/4 full
+    if ((node->childCount + 1) * 4 > node->childCapacity * 3)
+    {
+        uint32_t capacity = node->childCapacity ? node->childCapacity * 2 : 4;
+        TopicTrieNode_t** old = node->children;
+        uint32_t oldCapacity = node->childCapacity;
+        uint32_t i;
+
+        node->children = PubSubAlloc_alloc(self->allocator, capacity * sizeof(TopicTrieNode_t*));
+        if (node->children == NULL)
+        {
+            node->children = old;
+            return false;
+        }
+        memset(node->children, 0, capacity * sizeof(TopicTrieNode_t*));
+        node->childCapacity = capacity;
+        for (i = 0; i < oldCapacity; i++)
+        {
+            if (old[i] != NULL)
+            {
+                findChild(node, old[i]->level, old[i]->length, &index);
+                node->children[index] = old[i];
+            }
+        }
+        PubSubAlloc_free(self->allocator, old, oldCapacity * sizeof(TopicTrieNode_t*));
+    }
+
+    findChild(node, child->level, child->length, &index);
+    node->children[index] = child;
+    node->childCount++;
+    return true;
+}
+
+// linear probing deletion: shift back the entries that follow in the run
+static void removeChild(TopicTrieNode_t* node, TopicTrieNode_t* child)
+{
+    uint32_t mask = node->childCapacity - 1;
+    uint32_t i;
+    uint32_t j;
+
+    if (findChild(node, child->level, child->length, &i) != child)
+    {
+        return;
+    }
+    node->children[i] = NULL;
+    node->childCount--;
+
+    j = (i + 1) & mask;
+    while (node->children[j] != NULL)
+    {
+        TopicTrieNode_t* moved = node->children[j];
+        uint32_t home;
+        node->children[j] = NULL;
+        findChild(node, moved->level, moved->length, &home);
+        node->children[home] = moved;
+        j = (j + 1) & mask;
+    }
+}
+
+// walks the filter level by level, optionally creating missing nodes
+static TopicTrieNode_t* findNode(TopicTrie_t* self, const char* filter, bool create)
+{
+    const char* level = filter;
+
+    if (self->root == NULL)
+    {
+        if (!create)
+        {
+            return NULL;
+        }
+        self->root = newNode(self, NULL, "", 0);
+        if (self->root == NULL)
+        {
+            return NULL;
+        }
+    }
+
+    TopicTrieNode_t* node = self->root;
+    while (node != NULL)
+    {
+        const char* end = strchr(level, '/');
+        uint16_t length = end ? (uint16_t)(end - level) : (uint16_t)strlen(level);
+        TopicTrieNode_t** wildcard = NULL;
+        TopicTrieNode_t* child;
+
+        if ((length == 1) && (level[0] == '+'))
+        {
+            wildcard = &node->plus;
+        }
+        else if ((length == 1) && (level[0] == '#'))
+        {
+            if (end != NULL)
+            {
+                // '#' must be the last level
+                return NULL;
+            }
+            wildcard = &node->hash;
+        }
+        else if ((memchr(level, '+', length) != NULL) || (memchr(level, '#', length) != NULL))
+        {
+            // Wildcards must occupy a whole level
+            return NULL;
+        }
+
+        child = wildcard ? *wildcard : findChild(node, level, length, NULL);
+        if ((child == NULL) && create)
+        {
+            child = newNode(self, node, level, length);
+            if (child == NULL)
+            {
+                return NULL;
+            }
+            if (wildcard != NULL)
+            {
+                *wildcard = child;
+            }
+            else if (!addChild(self, node, child))
+            {
+                releaseNode(self, child);
+                return NULL;
+            }
+        }
+        node = child;
+        if (end == NULL)
+        {
+            break;
+        }
+        level = end + 1;
+    }
+    return node;
+}
+
+// frees nodes that no longer lead to any filter, walking up towards the root
+static void prune(TopicTrie_t* self, TopicTrieNode_t* node)
+{
+    while ((node != NULL) && (node != self->root) &&
+           !node->subscribed && (node->childCount == 0) &&
+           (node->plus == NULL) && (node->hash == NULL))
+    {
+        TopicTrieNode_t* parent = node->parent;
+        if (parent->plus == node)
+        {
+            parent->plus = NULL;
+        }
+        else if (parent->hash == node)
+        {
+            parent->hash = NULL;
+        }
+        else
+        {
+            removeChild(parent, node);
+        }
+        releaseNode(self, node);
+        node = parent;
+    }
+}
+
+// level is the remaining part of the topic, or NULL once every level has been
+// consumed. Topics starting with '$' are not matched by leading wildcards.
+static int matchLevel(const TopicTrieNode_t* node, const char* level, bool first, fpTopicTrieVisit_t visit, void* context)
+{
+    int count = 0;
+    bool wildcards = !(first && (level != NULL) && (level[0] == '$'));
+
+    // "a/#" also matches "a" itself
+    if (wildcards && (node->hash != NULL) && node->hash->subscribed)
+    {
+        visit(node->hash, context);
+        count++;
+    }
+    if (level == NULL)
+    {
+        if (node->subscribed)
+        {
+            visit(node, context);
+            count++;
+        }
+        return count;
+    }
+
+    const char* end = strchr(level, '/');
+    uint16_t length = end ? (uint16_t)(end - level) : (uint16_t)strlen(level);
+    const char* next = end ? end + 1 : NULL;
+    const TopicTrieNode_t* child = findChild(node, level, length, NULL);
+
+    if (child != NULL)
+    {
+        count += matchLevel(child, next, false, visit, context);
+    }
+    if (wildcards && (node->plus != NULL))
+    {
+        count += matchLevel(node->plus, next, false, visit, context);
+    }
+    return count;
+}
+
+static void walkNode(const TopicTrieNode_t* node, fpTopicTrieVisit_t visit, void* context)
+{
+    uint32_t i;
+    if (node == NULL)
+    {
+        return;
+    }
+    if (node->subscribed)
+    {
+        visit(node, context);
+    }
+    for (i = 0; i < node->childCapacity; i++)
+    {
+        walkNode(node->children[i], visit, context);
+    }
+    walkNode(node->plus, visit, context);
+    walkNode(node->hash, visit, context);
+}
+
+// frees one node and its child table, not the children
+static void releaseNode(TopicTrie_t* self, TopicTrieNode_t* node)
+{
+    PubSubAlloc_free(self->allocator, node->children, node->childCapacity * sizeof(TopicTrieNode_t*));
+    PubSubAlloc_free(self->allocator, node, NODE_SIZE(node->length));
+}
+
+static void freeNode(TopicTrie_t* self, TopicTrieNode_t* node)
+{
+    uint32_t i;
+    if (node == NULL)
+    {
+        return;
+    }
+    for (i = 0; i < node->childCapacity; i++)
+    {
+        freeNode(self, node->children[i]);
+    }
+    freeNode(self, node->plus);
+    freeNode(self, node->hash);
+    releaseNode(self, node);
+}
+
+/******************************************************************************
+ * Function implementation
+ *****************************************************************************/
+// Registers or replaces the handler for a filter. Fails for malformed filters
+// or when memory runs out.
+bool TopicTrie_insert(TopicTrie_t* self, const char* filter, fpTopicHandler_t handler, uint8_t qos)
+{
+    TopicTrieNode_t* node = findNode(self, filter, true);
+    if (node == NULL)
+    {
+        return false;
+    }
+    if (!node->subscribed)
+    {
+        node->subscribed = true;
+        self->count++;
+    }
+    node->handler = handler;
+    node->qos = qos;
+    return true;
+}
+
+bool TopicTrie_remove(TopicTrie_t* self, const char* filter)
+{
+    TopicTrieNode_t* node = findNode(self, filter, false);
+    if ((node == NULL) || !node->subscribed)
+    {
+        return false;
+    }
+    node->subscribed = false;
+    node->handler = NULL;
+    self->count--;
+    prune(self, node);
+    return true;
+}
+
+// Calls visit for every registered filter matching topic, returns how many
+// matched
+int TopicTrie_match(const TopicTrie_t* self, const char* topic, fpTopicTrieVisit_t visit, void* context)
+{
+    if ((self->root == NULL) || (self->count == 0))
+    {
+        return 0;
+    }
+    return matchLevel(self->root, topic, true, visit, context);
+}
+
+const TopicTrieNode_t* TopicTrie_find(TopicTrie_t* self, const char* filter)
+{
+    TopicTrieNode_t* node = findNode(self, filter, false);
+    return ((node != NULL) && node->subscribed) ? node : NULL;
+}
+
+void TopicTrie_walk(const TopicTrie_t* self, fpTopicTrieVisit_t visit, void* context)
+{
+    if (self->count > 0)
+    {
+        walkNode(self->root, visit, context);
+    }
+}
+
+size_t TopicTrie_filter(const TopicTrieNode_t* node, char* buf, size_t size)
+{
+    const TopicTrieNode_t* n;
+    size_t length = 0;
+
+    // Every level below the root plus its separator, or the terminating NUL
+    for (n = node; n->parent != NULL; n = n->parent)
+    {
+        length += n->length + 1;
+    }
+    if ((length == 0) || (length > size))
+    {
+        return 0;
+    }
+    size_t pos = length - 1;
+    buf[pos] = 0;
+    for (n = node; n->parent != NULL; n = n->parent)
+    {
+        pos -= n->length;
+        memcpy(&buf[pos], n->level, n->length);
+        if (n->parent->parent != NULL)
+        {
+            buf[--pos] = '/';
+        }
+    }
+    return length - 1;
+}
+
+void TopicTrie_free(TopicTrie_t* self)
+{
+    freeNode(self, self->root);
+    self->root = NULL;
+    self->count = 0;
+}
@@ -0,0 +1,151 @@
+/*
+ test_socket.c - SocketClient_t against a loopback listener in the same
+  process: connect, both directions, queued writes and refused frames.
+*/
+
+#include "SocketClient.h"
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#define CHECK(cond) \
+    do { if (!(cond)) { printf("%s:%d: %s\n", __FILE__, __LINE__, #cond); return 1; } } while (0)
+
+#define FRAME_SIZE  1000
+#define MAX_FRAMES  100000
+
+static uint8_t data[3 * SOCKETCLIENT_TX_SIZE];
+
+// receives exactly size bytes on the blocking fd
+static int receiveAll(int fd, uint8_t* buf, size_t size)
+{
+    size_t done = 0;
+    while (done < size)
+    {
+        ssize_t rc = recv(fd, &buf[done], size - done, 0);
+        if (rc <= 0)
+        {
+            return 0;
+        }
+        done += rc;
+    }
+    return 1;
+}
+
+int main(void)
+{
+    static SocketClient_t client;
+    static uint8_t buf[3 * SOCKETCLIENT_TX_SIZE];
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    int small = 4096;
+    size_t i;
+
+    for (i = 0; i < sizeof(data); i++)
+    {
+        data[i] = (uint8_t)(i * 7);
+    }
+
+    int listener = socket(AF_INET, SOCK_STREAM, 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    CHECK(bind(listener, (struct sockaddr*)&addr, sizeof(addr)) == 0);
+    CHECK(listen(listener, 1) == 0);
+    CHECK(getsockname(listener, (struct sockaddr*)&addr, &len) == 0);
+
+    // Connect by name and accept
+    SocketClient_init(&client);
+    CHECK(client.base.connectHost(&client.base, "127.0.0.1", ntohs(addr.sin_port)) == 1);
+    int peer = accept(listener, NULL, NULL);
+    CHECK(peer >= 0);
+    CHECK(client.base.connected(&client.base));
+
+    // Client to peer
+    CHECK(client.base.writeMulti(&client.base, (const uint8_t*)"hello", 5) == 5);
+    CHECK(receiveAll(peer, buf, 5) && (memcmp(buf, "hello", 5) == 0));
+
+    // Peer to client, through every read function
+    CHECK(send(peer, data, sizeof(data), 0) == (ssize_t)sizeof(data));
+    size_t got = 0;
+    while (got < sizeof(data))
+    {
+        CHECK(client.base.wait(&client.base, 1000) == 1);
+        CHECK(client.base.available(&client.base) > 0);
+        CHECK(client.base.peek(&client.base) == data[got]);
+        int b = client.base.read(&client.base);
+        CHECK(b == data[got]);
+        buf[got++] = (uint8_t)b;
+        got += client.base.readMulti(&client.base, &buf[got], sizeof(data) - got);
+    }
+    CHECK(memcmp(buf, data, sizeof(data)) == 0);
+
+    // A frame larger than the send buffer: refused without a write timeout,
+    // sent whole with one
+    struct iovec iov[2];
+    iov[0].iov_base = data;
+    iov[0].iov_len = 10;
+    iov[1].iov_base = &data[10];
+    iov[1].iov_len = sizeof(data) - 10;
+    SocketClient_setWriteTimeout(&client, 0);
+    CHECK(client.base.writeVec(&client.base, iov, 2) == 0);
+    SocketClient_setWriteTimeout(&client, SOCKETCLIENT_WRITE_TIMEOUT);
+    CHECK(client.base.writeVec(&client.base, iov, 2) == sizeof(data));
+    CHECK(receiveAll(peer, buf, sizeof(data)) && (memcmp(buf, data, sizeof(data)) == 0));
+
+    // Writes never block: once the socket is full the rest is queued, and
+    // then frames are refused whole rather than cut short
+    setsockopt(SocketClient_fd(&client), SOL_SOCKET, SO_SNDBUF, &small, sizeof(small));
+    setsockopt(peer, SOL_SOCKET, SO_RCVBUF, &small, sizeof(small));
+    size_t accepted = 0;
+    size_t frames;
+    for (frames = 0; frames < MAX_FRAMES; frames++)
+    {
+        size_t rc = client.base.writeMulti(&client.base, &data[frames % 100], FRAME_SIZE);
+        if (rc == 0)
+        {
+            break;
+        }
+        CHECK(rc == FRAME_SIZE);
+        accepted++;
+    }
+    CHECK(frames < MAX_FRAMES);
+    CHECK(SocketClient_pending(&client));
+    CHECK(client.base.connected(&client.base));
+
+    // The peer reads everything while flush() pushes out the queue
+    size_t frame = 0;
+    size_t fill = 0;
+    for (i = 0; (frame < accepted) && (i < 10 * MAX_FRAMES); i++)
+    {
+        client.base.flush(&client.base);
+        ssize_t rc = recv(peer, &buf[fill], FRAME_SIZE - fill, MSG_DONTWAIT);
+        if (rc > 0)
+        {
+            fill += rc;
+        }
+        if (fill == FRAME_SIZE)
+        {
+            CHECK(memcmp(buf, &data[frame % 100], FRAME_SIZE) == 0);
+            frame++;
+            fill = 0;
+        }
+    }
+    CHECK(frame == accepted);
+    CHECK(!SocketClient_pending(&client));
+
+    // Peer closes: reads end and the client reports the connection gone
+    close(peer);
+    CHECK(client.base.wait(&client.base, 1000) == 1);
+    CHECK(client.base.read(&client.base) == -1);
+    CHECK(!client.base.connected(&client.base));
+
+    client.base.stop(&client.base);
+    close(listener);
+    printf("socket ok\n");
+    return 0;
+}
@@ -0,0 +1,139 @@
+/*
+ test_subscribe.c - SUBSCRIBE and UNSUBSCRIBE size checks against a packet
+  buffer allocated at exactly the configured size.
+*/
+
+#include "PubSubClient.h"
+#include "LoopbackClient.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CHECK(cond) \
+    do { if (!(cond)) { printf("%s:%d: %s\n", __FILE__, __LINE__, #cond); return 1; } } while (0)
+
+#define PACKET_SIZE 64
+#define GUARD_SIZE  16
+#define GUARD_BYTE  0xA5
+#define MAX_BLOCKS  8
+
+#if MQTT_VERSION == MQTT_VERSION_5
+#define PROPERTIES  1
+#else
+#define PROPERTIES  0
+#endif
+
+// Session buffers with guard bytes right behind them
+typedef struct
+{
+    PubSubAllocator_t base;
+    uint8_t* blocks[MAX_BLOCKS];
+    size_t sizes[MAX_BLOCKS];
+    size_t count;
+} GuardAllocator_t;
+
+static void* guardAlloc(PubSubAllocator_t* allocator, size_t size)
+{
+    GuardAllocator_t* self = (GuardAllocator_t*)allocator;
+    uint8_t* block;
+    if (self->count == MAX_BLOCKS)
+    {
+        return NULL;
+    }
+    block = malloc(size + GUARD_SIZE);
+    if (block != NULL)
+    {
+        memset(&block[size], GUARD_BYTE, GUARD_SIZE);
+        self->blocks[self->count] = block;
+        self->sizes[self->count++] = size;
+    }
+    return block;
+}
+
+static void guardFree(PubSubAllocator_t* allocator, void* ptr, size_t size)
+{
+    free(ptr);
+}
+
+// true while nothing was written past a block
+static int guardsIntact(GuardAllocator_t* self)
+{
+    size_t i;
+    size_t k;
+    for (i = 0; i < self->count; i++)
+    {
+        for (k = 0; k < GUARD_SIZE; k++)
+        {
+            if (self->blocks[i][self->sizes[i] + k] != GUARD_BYTE)
+            {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+static unsigned long testMillis(void)
+{
+    return 0;
+}
+
+static void testCallback(char* topic, uint8_t* payload, unsigned int length)
+{
+}
+
+static char* topicOf(char* buf, size_t length)
+{
+    memset(buf, 't', length);
+    buf[length] = 0;
+    return buf;
+}
+
+int main(void)
+{
+    static PubSubClient_t client;
+    static LoopbackClient_t loopback;
+    static uint8_t rx[256];
+    static GuardAllocator_t guard = { { guardAlloc, guardFree } };
+    const uint8_t connack[4] = {MQTTCONNACK, 2, 0, 0};
+    uint8_t ip[4] = {127, 0, 0, 1};
+    PubSubConfig_t config;
+    char topic[PACKET_SIZE + 1];
+    // Fixed header with one length byte, msgId, properties, topic length
+    size_t longest = PACKET_SIZE - 5 - 2 - PROPERTIES - 2;
+
+    LoopbackClient_init(&loopback, rx, sizeof(rx));
+    PubSub_initIPCallback(&client, &loopback.base, testMillis, ip, 1883, testCallback);
+    memset(&config, 0, sizeof(config));
+    config.allocator = &guard.base;
+    config.packetSize = PACKET_SIZE;
+    CHECK(PubSub_configure(&client, &config));
+    LoopbackClient_push(&loopback, connack, sizeof(connack));
+    CHECK(PubSub_connectId(&client, "test"));
+
+    // SUBSCRIBE takes an options byte after the topic
+    size_t sent = loopback.txBytes;
+    CHECK(PubSub_subscribeQOS(&client, topicOf(topic, longest - 1), 1, 0));
+    CHECK(loopback.txBytes - sent == PACKET_SIZE - 4 + 1);
+    CHECK(!PubSub_subscribeQOS(&client, topicOf(topic, longest), 1, 0));
+    CHECK(guardsIntact(&guard));
+
+    // UNSUBSCRIBE does not
+    sent = loopback.txBytes;
+    CHECK(PubSub_unsubscribe(&client, topicOf(topic, longest), 0));
+    CHECK(loopback.txBytes - sent == PACKET_SIZE - 4 + 1);
+    CHECK(!PubSub_unsubscribe(&client, topicOf(topic, longest + 1), 0));
+    CHECK(guardsIntact(&guard));
+
+    // The address prefix counts against the same room
+    PubSub_setMyAddress(&client, "a", "b", "c");
+    size_t alen = strlen("a/b/c/");
+    CHECK(PubSub_subscribeQOS(&client, topicOf(topic, longest - 1 - alen), 0, 1));
+    CHECK(!PubSub_subscribeQOS(&client, topicOf(topic, longest - alen), 0, 1));
+    CHECK(PubSub_unsubscribe(&client, topicOf(topic, longest - alen), 1));
+    CHECK(guardsIntact(&guard));
+
+    PubSub_deinit(&client);
+    printf("subscribe ok\n");
+    return 0;
+}